@@ -6,11 +6,20 @@ extern "C" {
   #include "fermi-lite/fml.h"
 }
 
+#include <functional>
+
 #include "SeqLib/BamRecord.h"
 #include "SeqLib/UnalignedSequence.h"
+#include "SeqLib/FastqReader.h"
+#include "SeqLib/BamReader.h"
 
 namespace SeqLib {
 
+  /** Function called on each read corrected by BFC::CorrectStream, in input order.
+   * The read is only valid during the call.
+   */
+  typedef std::function<void(const UnalignedSequence& s)> CorrectedCallback;
+
 /** Class to perform error-correction using BFC algorithm
  *
  * BFC is designed and implemented by Heng Li (https://github.com/lh3/bfc). 
@@ -36,12 +45,14 @@ namespace SeqLib {
       sum_k = 0;
       tot_len = 0;
       m_seqs_size = 0;
+      m_mode = -1;
+      m_map = NULL;
+      m_map_len = 0;
     }
 
     ~BFC() {
       clear();
-      if (ch)
-	bfc_ch_destroy(ch);
+      clear_table();
     }
 
     /** Peform BFC error correction on the sequences stored in this object */
@@ -50,6 +61,25 @@ namespace SeqLib {
     /** Train the error corrector using the reads stored in this object */
     bool Train();
 
+    /** Write the trained k-mer table to a file, for LoadTable
+     * @param file Path of the table file to write
+     * @return True if able to write the table. False if not trained
+     */
+    bool WriteTable(const std::string& file) const;
+
+    /** Map a k-mer table written by WriteTable read-only into memory, in 
+     * place of Train.
+     *
+     * The hash tables point straight into the mapping, so nothing is 
+     * recounted or copied, and processes correcting shards of the same sample
+     * share one copy of the table in the page cache. Sets the k-mer size
+     * and kcov from the table.
+     * @param file Path of a table written by WriteTable
+     * @return True if successful
+     * @note Will delete the old table if already stored
+     */
+    bool LoadTable(const std::string& file);
+
     /** Add a sequence for either training or correction 
      * @param seq A sequence to be copied into this object (A, T, C, G)
      */
@@ -60,6 +90,43 @@ namespace SeqLib {
      */
     void SetKmer(int k) { kmer = k; }
 
+    /** Set the number of threads used for k-mer counting (Train) and 
+     * correction (ErrorCorrect, CorrectStream). Default 1
+     * @param n Number of threads
+     * @exception Throws invalid_argument if n < 1
+     */
+    void SetThreads(int n);
+
+    /** Return the number of threads used for training and correction */
+    int GetThreads() const { return bfc_opt.n_threads; }
+
+    /** Correct every read from a FASTA/FASTQ stream, without storing them.
+     *
+     * Reads are taken chunk_size at a time, and each chunk is corrected on 
+     * GetThreads() threads while the next chunk is read. Memory use is bounded
+     * by two chunks, so the input can be a whole-genome read set. The k-mer
+     * table must already be built by Train, typically from a sample of the
+     * reads (AddSequence, Train, then clear). Reads stored in this object are 
+     * not changed.
+     * @param r Open reader to take reads from until it is exhausted
+     * @param cb Called on each corrected read, on the calling thread, in input order
+     * @param chunk_size Number of reads per chunk
+     * @return Number of reads corrected
+     * @exception Throws runtime_error if not trained, invalid_argument if chunk_size is 0
+     */
+    size_t CorrectStream(FastqReader& r, const CorrectedCallback& cb, size_t chunk_size = 100000);
+
+    /** Correct every read from a BAM/SAM/CRAM stream, without storing them.
+     * See CorrectStream. Reads are corrected as stored in the file (ie the 
+     * reverse complement of the original read for reverse strand alignments).
+     * Records with no sequence are skipped.
+     * @param r Open reader to take reads from until it is exhausted
+     * @param cb Called on each corrected read, on the calling thread, in input order
+     * @param chunk_size Number of reads per chunk
+     * @return Number of reads corrected
+     */
+    size_t CorrectStream(BamReader& r, const CorrectedCallback& cb, size_t chunk_size = 100000);
+
     /** Correct a single new sequence not stored in object 
      * @param str Sequence of string to correct (ACTG)
      * @param q Quality score of sequence to correct 
@@ -139,6 +206,26 @@ namespace SeqLib {
     // do the actual read correction
     void correct_reads();
 
+    // correct n reads in place with the trained k-mer table
+    void correct_batch(fseq1_t* seqs, size_t n);
+
+    // kcov and correction thresholds from the k-mer table, once per Train
+    void set_coverage();
+
+    // correct a stream, with fill(chunk) returning false when it is exhausted
+    size_t correct_stream(const std::function<bool(UnalignedSequenceVector&)>& fill,
+			  const CorrectedCallback& cb, size_t chunk_size);
+
+    // peak of the k-mer histogram, or -1 if not computed
+    int m_mode;
+
+    // mapped table (LoadTable), or NULL
+    void* m_map;
+    size_t m_map_len;
+
+    // free the k-mer table, mapped or not
+    void clear_table();
+
     // 0 turns off filter uniq
     int flt_uniq; // from fml_correct call
     
@@ -33,6 +33,8 @@ class BWAWrapper {
    */
   BWAWrapper() { 
     idx = 0;
+    m_map = 0;
+    m_map_len = 0;
     copy_comment = false;
     memopt = mem_opt_init();
     memopt->flag |= MEM_F_SOFTCLIP;
@@ -40,8 +42,7 @@ class BWAWrapper {
 
   /** Destroy the BWAWrapper (deallocate index and options) */
   ~BWAWrapper() { 
-    if (idx)
-      bwa_idx_destroy(idx);
+    clear_index();
     if (memopt)
       free(memopt);
   }
@@ -76,6 +77,38 @@ class BWAWrapper {
   void AlignSequence(const UnalignedSequence& us, BamRecordVector& vec, bool hardclip,
           double keep_sec_with_frac_of_primary_score, int max_secondary) const;
 
+  /** Perform a BWA-MEM alignment of a batch of sequences across threads
+   * @param v Sequences to be aligned
+   * @param out Set to one BamRecordVector per sequence, in the same order as v
+   * @param hardclip Should the output BamRecord objects be hardclipped
+   * @param keep_sec_with_frac_of_primary_score Set a threshold for whether a secondary alignment should be output
+   * @param max_secondary Set a hard-limit on the number of secondary hits that will be reported
+   * @param nthreads Number of threads to align with, including the calling thread
+   * @note Ties for the primary alignment are broken by the position of the sequence in v,
+   * so output does not depend on nthreads (but may differ from AlignSequence, which breaks them randomly)
+   * @exception Throws invalid_argument if nthreads < 1
+   */
+  void AlignSequences(const UnalignedSequenceVector& v, std::vector<BamRecordVector>& out, bool hardclip,
+		      double keep_sec_with_frac_of_primary_score, int max_secondary, int nthreads) const;
+
+  /** Perform a paired-end BWA-MEM alignment of a batch of read pairs.
+   *
+   * Runs the bwa mem -p pipeline on the loaded index: the insert-size
+   * distribution is estimated from the batch, unpaired mates are rescued
+   * by local alignment near their partner, and the output has mate
+   * position, insert size and pair flags set.
+   * @param r1 First reads of the pairs
+   * @param r2 Second reads of the pairs. r2[i] is the mate of r1[i]
+   * @param vec Alignments are appended to vec, pair by pair, in input order
+   * (all of the records for r1[i], then all of those for r2[i])
+   * @param nthreads Number of threads to align with
+   * @note Insert-size estimation needs a reasonable number of uniquely mapped 
+   * pairs. With too few, pairs are scored without it and no mates are rescued.
+   * Progress is written to stderr according to bwa_verbose, as with bwa itself.
+   * @exception Throws invalid_argument if r1 and r2 are of different size or nthreads < 1
+   */
+  void AlignPairs(const UnalignedSequenceVector& r1, const UnalignedSequenceVector& r2, BamRecordVector& vec, int nthreads) const;
+
   /** Construct a new bwa index for this object. 
    * @param v vector of references to input (e.g. v = {{"r1", "AT"}};)
    * 
@@ -84,6 +117,15 @@ class BWAWrapper {
    */
   void ConstructIndex(const UnalignedSequenceVector& v);
 
+  /** Construct a bwa index for each of many BWAWrapper objects at once, across threads
+   * @param w Wrappers to construct indices for. w[i] gets an index of refs[i]
+   * @param refs References to index, one per wrapper
+   * @param nthreads Number of threads to use, including the calling thread
+   * @exception Throws invalid_argument if sizes of w and refs differ, if nthreads < 1,
+   * or (as ConstructIndex) if any of the names or sequences is empty
+   */
+  static void ConstructIndexes(const std::vector<BWAWrapper*>& w, const std::vector<UnalignedSequenceVector>& refs, int nthreads);
+
   /** Retrieve a bwa index object from disk
    * @param file path a to an index fasta (index with bwa index)
    * @return True if successful
@@ -91,6 +133,26 @@ class BWAWrapper {
    */
   bool LoadIndex(const std::string& file);
 
+  /** Write the stored index as a single packed image, for LoadIndexImage
+   * @param file Path of the image file to write
+   * @return True if able to write the image
+   * @note Repacks the stored index into one contiguous block first, so 
+   * should not be called while other threads are aligning with this object
+   */
+  bool WriteIndexImage(const std::string& file);
+
+  /** Map a packed index image (from WriteIndexImage) read-only into memory.
+   * 
+   * Nothing is copied: the index points into the mapping, so loading takes
+   * milliseconds once the file is in the page cache, and processes mapping 
+   * the same image share one copy of it.
+   * @param file Path of an image written by WriteIndexImage
+   * @return True if successful. False if the file is missing, or its
+   * header or layout is not that of a complete image
+   * @note Will delete the old index if already stored
+   */
+  bool LoadIndexImage(const std::string& file);
+
   /** Dump the stored index to files
    * @note This does not write the fasta itself
    * @param index_name Write index files (*.sai, *.pac, *.ann, *.bwt, *.amb)
@@ -176,6 +238,10 @@ class BWAWrapper {
   
  private:
 
+  // convert the hits for one sequence to BamRecords and free them
+  void regs2bam(mem_alnreg_v& ar, const std::string& seq, const std::string& name, BamRecordVector& vec, bool hardclip, 
+		double keep_sec_with_frac_of_primary_score, int max_secondary) const;
+
   // Construct a bam_hdr_t from a header string 
   bam_hdr_t* sam_hdr_read2(const std::string& hdr) const;
 
@@ -188,21 +254,22 @@ class BWAWrapper {
   // hold the full index structure
   bwaidx_t* idx;
 
+  // mapped index image (LoadIndexImage), or NULL
+  void* m_map;
+  size_t m_map_len;
+
+  // destroy the index and unmap its image, if any
+  void clear_index();
+
   // Convert a bns to a header string 
   std::string bwa_print_sam_hdr2(const bntseq_t *bns, const char *hdr_line) const;
 
-  // overwrite the bwa bwt_pac2pwt function
-  bwt_t *seqlib_bwt_pac2bwt(const uint8_t *pac, int bwt_seq_lenr);
+  // make the bwt (with occ and sampled sa) and the forward pac from the reference sequences
+  static void seqlib_build_bwt(const UnalignedSequenceVector& v, size_t tlen, bwt_t** bwt, uint8_t** pac);
 
   // add an anns (chr annotation structure) 
   bntann1_t* seqlib_add_to_anns(const std::string& name, const std::string& seq, bntann1_t * ann, size_t offset);
 
-  // overwrite the bwa-mem add1 function, which takes a sequence and adds to pac
-  uint8_t* seqlib_add1(const kseq_t *seq, bntseq_t *bns, uint8_t *pac, int64_t *m_pac, int *m_seqs, int *m_holes, bntamb1_t **q);
-
-  // make the pac structure (2-bit encoded packed sequence)
-  uint8_t* seqlib_make_pac(const UnalignedSequenceVector& v, bool for_only);
-
   // write pac part of the index
   void seqlib_write_pac_to_file(const std::string& file) const;
 
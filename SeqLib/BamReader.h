@@ -2,6 +2,13 @@
 #define SEQLIB_BAM_POLYREADER_H
 
 #include <cassert>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 #include "SeqLib/ReadFilter.h"
 #include "SeqLib/BamWalker.h"
 #include "SeqLib/ThreadPool.h"
@@ -16,20 +23,78 @@ namespace SeqLib {
 
   class BamReader;
 
+  struct _BamHeapCompare;
+
+  struct _RegionPlan;
+
   typedef SeqPointer<hts_idx_t> SharedIndex; ///< Shared pointer to the HTSlib index struct
 
   typedef SeqPointer<htsFile> SharedHTSFile; ///< Shared pointer to the HTSlib file pointer
+
+  /** Process-wide cache of loaded BAM indices
+   *
+   * Every BamReader looks up its index here the first time a region is set,
+   * so many readers on the same file (in one thread or many) load the .bai/.csi
+   * only once. Entries are keyed by file path and the modification times of the
+   * BAM and its index file, so an index is reloaded if either is rewritten.
+   * All functions are thread safe.
+   * @note CRAM indices are owned by the htsFile they are loaded through in HTSlib,
+   * so they can't be shared and are not cached. Each CRAM reader loads its own.
+   */
+  class BamIndexCache {
+
+  public:
+
+    /** Load the index for a BAM into the cache, if not already there
+     * @param f Path to an indexed BAM
+     * @return false if f can't be opened, is not a BAM, or has no index
+     */
+    static bool Preload(const std::string& f);
+
+    /** Drop the cached index for a file. Readers already using it keep their copy.
+     * @param f Path to a BAM
+     * @return true if an index was cached for f
+     */
+    static bool Evict(const std::string& f);
+
+    /** Drop all cached indices */
+    static void Clear();
+
+    /** Return the number of cached indices */
+    static size_t Size();
+
+    /** Return the cached index for f, loading it through fp if needed
+     * @param f Path to the BAM
+     * @param fp Open handle on f
+     * @return Empty pointer if the index can't be loaded
+     */
+    static SharedIndex Get(const std::string& f, htsFile* fp);
+
+  private:
+
+    struct Entry {
+      time_t mtime; // of the BAM
+      std::string idx_file; // index file it was loaded from
+      time_t idx_mtime; // of idx_file
+      SharedIndex idx;
+    };
+
+    static std::mutex m_mutex;
+    static std::map<std::string, Entry> m_cache;
+
+  };
  
   // store file accessors for single BAM
   class _Bam {
 
     friend class BamReader;
+    friend struct _BamHeapCompare;
 
   public:
 
-  _Bam(const std::string& m) : m_region_idx(0), m_in(m), empty(true), mark_for_closure(false)  {}
+  _Bam(const std::string& m) : m_region_idx(0), m_plan(NULL), m_in(m), empty(true), mark_for_closure(false), m_order(0), m_data_start(-1)  {}
 
-  _Bam() : m_region_idx(0), empty(true), mark_for_closure(false) {}
+  _Bam() : m_region_idx(0), m_plan(NULL), empty(true), mark_for_closure(false), m_order(0), m_data_start(-1) {}
 
     //! Return the header for this BAM
     const BamHeader& GetHeader() const {
@@ -48,9 +113,20 @@ namespace SeqLib {
 
   private:
 
-    // do the read loading
+    // do the read loading into next_read. If recycle, read over
+    // the bam1_t already in next_read when no one else holds it
     // the return value here is just passed along from sam_read1
-    int32_t load_read(BamRecord& r);
+    int32_t load_read(bool recycle);
+
+    // hand the slotted read off to r. If recycling, r and next_read
+    // trade buffers, so the old one in r gets read into next time
+    void take_read(BamRecord& r, bool recycle) {
+      if (recycle)
+	r.swap(next_read);
+      else
+	r = next_read;
+      empty = true;
+    }
 
     void set_pool(ThreadPool t) {
       if (t.IsOpen() && fp) // probably dont need this, it can handle null
@@ -63,6 +139,10 @@ namespace SeqLib {
       m_region_idx = 0;
     }
 
+    // go back to the first read of the first region, or of the file if
+    // there are no regions. Drops the slotted read
+    bool rewind(ThreadPool t);
+
     // close this bam
     bool close() {
       if (!fp)
@@ -83,7 +163,7 @@ namespace SeqLib {
     }
 
     // set a pre-loaded index (save on loading each time)
-    //void set_index(SharedIndex& i) { idx = i; }
+    void set_index(SharedIndex& i) { idx = i; }
 
     // set a pre-loaded htsfile (save on loading each time)
     //void set_file(SharedHTSFile& i) { fp = i; }
@@ -93,6 +173,9 @@ namespace SeqLib {
 
     GRC* m_region; // local copy of region
 
+    // if regions were coalesced, decides which reads from m_region to keep
+    const _RegionPlan* m_plan;
+
     SharedHTSFile fp;     // BAM file pointer
     SharedIndex idx;  // bam index
     SeqPointer<hts_itr_t> hts_itr; // iterator to index location
@@ -107,6 +190,12 @@ namespace SeqLib {
     
     // if set to true, then won't even attempt to lookup read
     bool mark_for_closure;
+
+    // order in which this file was opened. Breaks ties in the merge
+    size_t m_order;
+
+    // virtual offset of the first read (BAM only, -1 otherwise)
+    int64_t m_data_start;
     
     // open the file pointer
     bool open_BAM_for_reading(SeqLib::ThreadPool t);
@@ -117,6 +206,169 @@ namespace SeqLib {
   };
 
   typedef SeqHashMap<std::string, _Bam> _BamMap;
+
+  /** Function called on each read by BamReader::ForEachRegionParallel.
+   * Gets the read and the index of the region it was found in.
+   */
+  typedef std::function<void(const BamRecord& r, size_t region)> RegionCallback;
+
+  /** Counters for the background read prefetching of a BamReader */
+  struct PrefetchStats {
+
+    PrefetchStats() : depth(0), queued(0), reads(0), producer_stalls(0), consumer_stalls(0) {}
+
+    size_t depth; ///< Max number of reads decoded ahead of the caller
+    size_t queued; ///< Number of reads decoded and waiting to be taken
+    uint64_t reads; ///< Total reads handed out through the queue
+    uint64_t producer_stalls; ///< Times the decode thread waited on a full queue
+    uint64_t consumer_stalls; ///< Times GetNextRecord waited on an empty queue
+  };
+
+  /** Summary of how a BamReader merged its regions into index queries
+   *
+   * bytes_saved is estimated from the BAM index chunks, summed over files.
+   * Overlapping regions are first merged into one, and each of those is
+   * counted as read on its own. The queries are counted from their first
+   * block to their last. So reading overlaps more than once is not counted
+   * as a saving. It is negative if the merged gaps cost more than they save.
+   */
+  struct RegionPlanStats {
+
+    RegionPlanStats() : regions(0), queries(0), seeks_saved(0), bytes_saved(0) {}
+
+    size_t regions; ///< Number of regions requested
+    size_t queries; ///< Number of index queries made for them (per file)
+    size_t seeks_saved; ///< Index queries (and seeks) avoided per file
+    int64_t bytes_saved; ///< Estimated compressed bytes not read (see above)
+  };
+
+  // requested regions merged into fewer index queries. Reads are kept only if
+  // they overlap a requested region, and only from the first query that returns them
+  struct _RegionPlan {
+
+    GRC queries; // one iterator query per element
+    std::vector<GenomicRegion> targets; // sorted, disjoint union of the requested regions
+    std::vector<size_t> owner; // index of the query responsible for each target
+    RegionPlanStats stats;
+
+    // should read b, returned by query q, be passed on
+    bool keep(const bam1_t* b, size_t q) const;
+
+    void clear() {
+      queries = GRC();
+      targets.clear();
+      owner.clear();
+      stats = RegionPlanStats();
+    }
+  };
+
+  // bounded single-producer / single-consumer ring of decoded reads,
+  // filled by a background thread. Copies start out stopped and empty
+  struct _BamPrefetch {
+
+    _BamPrefetch() : depth(0) { clear(); }
+
+    _BamPrefetch(const _BamPrefetch& p) : depth(p.depth) { clear(); }
+
+    _BamPrefetch& operator=(const _BamPrefetch& p) {
+      halt();
+      depth = p.depth;
+      clear();
+      return *this;
+    }
+
+    ~_BamPrefetch() { halt(); }
+
+    // signal the producer to stop and wait for it. Queued reads are kept, and
+    // the end of input is forgotten, so the next pop restarts the producer
+    // and it looks again (files may have been opened or reset since)
+    void halt() {
+      stop = true;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	cv.notify_all();
+      }
+      if (worker.joinable())
+	worker.join();
+      stop = false;
+      done = false;
+    }
+
+    // drop any queued reads and reset the counters
+    void clear() {
+      ring.assign(depth, BamRecord());
+      head = 0;
+      tail = 0;
+      stop = false;
+      done = false;
+      producer_waiting = false;
+      consumer_waiting = false;
+      error = std::exception_ptr();
+      reset_stats();
+    }
+
+    // change the depth while halted, keeping the queued reads in order.
+    // The ring is never smaller than what is already queued
+    void resize(size_t d) {
+      size_t n = tail - head;
+      std::vector<BamRecord> r(std::max(d, n));
+      for (size_t i = 0; i < n; ++i)
+	r[i].swap(ring[(head + i) % ring.size()]);
+      ring.swap(r);
+      depth = d;
+      head = 0;
+      tail = n;
+      reset_stats();
+    }
+
+    void reset_stats() {
+      reads = 0;
+      producer_stalls = 0;
+      consumer_stalls = 0;
+    }
+
+    // wait until ready() or stop. The other side usually moves within a few
+    // reads, so yield a little first, then sleep until wake() is called
+    template <class F>
+    void wait(std::atomic<bool>& waiting, F ready) {
+      for (int i = 0; i < 64; ++i) {
+	if (ready() || stop)
+	  return;
+	std::this_thread::yield();
+      }
+      std::unique_lock<std::mutex> lock(mtx);
+      waiting = true;
+      cv.wait(lock, [&]() { return ready() || stop; });
+      waiting = false;
+    }
+
+    // wake the other side if it went to sleep in wait()
+    void wake(std::atomic<bool>& waiting) {
+      if (waiting) {
+	std::lock_guard<std::mutex> lock(mtx);
+	cv.notify_all();
+      }
+    }
+
+    size_t depth; // max reads to queue
+    std::vector<BamRecord> ring; // at least depth slots
+    std::atomic<size_t> head; // total reads popped by the consumer
+    std::atomic<size_t> tail; // total reads pushed by the producer
+    std::atomic<bool> stop; // producer should exit
+    std::atomic<bool> done; // producer hit the end of input (or an error)
+    std::exception_ptr error; // error thrown on the producer, rethrown on pop
+    std::thread worker;
+
+    // for a side that is waiting on the other to sleep, instead of spinning
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::atomic<bool> producer_waiting;
+    std::atomic<bool> consumer_waiting;
+
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> producer_stalls;
+    std::atomic<uint64_t> consumer_stalls;
+  };
   
 /** Stream in reads from multiple BAM/SAM/CRAM or stdin */
 class BamReader {
@@ -126,12 +378,21 @@ class BamReader {
   /** Construct an empty BamReader */
   BamReader();
 
+  /** Copy a BamReader. The copy shares the open files (and their read
+   * positions) with r, but merges and walks regions on its own. Prefetching
+   * starts out stopped and empty
+   */
+  BamReader(const BamReader& r);
+
+  /** Assign from another BamReader. See the copy constructor */
+  BamReader& operator=(const BamReader& r);
+
   /** Destroy a BamReader and close all connections to the BAMs 
    * 
    * Calling the destructor will take care of all of the C-style dealloc
    * calls required within HTSlib to close a BAM or SAM file. 
    */
-  ~BamReader() { }
+  ~BamReader() { m_prefetch.halt(); }
 
   /** Explicitly set a reference genome to be used to decode CRAM file.
    * If no reference is specified, will automatically load from
@@ -162,6 +423,38 @@ class BamReader {
    * @return false if the thread pool has not been opened 
    */
   bool SetThreadPool(ThreadPool p);
+
+  /** Reuse the memory of the BamRecord passed to GetNextRecord
+   *
+   * With recycling on, GetNextRecord decodes into a bam1_t from a previous
+   * call instead of allocating a new one, so a loop that does not keep
+   * copies of its reads makes no heap allocations per read. A buffer is
+   * only reused if no other BamRecord shares it, so reads that are
+   * copied (e.g. pushed into a BamRecordVector) are never overwritten.
+   * @note Raw bam1_t pointers taken with BamRecord::raw() are not
+   * valid after the next call to GetNextRecord.
+   * @param r true to turn recycling on
+   */
+  void SetRecycleRecords(bool r);
+
+  /** Decode reads on a background thread, ahead of GetNextRecord
+   *
+   * A producer thread reads and parses records (in file-merge order)
+   * into a bounded lock-free queue, and GetNextRecord / GetNextBatch just
+   * pop from it. This overlaps I/O and parsing with whatever the caller
+   * does with each read. Decompression can additionally be spread over
+   * a ThreadPool with SetThreadPool.
+   * @note Setting regions, calling Reset or closing files drops any reads 
+   * that have been decoded but not yet returned. Changing the depth keeps 
+   * them, and they are returned first. Opening or configuring files
+   * pauses the thread, and it is restarted on the next read (also after it 
+   * has reached the end of the input).
+   * @param depth Number of reads to decode ahead. 0 turns prefetching off
+   */
+  void SetPrefetch(size_t depth);
+
+  /** Return the queue depth and stall counts for read prefetching */
+  PrefetchStats GetPrefetchStats() const;
   
   /** Set up multiple regions. Overwrites current regions. 
    * 
@@ -174,36 +467,56 @@ class BamReader {
    */
   bool SetMultipleRegions(const GRC& grc);
 
+  /** Merge nearby regions into fewer index queries
+   *
+   * Applies to later calls to SetMultipleRegions. Regions are sorted and
+   * merged when they are within gap bp of each other, or when their index
+   * chunks share a BGZF block, so the same blocks are not seeked to and
+   * decompressed again for every region. Reads that fall in the merged gaps
+   * are skipped.
+   * @note With merging on, each read is returned only once, even if it 
+   * overlaps several regions. Reads are not guaranteed to be in coordinate
+   * order: a read that starts before a query but is kept by it comes out
+   * after the reads of the query before.
+   * @param gap Max distance in bp between merged regions. Negative turns merging off (default)
+   */
+  void SetRegionCoalescing(int32_t gap);
+
+  /** Return how the last SetMultipleRegions was planned (all zero if not coalesced) */
+  RegionPlanStats GetRegionPlanStats() const { return m_plan.stats; }
+
   /** Return if the reader has opened the first file */
   bool IsOpen() const { if (m_bams.size()) return m_bams.begin()->second.fp.get() != NULL; return false; }
 
-  /*
-  Set pre-loaded raw htslib index 
-    Provide the reader with an index structure that is already loaded.
-    This is useful if there are multiple newly created BamReader objects
-    that use the same index (e.g. make a BAM index in a loop)
-    @note This does not make a copy, so ops on this index are shared with
-    every other object that controls it.
-    @param i Pointer to an HTSlib index
-    @param f Name of the file to set index for
-    @return True if the file f is controlled by this object
+  /** Set pre-loaded raw htslib index 
+   *
+   * Provide the reader with an index structure that is already loaded.
+   * This is useful if there are multiple newly created BamReader objects
+   * that use the same index (e.g. make a BAM index in a loop)
+   * @note This does not make a copy, so ops on this index are shared with
+   * every other object that controls it. BAM indices are shared automatically
+   * through BamIndexCache, so this is only needed to bypass the cache.
+   * @param i Pointer to an HTSlib index
+   * @param f Name of the file to set index for
+   * @return True if the file f is controlled by this object
+   */
   bool SetPreloadedIndex(const std::string& f, SharedIndex& i);
 
-  Return a shared pointer to the raw htsFile object
-    @exception Throws runtime_error if the requested file has not been opened already with Open
-    @param f File to retrieve the htsFile from.
-   
+  /** Return a shared pointer to the raw htsFile object
+   * @exception Throws runtime_error if the requested file has not been opened already with Open
+   * @param f File to retrieve the htsFile from.
+   */
   SharedHTSFile GetHTSFile (const std::string& f) const;
 
-  Return a shared pointer to the raw htsFile object from the first BAM
-    @exception Throws runtime_error if no files have been opened already with Open
-    @param f File to retrieve the htsFile from.
+  /** Return a shared pointer to the raw htsFile object from the first BAM
+   * @exception Throws runtime_error if no files have been opened already with Open
+   */
   SharedHTSFile GetHTSFile () const;
 
-  Set a pre-loaded raw index, to the first BAM
-   @note see SetPreloadedIndex(const std::string& f, SharedIndex& i)
+  /** Set a pre-loaded raw index, to the first BAM
+   * @note see SetPreloadedIndex(const std::string& f, SharedIndex& i)
+   */
   bool SetPreloadedIndex(SharedIndex& i);
-  */
 
   /** Return if the reader has opened the file
    * @param f Name of file to check
@@ -226,7 +539,8 @@ class BamReader {
 
   /** Reset the given BAM/SAM/CRAM to the begining, but keep the loaded indicies and file-pointers 
    * @param f Name of file to reset
-   * @return Returns false if this BAM is not found in object
+   * @return Returns false if this BAM is not found in object, or it can't
+   * be rewound (e.g. reading from stdin)
    * @note Unlike Reset(), this version will NOT reset the regions, since other BAMs may still be
    * using them.
    */
@@ -268,7 +582,46 @@ class BamReader {
    */
   bool GetNextRecord(BamRecord &r);
 
-  /** Reset all the regions, but keep the loaded indicies and file-pointers */
+  /** Retrieve up to n reads at once from the available input streams.
+   *
+   * Fills batch[0,n) in the same order as repeated calls to GetNextRecord.
+   * The reads are decoded into the bam1_t buffers already held by batch
+   * wherever no other BamRecord shares them, so reusing the same batch
+   * across calls makes no heap allocations per read once it is warm.
+   * @note Raw bam1_t pointers into batch are not valid after the next call.
+   * @param batch Reads to fill. Is grown to size n if smaller
+   * @param n Maximum number of reads to retrieve
+   * @return Number of reads filled. Less than n only at end of input
+   */
+  size_t GetNextBatch(BamRecordVector& batch, size_t n);
+
+  /** Visit every read in a set of regions, using multiple threads
+   *
+   * The regions are handed out to nthreads workers. Each worker opens
+   * its own file handles, so this does not disturb the reader's own
+   * position or regions. BAM indices are loaded once and shared by all
+   * workers (CRAM indices are tied to a file handle, so each worker loads
+   * its own). With multiple files, reads from a region are visited
+   * for every file.
+   * @note As with SetMultipleRegions, a read that overlaps more than one
+   * region is visited once per region.
+   * @param grc Regions to visit
+   * @param func Called on each read. Unless ordered is set, this is called
+   * concurrently from the worker threads and must be thread safe
+   * @param nthreads Number of worker threads
+   * @param ordered If true, func is called only from the calling thread,
+   * one region at a time in the order of grc, and by position within a
+   * region (ties broken by file open order). Workers buffer a bounded
+   * number of regions ahead of the caller.
+   * @return Number of reads visited
+   * @exception Throws an invalid_argument if nthreads < 1 or a file is not a BAM/CRAM,
+   * and a runtime_error if an index can't be loaded or a read fails to decode.
+   * Errors thrown by func are passed on to the caller.
+   */
+  size_t ForEachRegionParallel(const GRC& grc, const RegionCallback& func, int nthreads, bool ordered = false);
+
+  /** Reset all the regions and rewind every file to its first read,
+   * but keep the loaded indicies and file-pointers */
   void Reset();
 
   /** Return a copy of the header to the first file 
@@ -293,6 +646,55 @@ class BamReader {
   // hold the reference for CRAM reading
   std::string m_cram_reference;
 
+  // reuse bam1_t memory between reads
+  bool m_recycle;
+
+  // min-heap of BAMs with a read slotted, for merging multiple files
+  std::vector<_Bam*> m_heap;
+
+  // BAM whose read was just returned, and needs to be refilled
+  _Bam* m_heap_last;
+
+  // heap needs to be rebuilt (eg files opened/closed or regions changed)
+  bool m_heap_dirty;
+
+  // pull the next read from whichever file is next
+  bool get_next_record(BamRecord& r, bool recycle);
+
+  // pull the next read from the prefetch queue, or straight from the files
+  bool next_record(BamRecord& r, bool recycle);
+
+  // reads decoded ahead on a background thread
+  _BamPrefetch m_prefetch;
+
+  // producer loop for the prefetch thread
+  void prefetch_loop();
+
+  // take the next read from the prefetch queue
+  bool prefetch_pop(BamRecord& r, bool recycle);
+
+  // pull the next read from the multi-file merge heap
+  bool get_next_merged_record(BamRecord& r, bool recycle);
+
+  // all the BAMs, in the order they were opened
+  std::vector<_Bam*> open_order();
+
+  // merge gap for SetMultipleRegions. Negative for no merging
+  int32_t m_coalesce_gap;
+
+  // regions from SetMultipleRegions, merged into queries
+  _RegionPlan m_plan;
+
+  // build m_plan from m_region
+  void plan_regions();
+
+  // point all the BAMs back to m_region, with no plan
+  void unplan_regions();
+
+  // after a copy, point the BAMs at this object's regions and plan,
+  // and have the merge heap rebuilt from them
+  void repoint();
+
   // for multicore reading/writing
   ThreadPool pool;
 
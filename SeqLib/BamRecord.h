@@ -8,6 +8,8 @@
 #include <sstream>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
+#include <iterator>
 
 extern "C" {
 #include "htslib/htslib/hts.h"
@@ -21,6 +23,7 @@ extern "C" {
 #include "SeqLib/SeqLibUtils.h"
 #include "SeqLib/GenomicRegion.h"
 #include "SeqLib/UnalignedSequence.h"
+#include "SeqLib/SeqDecode.h"
 
 static const char BASES[16] = {' ', 'A', 'C', ' ',
                                'G', ' ', ' ', ' ', 
@@ -46,6 +49,8 @@ static const uint8_t CIGTAB[255] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
 
 namespace SeqLib {
 
+  class _Bam;
+
 /** Basic container for a single cigar operation
  *
  * Stores a single cigar element in a compact 32bit form (same as HTSlib).
@@ -195,6 +200,228 @@ class CigarField {
 
  typedef SeqHashMap<std::string, size_t> CigarMap;
 
+/** Non-owning view of the CIGAR of a BamRecord
+ *
+ * Reads straight from the raw uint32_t cigar ops in the bam1_t,
+ * so unlike BamRecord::GetCigar() it does not allocate.
+ * @note Only valid while the BamRecord it came from is alive and unmodified
+ */
+ class CigarView {
+
+ public:
+
+   /** Iterator over the ops, as CigarField values */
+   class const_iterator {
+   public:
+     typedef std::forward_iterator_tag iterator_category;
+     typedef CigarField value_type;
+     typedef std::ptrdiff_t difference_type;
+     typedef const CigarField* pointer;
+     typedef CigarField reference;
+     const_iterator(const uint32_t* p) : m_p(p) {}
+     CigarField operator*() const { return CigarField(*m_p); }
+     const_iterator& operator++() { ++m_p; return *this; }
+     const_iterator operator++(int) { const_iterator t = *this; ++m_p; return t; }
+     bool operator==(const const_iterator& o) const { return m_p == o.m_p; }
+     bool operator!=(const const_iterator& o) const { return m_p != o.m_p; }
+   private:
+     const uint32_t* m_p;
+   };
+
+   /** Construct an empty view */
+   CigarView() : m_data(NULL), m_size(0) {}
+
+   /** Construct a view over n raw cigar ops */
+   CigarView(const uint32_t* c, size_t n) : m_data(c), m_size(n) {}
+
+   const_iterator begin() const { return const_iterator(m_data); } ///< Iterator to the first op
+   const_iterator end() const { return const_iterator(m_data + m_size); } ///< Iterator to one past the last op
+
+   /** Returns the number of cigar ops */
+   inline size_t size() const { return m_size; }
+
+   /** Returns true if there are no cigar ops */
+   inline bool empty() const { return !m_size; }
+
+   /** Returns the i'th cigar op */
+   inline CigarField operator[](size_t i) const { return CigarField(m_data[i]); }
+
+   /** Returns the first cigar op */
+   inline CigarField front() const { return CigarField(m_data[0]); }
+
+   /** Returns the last cigar op */
+   inline CigarField back() const { return CigarField(m_data[m_size - 1]); }
+
+   /** Returns the raw sam.h cigar ops */
+   inline const uint32_t* raw() const { return m_data; }
+
+   /** Return the number of query-consumed bases */
+   inline int NumQueryConsumed() const {
+     int out = 0;
+     for (size_t i = 0; i < m_size; ++i)
+       if (bam_cigar_type(bam_cigar_op(m_data[i]))&1)
+	 out += bam_cigar_oplen(m_data[i]);
+     return out;
+   }
+
+   /** Return the number of reference-consumed bases */
+   inline int NumReferenceConsumed() const {
+     int out = 0;
+     for (size_t i = 0; i < m_size; ++i)
+       if (bam_cigar_type(bam_cigar_op(m_data[i]))&2)
+	 out += bam_cigar_oplen(m_data[i]);
+     return out;
+   }
+
+   /** Make an owning copy of the CIGAR */
+   Cigar AsCigar() const {
+     Cigar c;
+     for (size_t i = 0; i < m_size; ++i)
+       c.add(CigarField(m_data[i]));
+     return c;
+   }
+
+ private:
+
+   const uint32_t* m_data;
+   size_t m_size;
+
+ };
+
+/** Non-owning view of the 4-bit packed sequence of a BamRecord
+ *
+ * Bases are decoded one at a time as they are read, so no string is built.
+ * @note Only valid while the BamRecord it came from is alive and unmodified
+ */
+ class SequenceView {
+
+ public:
+
+   /** Iterator over the bases, as ASCII chars (ACGTN) */
+   class const_iterator {
+   public:
+     typedef std::forward_iterator_tag iterator_category;
+     typedef char value_type;
+     typedef std::ptrdiff_t difference_type;
+     typedef const char* pointer;
+     typedef char reference;
+     const_iterator(const uint8_t* s, size_t i) : m_s(s), m_i(i) {}
+     char operator*() const { return BASES[bam_seqi(m_s, m_i)]; }
+     const_iterator& operator++() { ++m_i; return *this; }
+     const_iterator operator++(int) { const_iterator t = *this; ++m_i; return t; }
+     bool operator==(const const_iterator& o) const { return m_i == o.m_i && m_s == o.m_s; }
+     bool operator!=(const const_iterator& o) const { return !(*this == o); }
+   private:
+     const uint8_t* m_s;
+     size_t m_i;
+   };
+
+   /** Construct an empty view */
+   SequenceView() : m_data(NULL), m_size(0) {}
+
+   /** Construct a view over n bases of packed (bam_get_seq) sequence */
+   SequenceView(const uint8_t* s, size_t n) : m_data(s), m_size(n) {}
+
+   const_iterator begin() const { return const_iterator(m_data, 0); } ///< Iterator to the first base
+   const_iterator end() const { return const_iterator(m_data, m_size); } ///< Iterator to one past the last base
+
+   /** Returns the number of bases */
+   inline size_t size() const { return m_size; }
+
+   /** Returns true if there is no sequence */
+   inline bool empty() const { return !m_size; }
+
+   /** Returns the i'th base as an ASCII char */
+   inline char operator[](size_t i) const { return BASES[bam_seqi(m_data, i)]; }
+
+   /** Returns the i'th base as its 4-bit code (1=A, 2=C, 4=G, 8=T, 15=N) */
+   inline uint8_t code(size_t i) const { return bam_seqi(m_data, i); }
+
+   /** Returns the raw packed sequence */
+   inline const uint8_t* raw() const { return m_data; }
+
+   /** Make an owning copy of the sequence */
+   std::string str() const {
+     std::string out(m_size, 'N');
+     if (m_size)
+       DecodeBases(m_data, m_size, &out[0]);
+     return out;
+   }
+
+ private:
+
+   const uint8_t* m_data;
+   size_t m_size;
+
+ };
+
+/** Non-owning view of a single aux tag of a BamRecord
+ *
+ * Points straight into the bam1_t aux data, so string tags can be
+ * compared and numbers read without making a std::string.
+ * @note Only valid while the BamRecord it came from is alive and unmodified
+ */
+ class TagView {
+
+ public:
+
+   /** Construct a view of a missing tag */
+   TagView() : m_p(NULL) {}
+
+   /** Construct from a pointer returned by bam_aux_get (may be NULL) */
+   TagView(const uint8_t* p) : m_p(p) {}
+
+   /** Returns true if the tag was found */
+   inline bool Found() const { return m_p != NULL; }
+
+   /** Return the SAM type char of the tag (eg Z, i, f), or 0 if not found */
+   inline char Type() const { return m_p ? *m_p : 0; }
+
+   /** Returns true if this is a string (Z) tag */
+   inline bool IsString() const { return Type() == 'Z'; }
+
+   /** Returns true if this is an integer tag (cCsSiI) */
+   inline bool IsInt() const {
+     char t = Type();
+     return t == 'c' || t == 'C' || t == 's' || t == 'S' || t == 'i' || t == 'I';
+   }
+
+   /** Returns true if this is a float (f or d) tag */
+   inline bool IsFloat() const { return Type() == 'f' || Type() == 'd'; }
+
+   /** Return the value of a Z tag. Empty if not a Z tag */
+   inline const char* c_str() const { return IsString() ? reinterpret_cast<const char*>(m_p + 1) : ""; }
+
+   /** Return the length of a Z tag. 0 if not a Z tag */
+   inline size_t size() const { return strlen(c_str()); }
+
+   /** Return the value of an integer tag. 0 if not an integer tag */
+   inline int64_t AsInt() const { return IsInt() ? bam_aux2i(m_p) : 0; }
+
+   /** Return the value of a float tag. 0 if not a float tag */
+   inline double AsFloat() const { return IsFloat() ? bam_aux2f(m_p) : 0; }
+
+   /** Returns true if this is a Z tag equal to s */
+   inline bool operator==(const char* s) const { return IsString() && strcmp(c_str(), s) == 0; }
+
+   /** Returns true if this is a Z tag equal to s */
+   inline bool operator==(const std::string& s) const { return IsString() && s.compare(c_str()) == 0; }
+
+   /** Count the occurences of a char in a Z tag */
+   inline size_t Count(char c) const {
+     size_t n = 0;
+     for (const char* s = c_str(); *s; ++s)
+       if (*s == c)
+	 ++n;
+     return n;
+   }
+
+ private:
+
+   const uint8_t* m_p;
+
+ };
+
 /** Class to store and interact with a SAM alignment record
  *
  * HTSLibrary reads are stored in the bam1_t struct. Memory allocation
@@ -207,6 +434,7 @@ class BamRecord {
 
   friend class BLATWraper;
   friend class BWAWrapper;
+  friend class _Bam;
 
  public:
 
@@ -241,6 +469,12 @@ class BamRecord {
   /** Make a BamRecord with no memory allocated and a null header */
   BamRecord() {}
 
+  /** Exchange the underlying bam1_t with another BamRecord. 
+   * No memory is allocated or copied.
+   * @param r BamRecord to swap with
+   */
+  inline void swap(BamRecord& r) { b.swap(r.b); }
+
   /** BamRecord is aligned on reverse strand */
   inline bool ReverseFlag() const { return b ? ((b->core.flag&BAM_FREVERSE) != 0) : false; }
 
@@ -433,9 +667,9 @@ class BamRecord {
   inline std::string ParseReadGroup() const {
 
     // try to get from RG tag first
-    std::string RG;
-    if (GetZTag("RG", RG))
-      return RG;
+    TagView rg = GetTagView("RG");
+    if (rg.IsString())
+      return std::string(rg.c_str());
 
     // try to get the read group tag from qname second
     std::string qn = Qname();
@@ -449,7 +683,7 @@ class BamRecord {
     if (b->core.tid != b->core.mtid || !PairMappedFlag())
       return 0;
 
-    return std::abs(b->core.pos - b->core.mpos) + GetCigar().NumQueryConsumed();
+    return std::abs(b->core.pos - b->core.mpos) + GetCigarView().NumQueryConsumed();
 
   }
   
@@ -546,6 +780,22 @@ class BamRecord {
   }
 
 
+  /** Return a non-allocating view of the CIGAR 
+   * @note Only valid while this record is alive and unmodified
+   */
+  CigarView GetCigarView() const { return b ? CigarView(bam_get_cigar(b), b->core.n_cigar) : CigarView(); }
+
+  /** Return a non-allocating view of the sequence 
+   * @note Only valid while this record is alive and unmodified
+   */
+  SequenceView GetSequenceView() const { return b ? SequenceView(bam_get_seq(b), b->core.l_qseq) : SequenceView(); }
+
+  /** Return a non-allocating view of an aux tag
+   * @param tag Name of the tag. eg "RG"
+   * @note Only valid while this record is alive and unmodified
+   */
+  TagView GetTagView(const char* tag) const { return b ? TagView(bam_aux_get(b.get(), tag)) : TagView(); }
+
   /** Retrieve the CIGAR as a more managable Cigar structure */
   Cigar GetCigar() const {
     uint32_t* c = bam_get_cigar(b);
@@ -573,6 +823,9 @@ class BamRecord {
   /** Retrieve the sequence of this read as a string (ACTGN) */
   std::string Sequence() const;
 
+  /** Get the reverse complement of the sequence of this read as a string */
+  std::string SequenceReverseComplement() const;
+
   /** Return the mean quality score 
    */
   double MeanPhred() const;
@@ -597,8 +850,8 @@ class BamRecord {
     //if (!p[0])
     //  return std::string();
     std::string out(b->core.l_qseq, ' ');
-    for (int32_t i = 0; i < b->core.l_qseq; ++i) 
-      out[i] = (char)(p[i] + offset);
+    if (b->core.l_qseq > 0)
+      DecodeQualities(p, b->core.l_qseq, offset, &out[0]);
     return out;
   }
 
@@ -4,6 +4,7 @@
 #include <string>
 #include <cstdlib>
 #include <iostream>
+#include <functional>
 
 #include "SeqLib/BamRecord.h"
 
@@ -15,6 +16,36 @@ extern "C"
 }
 namespace SeqLib {
 
+  /** One assembled unitig, as handed to a FermiAssembler::UnitigCallback.
+   * The pointers are only valid during the callback.
+   */
+  struct FermiUnitig {
+
+    int id; ///< Index of the unitig (the GFA segment name)
+    const char* seq; ///< Sequence, upper case ACTGN. Null terminated
+    const char* cov; ///< Per-base coverage string (the GFA PD tag). Null terminated
+    int len; ///< Length of seq
+    int nsr; ///< Number of reads supporting the unitig
+  };
+
+  /** One overlap between two unitigs, as written to a GFA L line */
+  struct FermiEdge {
+
+    int from; ///< Unitig the edge starts from
+    bool from_rev; ///< Edge leaves the reverse strand of from
+    int to; ///< Unitig the edge goes to
+    bool to_rev; ///< Edge enters the reverse strand of to
+    int len; ///< Length of the overlap
+  };
+
+  /** Function called on each unitig by FermiAssembler::VisitUnitigs.
+   * Return false to stop the traversal.
+   */
+  typedef std::function<bool(const FermiUnitig& u)> UnitigCallback;
+
+  /** Function called on each overlap by FermiAssembler::VisitUnitigs */
+  typedef std::function<void(const FermiEdge& e)> EdgeCallback;
+
   /** Sequence assembly using FermiKit from Heng Li
    */
   class FermiAssembler {
@@ -33,12 +64,22 @@ namespace SeqLib {
      * @param brv Reads with or without quality scores
      * @note This will copy the reads and quality scores
      * into this object. Deallocation is automatic with object
-     * destruction, or with ClearReads.
+     * destruction, or with ClearReads. The bases and qualities are
+     * decoded straight from the BAM records, and the names go into a 
+     * single block sized for the whole batch. Reads with no bases are skipped.
      */ 
     void AddReads(const BamRecordVector& brv);
 
+    /** Move a set of reads into this assembler, as AddReads, then
+     * clear brv so the BAM records can be released right away.
+     * @param brv Reads to add. Is empty on return
+     */
+    void MoveReads(BamRecordVector& brv);
+
     /** Clear all of the sequences and deallocate memory.
      * This is not required, as it will be done on object destruction
+     * @note Read names live in a few large blocks (one per AddReads batch),
+     * so this frees blocks rather than individual names.
      */
     void ClearReads();
 
@@ -105,6 +146,36 @@ namespace SeqLib {
     // From lh3: retain a bubble if one side is longer than the other side by >INT-bp
     //void SetBubbleDifference(int bdiff) { opt.mag_opt.max_bdiff; }
 
+    /** Set the number of threads used by CorrectReads, CorrectAndFilterReads,
+     * PerformAssembly and DirectAssemble (default 1)
+     * @param n Number of threads
+     * @exception Throws invalid_argument if n < 1
+     */
+    void SetThreads(int n);
+
+    /** Return the number of threads used for correction and assembly */
+    int GetThreads() const { return opt.n_threads; }
+
+    /** Assemble many independent read sets (e.g. one per SV candidate window) at once.
+     * 
+     * Each read set is corrected and assembled as PerformAssembly would, with the
+     * parameters of this assembler, on its own single-threaded assembler. Read sets
+     * are handed to the nthreads workers as they free up, so a few large windows
+     * do not hold up the rest. Reads stored in this object are not used or changed.
+     * @param windows Read sets to assemble
+     * @param nthreads Number of threads, including the calling thread
+     * @return Contigs for each read set, in the order of windows
+     * @exception Throws invalid_argument if nthreads < 1
+     */
+    std::vector<std::vector<std::string> > AssembleMany(const std::vector<UnalignedSequenceVector>& windows, int nthreads) const;
+
+    /** Assemble many independent sets of aligned reads at once. See AssembleMany
+     * @param windows Read sets to assemble
+     * @param nthreads Number of threads, including the calling thread
+     * @return Contigs for each read set, in the order of windows
+     */
+    std::vector<std::vector<std::string> > AssembleMany(const std::vector<BamRecordVector>& windows, int nthreads) const;
+
     /** Return the minimum overlap parameter for this assembler */
     uint32_t GetMinOverlap() const { return opt.min_asm_ovlp; }
 
@@ -120,16 +191,58 @@ namespace SeqLib {
     /** Return the number of sequences that are controlled by this assembler */
     size_t NumSequences() const { return n_seqs; }
 
-    void WriteGFA(std::ostream &out);
+    /** Walk the assembled unitigs one at a time, without copying them.
+     *
+     * Each unitig is passed to contig, followed by the overlaps it starts 
+     * (each overlap is reported once, from the lower numbered unitig, as in
+     * WriteGFA). With release, each unitig is freed as soon as it has been 
+     * visited, and all contigs are cleared on return, so the peak memory
+     * of a large assembly is not held while the output is written.
+     * @param contig Called on each unitig. Return false to stop
+     * @param edge Called on each overlap. May be empty
+     * @param release Free the unitigs as they are consumed
+     * @return Number of unitigs visited
+     */
+    size_t VisitUnitigs(const UnitigCallback& contig, const EdgeCallback& edge = EdgeCallback(), bool release = false);
+
+    /** Write the assembly graph in GFA 1.0 format
+     * @param out Stream to write to
+     * @param release Free each unitig once it is written (see VisitUnitigs)
+     */
+    void WriteGFA(std::ostream &out, bool release = false);
   private:
 
+    // make room for n more reads in m_seqs
+    void reserve_seqs(size_t n);
+
+    // make sure the next n bytes of name storage are contiguous
+    void reserve_bytes(size_t n);
+
+    // take n bytes of name storage
+    char* alloc_bytes(size_t n);
+
+    // copy one read into m_seqs
+    void add_read(const char* name, size_t l_name, const char* seq, const char* qual, size_t l_seq);
+
+    // decode one aligned read into m_seqs
+    void add_bam_read(const bam1_t* b);
+
     // reads to assemble
     fseq1_t *m_seqs;
   
     // size of m_seqs
     size_t m;
   
-    std::vector<std::string> m_names;
+    // read names, pointing into m_blocks
+    std::vector<const char*> m_names;
+
+    // storage for the read names. The bases and qualities are malloc'd
+    // per read instead, since fml is free to free or replace them
+    std::vector<char*> m_blocks;
+
+    // next free byte / bytes left in the last of m_blocks
+    char* m_block_ptr;
+    size_t m_block_left;
 
     // number of base-pairs
     uint64_t size;
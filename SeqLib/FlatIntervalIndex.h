@@ -0,0 +1,161 @@
+#ifndef SEQLIB_FLAT_INTERVAL_INDEX_H
+#define SEQLIB_FLAT_INTERVAL_INDEX_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+#include "SeqLib/SeqLibUtils.h"
+
+namespace SeqLib {
+
+  /** One interval stored in a FlatIntervalIndex */
+  struct FlatInterval {
+
+    int32_t start; ///< Start position (inclusive)
+    int32_t end; ///< End position (inclusive)
+    int32_t max; ///< Largest end in the subtree rooted at this interval (set by Index)
+    int32_t value; ///< Value stored with the interval (eg position in a GenomicRegionCollection)
+  };
+
+  /** @brief Flat, cache friendly index of intervals on many chromosomes.
+   *
+   * An implicit augmented interval tree, as in cgranges by Heng Li: the intervals of
+   * each chromosome are kept sorted by start in one contiguous array, and the tree is
+   * implied by the array positions (the node at i has children at i -/+ 2^(level-1)).
+   * Each interval only adds the max end of its subtree, so the whole index is one
+   * allocation of 16 bytes per interval, and queries walk a sorted array instead of
+   * chasing pointers. Intervals are closed, as with GenomicRegion.
+   */
+  class FlatIntervalIndex {
+
+  public:
+
+    /** Construct an empty index */
+    FlatIntervalIndex() : m_indexed(true), m_ext_a(0), m_ext_blocks(0), m_ext_n(0), m_ext_nblocks(0) {}
+
+    /** Add an interval. Index must be called before any queries
+     * @param chr Chromosome ID. Intervals with chr < 0 are not stored
+     * @param start Start of the interval
+     * @param end End of the interval (inclusive)
+     * @param value Value to return with the interval
+     */
+    void Add(int32_t chr, int32_t start, int32_t end, int32_t value);
+
+    /** Sort the intervals and build the implicit tree over each chromosome */
+    void Index();
+
+    /** Has Index been called since the last Add */
+    bool IsIndexed() const { return m_indexed; }
+
+    /** Remove all intervals */
+    void clear();
+
+    /** Number of intervals stored */
+    size_t size() const { return m_keep ? m_ext_n : m_a.size(); }
+
+    /** Is the index empty */
+    bool empty() const { return size() == 0; }
+
+    /** Append the built index to out, in the layout read by Attach.
+     * out should start 8 byte aligned in the final file / memory
+     */
+    void Serialize(std::vector<char>& out) const;
+
+    /** Use a serialized index (from Serialize) in place, without copying it.
+     * @param p Start of the serialized index. Must be 8 byte aligned
+     * @param len Number of bytes available from p
+     * @param keep Owner of the memory at p (eg an mmap), held as long as this index uses it
+     * @return Number of bytes of the index, or 0 if it is not a valid index
+     */
+    size_t Attach(const char* p, size_t len, SeqPointer<void> keep);
+
+    /** Append the intervals overlapping [start, end] on chr to out, in order of start
+     * @return Number of overlapping intervals
+     */
+    size_t FindOverlapping(int32_t chr, int32_t start, int32_t end, std::vector<FlatInterval>& out) const;
+
+    /** Return the number of intervals overlapping [start, end] on chr */
+    size_t CountOverlapping(int32_t chr, int32_t start, int32_t end) const;
+
+    /** Does any interval overlap [start, end] on chr. Stops at the first hit */
+    bool AnyOverlapping(int32_t chr, int32_t start, int32_t end) const;
+
+  private:
+
+    // intervals of one chromosome, m_a[off, off + n). Fixed size, as it is serialized
+    struct Block {
+
+      Block() : off(0), n(0), level(-1), pad(0) {}
+
+      uint64_t off;
+      uint64_t n;
+      int32_t level; // level of the root, or -1 if empty
+      int32_t pad;
+    };
+
+    // all intervals, grouped by chromosome and sorted by start
+    std::vector<FlatInterval> m_a;
+
+    // chromosome of each interval, only until Index
+    std::vector<int32_t> m_chr;
+
+    // blocks indexed by chromosome ID
+    std::vector<Block> m_blocks;
+
+    bool m_indexed;
+
+    // serialized index in use (Attach), in place of m_a and m_blocks
+    const FlatInterval* m_ext_a;
+    const Block* m_ext_blocks;
+    size_t m_ext_n;
+    size_t m_ext_nblocks;
+    SeqPointer<void> m_keep;
+
+    // call f(interval) on each overlap in order of start, until f returns false
+    template <class F>
+    void visit(int32_t chr, int32_t start, int32_t end, F f) const;
+  };
+
+  template <class F>
+  void FlatIntervalIndex::visit(int32_t chr, int32_t start, int32_t end, F f) const {
+
+    const Block* blocks = m_keep ? m_ext_blocks : (m_blocks.empty() ? NULL : &m_blocks[0]);
+    size_t nblocks = m_keep ? m_ext_nblocks : m_blocks.size();
+    if (chr < 0 || static_cast<size_t>(chr) >= nblocks)
+      return;
+    const Block& b = blocks[chr];
+    if (b.level < 0)
+      return;
+
+    const FlatInterval* a = (m_keep ? m_ext_a : &m_a[0]) + b.off;
+    const int64_t n = b.n;
+
+    // iterative in-order walk, pruning subtrees that end before start
+    struct Node { int64_t x; int k; int w; } stack[64];
+    int t = 0;
+    stack[t].k = b.level, stack[t].x = (1LL << b.level) - 1, stack[t++].w = 0;
+    while (t) {
+      Node z = stack[--t];
+      if (z.k <= 3) { // small subtree: scan it
+	int64_t i0 = z.x >> z.k << z.k, i1 = i0 + (1LL << (z.k + 1)) - 1;
+	if (i1 > n) i1 = n;
+	for (int64_t i = i0; i < i1 && a[i].start <= end; ++i)
+	  if (start <= a[i].end && !f(a[i]))
+	    return;
+      } else if (z.w == 0) { // first visit: come back after the left subtree
+	int64_t y = z.x - (1LL << (z.k - 1));
+	stack[t].k = z.k, stack[t].x = z.x, stack[t++].w = 1;
+	if (y >= n || a[y].max >= start)
+	  stack[t].k = z.k - 1, stack[t].x = y, stack[t++].w = 0;
+      } else if (z.x < n && a[z.x].start <= end) { // second visit: this node, then the right subtree
+	if (start <= a[z.x].end && !f(a[z.x]))
+	  return;
+	stack[t].k = z.k - 1, stack[t].x = z.x + (1LL << (z.k - 1)), stack[t++].w = 0;
+      }
+    }
+  }
+
+}
+
+#endif
@@ -7,6 +7,10 @@
 #include <set>
 #include <stdexcept>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
 #include <zlib.h>
 
 #define GZBUFFER 65472
@@ -173,6 +177,90 @@ bool GenomicRegionCollection<T>::ReadBED(const std::string & file, const BamHead
   return true;
 }
 
+template<class T>
+void GenomicRegionCollection<T>::add_sorted(std::vector<GenomicRegion>& v) {
+
+  std::sort(v.begin(), v.end());
+  bool was_empty = m_grv->empty();
+
+  m_grv->reserve(m_grv->size() + v.size());
+  // as set by the string constructor, which doesn't check pos1 <= pos2
+  T gr;
+  for (std::vector<GenomicRegion>::const_iterator i = v.begin(); i != v.end(); ++i) {
+    gr.chr = i->chr;
+    gr.pos1 = i->pos1;
+    gr.pos2 = i->pos2;
+    m_grv->push_back(gr);
+  }
+
+  if (was_empty)
+    m_sorted = true;
+  else
+    CoordinateSort();
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::ReadBED(const std::string & file, const BamHeader& hdr, int nthreads) {
+
+  idx = 0;
+  std::vector<GenomicRegion> v;
+  if (!ReadRegionFile(file, hdr, false, nthreads, v))
+    return false;
+  add_sorted(v);
+  return true;
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr, int nthreads) {
+
+  idx = 0;
+  std::vector<GenomicRegion> v;
+  if (!ReadRegionFile(file, hdr, true, nthreads, v))
+    return false;
+  add_sorted(v);
+  return true;
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::WriteRegionIndex(const std::string& file, const BamHeader& hdr) {
+
+  CreateFlatIndex();
+
+  std::vector<RegionIndexRecord> r(m_grv->size());
+  for (size_t i = 0; i < r.size(); ++i) {
+    const T& g = m_grv->at(i);
+    r[i].chr = g.chr;
+    r[i].pos1 = g.pos1;
+    r[i].pos2 = g.pos2;
+    r[i].strand = g.strand;
+  }
+  return WriteRegionIndexFile(file, hdr, r, *m_flat);
+}
+
+template<class T>
+bool GenomicRegionCollection<T>::LoadRegionIndex(const std::string& file, const BamHeader& hdr) {
+
+  const RegionIndexRecord* r;
+  size_t n;
+  FlatIntervalIndex fi;
+  if (!MapRegionIndexFile(file, hdr, &r, &n, fi))
+    return false;
+
+  clear();
+  m_grv->reserve(n);
+  T gr;
+  for (size_t i = 0; i < n; ++i) {
+    gr.chr = r[i].chr;
+    gr.pos1 = r[i].pos1;
+    gr.pos2 = r[i].pos2;
+    gr.strand = r[i].strand;
+    m_grv->push_back(gr);
+  }
+  *m_flat = fi;
+  m_sorted = true;
+  return true;
+}
+
 template<class T>
 bool GenomicRegionCollection<T>::ReadVCF(const std::string & file, const BamHeader& hdr) {
 
@@ -301,6 +389,7 @@ void GenomicRegionCollection<T>::MergeOverlappingIntervals() {
 
   // clear the old interval tree
   m_tree->clear();
+  m_flat->clear();
 }
 
 template <class T>
@@ -314,6 +403,8 @@ GenomicRegionVector GenomicRegionCollection<T>::AsGenomicRegionVector() const {
 template <class T>
 void GenomicRegionCollection<T>::CreateTreeMap() {
 
+  // queries go to whichever index was built last
+  m_flat->clear();
   if (!m_grv->size())
     return;
 
@@ -340,6 +431,24 @@ void GenomicRegionCollection<T>::CreateTreeMap() {
 
 }
 
+template <class T>
+void GenomicRegionCollection<T>::CreateFlatIndex() {
+
+  m_flat->clear();
+  if (!m_grv->size())
+    return;
+
+  // sort the genomic intervals, so IDs match CreateTreeMap
+  if (!m_sorted)
+    CoordinateSort();
+
+  for (size_t i = 0; i < m_grv->size(); ++i) {
+    const T& g = m_grv->at(i);
+    m_flat->Add(g.chr, g.pos1, g.pos2, i);
+  }
+  m_flat->Index();
+}
+
 template<class T>
 int GenomicRegionCollection<T>::TotalWidth() const { 
   int wid = 0; 
@@ -395,6 +504,9 @@ GenomicRegionCollection<T>::GenomicRegionCollection(int width, int ovlp, const T
 template<class T>
 size_t GenomicRegionCollection<T>::CountOverlaps(const T &gr) const {
 
+  if (use_flat())
+    return m_flat->CountOverlapping(gr.chr, gr.pos1, gr.pos2);
+
   if (m_tree->size() == 0 && m_grv->size() != 0) 
     {
       std::cerr << "!!!!!! WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
@@ -418,6 +530,26 @@ size_t GenomicRegionCollection<T>::CountOverlaps(const T &gr) const {
     if (gr1.chr != gr2.chr)
       return false;
     
+    // collect the values from the flat index, or the trees
+    std::vector<FlatInterval> fiv1, fiv2;
+    if (use_flat()) {
+      m_flat->FindOverlapping(gr1.chr, gr1.pos1, gr1.pos2, fiv1);
+      m_flat->FindOverlapping(gr2.chr, gr2.pos1, gr2.pos2, fiv2);
+      if (fiv1.empty() || fiv2.empty())
+	return false;
+      // both sorted by start, and so by value
+      std::vector<FlatInterval>::const_iterator i = fiv1.begin(), j = fiv2.begin();
+      while (i != fiv1.end() && j != fiv2.end()) {
+	if (i->value == j->value)
+	  return true;
+	if (i->value < j->value)
+	  ++i;
+	else
+	  ++j;
+      }
+      return false;
+    }
+
     if (m_tree->size() == 0 && m_grv->size() != 0) {
       std::cerr << "!!!!!! WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
       return false;
@@ -495,6 +627,7 @@ void GenomicRegionCollection<T>::allocate_grc() {
   m_sorted = false;
   m_grv =  SeqPointer<std::vector<T> >(new std::vector<T>()) ;
   m_tree = SeqPointer<GenomicIntervalTreeMap>(new GenomicIntervalTreeMap()) ;
+  m_flat = SeqPointer<FlatIntervalIndex>(new FlatIntervalIndex()) ;
 }
 
 template<class T>
@@ -523,6 +656,16 @@ template<class T>
 template<class K>
 std::vector<int> GenomicRegionCollection<T>::FindOverlappedIntervals(const K& gr, bool ignore_strand) const {  
 
+  if (use_flat()) {
+    std::vector<FlatInterval> fiv;
+    m_flat->FindOverlapping(gr.chr, gr.pos1, gr.pos2, fiv);
+    std::vector<int> output;  
+    for (std::vector<FlatInterval>::const_iterator i = fiv.begin(); i != fiv.end(); ++i)
+      if (ignore_strand || m_grv->at(i->value).strand == gr.strand) 
+	output.push_back(i->value);
+    return output;
+  }
+
   if (m_tree->size() == 0 && m_grv->size() != 0) 
     throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
   
@@ -573,6 +716,15 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
 
   GenomicRegionCollection<GenomicRegion> output;
 
+  if (use_flat()) {
+    std::vector<FlatInterval> fiv;
+    m_flat->FindOverlapping(gr.chr, gr.pos1, gr.pos2, fiv);
+    for (std::vector<FlatInterval>::const_iterator j = fiv.begin(); j != fiv.end(); ++j)
+      if (ignore_strand || (m_grv->at(j->value).strand == gr.strand) ) 
+	output.add(GenomicRegion(gr.chr, std::max(j->start, gr.pos1), std::min(j->end, gr.pos2)));
+    return output;
+  }
+
   if (m_tree->size() == 0 && m_grv->size() != 0) 
     throw std::logic_error("Need to run CreateTreeMap to make the interval tree before doing range queries");
   
@@ -609,70 +761,259 @@ GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(
   
 }
 
-  // this is query
-  template<class T>
-  template<class K>
-GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(const GenomicRegionCollection<K>& subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand) const
-{  
+template<class T>
+bool GenomicRegionCollection<T>::IsCoordinateSorted() const {
+  for (size_t i = 1; i < m_grv->size(); ++i) {
+    const T& a = (*m_grv)[i-1];
+    const T& b = (*m_grv)[i];
+    if (b.chr < a.chr || (b.chr == a.chr && b.pos1 < a.pos1))
+      return false;
+  }
+  return true;
+}
 
-  GenomicRegionCollection<GenomicRegion> output;
-  if (subject.NumTree() == 0 && subject.size() != 0) {
-    std::cerr << "!!!!!! findOverlaps: WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
-    return output;
+// orders subject IDs by end, latest first, for a min-heap on end
+template<class K>
+struct _SubjectEndGreater {
+  _SubjectEndGreater(typename std::vector<K>::const_iterator s) : m_s(s) {}
+  bool operator()(size_t a, size_t b) const { return m_s[a].pos2 > m_s[b].pos2; }
+  typename std::vector<K>::const_iterator m_s;
+};
+
+template<class T>
+template<class K, class F>
+void GenomicRegionCollection<T>::sweep_overlaps(size_t qb, size_t qe, typename std::vector<K>::const_iterator s, 
+						 size_t sb, size_t se, F& f, bool ignore_strand) const {
+
+  // subjects that start before the current query, in a min-heap on their end.
+  // Queries come in order of start, so a subject that ends before one query
+  // ends before all the later ones too. Everything left in the heap overlaps
+  std::vector<size_t> started;
+  _SubjectEndGreater<K> ends_later(s);
+  std::vector<size_t> hits;
+  size_t j = sb; // first subject not yet started
+  int32_t chr = 0;
+
+  for (size_t i = qb; i < qe; ++i) {
+    const T& q = (*m_grv)[i];
+
+    if (i == qb || q.chr != chr) {
+      started.clear();
+      chr = q.chr;
+      while (j < se && s[j].chr < chr)
+	++j;
+    }
+
+    while (j < se && s[j].chr == chr && s[j].pos1 < q.pos1) {
+      started.push_back(j++);
+      std::push_heap(started.begin(), started.end(), ends_later);
+    }
+    while (!started.empty() && s[started.front()].pos2 < q.pos1) {
+      std::pop_heap(started.begin(), started.end(), ends_later);
+      started.pop_back();
+    }
+
+    // subjects that started earlier, in subject order
+    hits.clear();
+    for (std::vector<size_t>::const_iterator m = started.begin(); m != started.end(); ++m)
+      if (ignore_strand || s[*m].strand == q.strand)
+	hits.push_back(*m);
+    std::sort(hits.begin(), hits.end());
+    for (std::vector<size_t>::const_iterator m = hits.begin(); m != hits.end(); ++m)
+      f(i, *m, chr, q.pos1, std::min(s[*m].pos2, q.pos2));
+
+    // then the subjects that start inside the query, which all overlap it
+    for (size_t k = j; k < se && s[k].chr == chr && s[k].pos1 <= q.pos2; ++k)
+      if (ignore_strand || s[k].strand == q.strand)
+	f(i, k, chr, s[k].pos1, std::min(s[k].pos2, q.pos2));
   }
+}
+
+template<class T>
+template<class K, class F>
+void GenomicRegionCollection<T>::for_each_overlap(const GenomicRegionCollection<K>& subject, F& f, bool ignore_strand) const {
+
+  // a single merge of both sorted lists
+  if (IsCoordinateSorted() && subject.IsCoordinateSorted()) {
+    sweep_overlaps<K>(0, m_grv->size(), subject.begin(), 0, subject.size(), f, ignore_strand);
+    return;
+  }
+
+  if (subject.NumTree() == 0 && subject.GetFlatIndex()->empty() && subject.size() != 0)
+    throw std::logic_error("Need to run CreateTreeMap or CreateFlatIndex on the subject, or sort both collections, before finding overlaps");
 
   // we loop through query, so want it to be smaller
   if (subject.size() < m_grv->size() && m_grv->size() - subject.size() > 20) 
     std::cerr << "findOverlaps warning: Suggest switching query and subject for efficiency." << std::endl;
 
-#ifdef DEBUG_OVERLAPS
-  std::cerr << "OVERLAP SUBJECT: " << std::endl;
-  for (auto& i : subject)
-    std::cerr << i << std::endl;
-#endif
+  // query the subject's flat index if it has one
+  const FlatIntervalIndex* flat = subject.GetFlatIndex();
+  if (!flat->empty()) {
+    std::vector<FlatInterval> fiv;
+    for (size_t i = 0; i < m_grv->size(); ++i) {
+      const T& q = m_grv->at(i);
+      fiv.clear();
+      flat->FindOverlapping(q.chr, q.pos1, q.pos2, fiv);
+      for (std::vector<FlatInterval>::const_iterator j = fiv.begin(); j != fiv.end(); ++j)
+	if (ignore_strand || (subject.at(j->value).strand == q.strand) )
+	  f(i, j->value, q.chr, std::max(j->start, q.pos1), std::min(j->end, q.pos2));
+    }
+    return;
+  }
 
   // loop through the query GRanges (this) and overlap with subject
   for (size_t i = 0; i < m_grv->size(); ++i) 
     {
-      // which chr (if any) are common between query and subject
-      GenomicIntervalTreeMap::const_iterator ff = subject.GetTree()->find(m_grv->at(i).chr);
+      const T& q = m_grv->at(i);
 
-      GenomicIntervalVector giv;
+      // which chr (if any) are common between query and subject
+      GenomicIntervalTreeMap::const_iterator ff = subject.GetTree()->find(q.chr);
 
-#ifdef DEBUG_OVERLAPS
-      std::cerr << "TRYING OVERLAP ON QUERY " << m_grv->at(i) << std::endl;
-#endif
       //must as least share a chromosome
-      if (ff != m_tree->end())
-	{
-	  // get the subject hits
-	  ff->second.findOverlapping(m_grv->at(i).pos1, m_grv->at(i).pos2, giv);
+      if (ff == subject.GetTree()->end())
+	continue;
 
-#ifdef DEBUG_OVERLAPS
-	  std::cerr << "ff->second.intervals.size() " << ff->second.intervals.size() << std::endl;
-	  for (auto& k : ff->second.intervals)
-	    std::cerr << " intervals " << k.start << " to " << k.stop << " value " << k.value << std::endl;
-	  std::cerr << "GIV NUMBER OF HITS " << giv.size() << " for query " << m_grv->at(i) << std::endl;
-#endif
-	  // loop through the hits and define the GenomicRegion
-	  for (GenomicIntervalVector::const_iterator j = giv.begin(); j != giv.end(); ++j) {
-	    //for (auto& j : giv) { // giv points to positions on subject
-	    if (ignore_strand || (subject.at(j->value).strand == m_grv->at(i).strand) ) {
-	      query_id.push_back(i);
-	      subject_id.push_back(j->value);
-#ifdef DEBUG_OVERLAPS
-	      std::cerr << "find overlaps hit " << j->start << " " << j->stop << " -- " << j->value << std::endl;
-#endif
-	      output.add(GenomicRegion(m_grv->at(i).chr, std::max(static_cast<int32_t>(j->start), m_grv->at(i).pos1), std::min(static_cast<int32_t>(j->stop), m_grv->at(i).pos2)));
-	    }
-	  }
-	}
+      // get the subject hits
+      GenomicIntervalVector giv;
+      ff->second.findOverlapping(q.pos1, q.pos2, giv);
+
+      // loop through the hits and define the GenomicRegion
+      for (GenomicIntervalVector::const_iterator j = giv.begin(); j != giv.end(); ++j) 
+	if (ignore_strand || (subject.at(j->value).strand == q.strand) )
+	  f(i, j->value, q.chr, std::max(static_cast<int32_t>(j->start), q.pos1), std::min(static_cast<int32_t>(j->stop), q.pos2));
     }
+}
+
+// gathers the overlaps for FindOverlaps
+struct _OverlapCollect {
+
+  _OverlapCollect(GenomicRegionCollection<GenomicRegion>& o, std::vector<int32_t>& q, std::vector<int32_t>& s)
+  : output(o), query_id(q), subject_id(s) {}
+
+  void operator()(size_t i, size_t j, int32_t chr, int32_t start, int32_t end) {
+    query_id.push_back(i);
+    subject_id.push_back(j);
+    output.add(GenomicRegion(chr, start, end));
+  }
+
+  GenomicRegionCollection<GenomicRegion>& output;
+  std::vector<int32_t>& query_id;
+  std::vector<int32_t>& subject_id;
+};
+
+// passes the overlaps on for the streaming FindOverlaps
+struct _OverlapStream {
 
+  _OverlapStream(const OverlapCallback& c) : cb(c), count(0) {}
+
+  void operator()(size_t i, size_t j, int32_t, int32_t, int32_t) {
+    cb(i, j);
+    ++count;
+  }
+
+  const OverlapCallback& cb;
+  size_t count;
+};
+
+  // this is query
+  template<class T>
+  template<class K>
+GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlaps(const GenomicRegionCollection<K>& subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand) const
+{  
+
+  GenomicRegionCollection<GenomicRegion> output;
+  if (subject.NumTree() == 0 && subject.GetFlatIndex()->empty() && subject.size() != 0 &&
+      !(IsCoordinateSorted() && subject.IsCoordinateSorted())) {
+    std::cerr << "!!!!!! findOverlaps: WARNING: Trying to find overlaps on empty tree. Need to run this->createTreeMap() somewhere " << std::endl;
+    return output;
+  }
+
+  _OverlapCollect f(output, query_id, subject_id);
+  for_each_overlap(subject, f, ignore_strand);
   return output;
-  
 }
 
+template<class T>
+template<class K>
+size_t GenomicRegionCollection<T>::FindOverlaps(const GenomicRegionCollection<K>& subject, const OverlapCallback& cb, bool ignore_strand) const
+{
+  _OverlapStream f(cb);
+  for_each_overlap(subject, f, ignore_strand);
+  return f.count;
+}
+
+template<class T>
+template<class K>
+GenomicRegionCollection<GenomicRegion> GenomicRegionCollection<T>::FindOverlapsParallel(const GenomicRegionCollection<K>& subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand, int nthreads) const
+{
+  if (nthreads < 1)
+    throw std::invalid_argument("FindOverlapsParallel - nthreads must be > 0");
+  if (!IsCoordinateSorted() || !subject.IsCoordinateSorted())
+    throw std::logic_error("FindOverlapsParallel - both collections must be coordinate sorted (see CoordinateSort)");
+
+  // one job per query chromosome: the queries [qb, qe) and the subjects [sb, se) on it
+  struct Job { size_t qb, qe, sb, se; };
+  std::vector<Job> jobs;
+  typename std::vector<K>::const_iterator s = subject.begin();
+  size_t sb = 0;
+  for (size_t qb = 0; qb < m_grv->size(); ) {
+    int32_t chr = (*m_grv)[qb].chr;
+    size_t qe = qb;
+    while (qe < m_grv->size() && (*m_grv)[qe].chr == chr)
+      ++qe;
+    while (sb < subject.size() && s[sb].chr < chr)
+      ++sb;
+    size_t se = sb;
+    while (se < subject.size() && s[se].chr == chr)
+      ++se;
+    Job jb = { qb, qe, sb, se };
+    jobs.push_back(jb);
+    qb = qe;
+    sb = se;
+  }
+
+  // each chromosome collects on its own, then they are joined in order
+  std::vector<GenomicRegionCollection<GenomicRegion> > outs(jobs.size());
+  std::vector<std::vector<int32_t> > qids(jobs.size()), sids(jobs.size());
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> abort(false);
+  std::mutex mtx;
+  std::exception_ptr error;
+
+  auto work = [&]() {
+    try {
+      for (size_t i = next++; i < jobs.size() && !abort; i = next++) {
+	_OverlapCollect f(outs[i], qids[i], sids[i]);
+	sweep_overlaps<K>(jobs[i].qb, jobs[i].qe, s, jobs[i].sb, jobs[i].se, f, ignore_strand);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!error)
+	error = std::current_exception();
+      abort = true;
+    }
+  };
+
+  if (static_cast<size_t>(nthreads) > jobs.size())
+    nthreads = jobs.size() ? jobs.size() : 1;
+  std::vector<std::thread> workers;
+  for (int t = 1; t < nthreads; ++t)
+    workers.push_back(std::thread(work));
+  work();
+  for (std::vector<std::thread>::iterator t = workers.begin(); t != workers.end(); ++t)
+    t->join();
+  if (error)
+    std::rethrow_exception(error);
+
+  GenomicRegionCollection<GenomicRegion> output;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    output.Concat(outs[i]);
+    query_id.insert(query_id.end(), qids[i].begin(), qids[i].end());
+    subject_id.insert(subject_id.end(), sids[i].begin(), sids[i].end());
+  }
+  return output;
+}
 
 template<class T>
 GenomicRegionCollection<T>::GenomicRegionCollection(const T& gr)
@@ -5,17 +5,64 @@
 #include <string>
 #include <cstdlib>
 #include <list>
+#include <functional>
 
 #include "SeqLib/IntervalTree.h"
+#include "SeqLib/FlatIntervalIndex.h"
 #include "SeqLib/GenomicRegionCollection.h"
 #include "SeqLib/BamRecord.h"
 
 namespace SeqLib {
 
+  /** Parse the regions of a BED or VCF file (plain, gzip or bgzip), as 
+   * GenomicRegionCollection::ReadBED / ReadVCF with nthreads do
+   * @param file Path to the file, or "-" for stdin
+   * @param hdr Dictionary for converting chromosome strings to chr indicies
+   * @param vcf Read the file as VCF (width 1 regions at POS), else as BED
+   * @param nthreads Number of threads for decompression and parsing
+   * @param out Regions are appended to this, in file order
+   * @return True if the file was read
+   */
+  bool ReadRegionFile(const std::string& file, const BamHeader& hdr, bool vcf, int nthreads, std::vector<GenomicRegion>& out);
+
+  /** One region as stored in a region index file. See GenomicRegionCollection::WriteRegionIndex */
+  struct RegionIndexRecord {
+    int32_t chr;
+    int32_t pos1;
+    int32_t pos2;
+    int32_t strand;
+  };
+
+  /** Write a region index file, as GenomicRegionCollection::WriteRegionIndex does
+   * @param file Path to write to
+   * @param hdr Contig dictionary to store. May be empty
+   * @param regions Regions, in the order of the IDs in fi
+   * @param fi Built flat index of the regions
+   * @return True if the file was written
+   */
+  bool WriteRegionIndexFile(const std::string& file, const BamHeader& hdr,
+			    const std::vector<RegionIndexRecord>& regions, const FlatIntervalIndex& fi);
+
+  /** Memory map a region index file, as GenomicRegionCollection::LoadRegionIndex does
+   * @param file Path to a file from WriteRegionIndexFile
+   * @param hdr Dictionary the file's contigs must match (same names and IDs). Not checked if empty
+   * @param regions Set to the regions, inside the mapping
+   * @param n Set to the number of regions
+   * @param fi Set to use the index inside the mapping. Keeps the mapping open
+   * @return True if the file was mapped, false if unreadable, invalid or from another dictionary
+   */
+  bool MapRegionIndexFile(const std::string& file, const BamHeader& hdr,
+			  const RegionIndexRecord** regions, size_t* n, FlatIntervalIndex& fi);
+
   /** Simple structure to store overlap results 
    */
   typedef std::pair<size_t, size_t> OverlapResult;
 
+  /** Function called on each overlap by the streaming GenomicRegionCollection::FindOverlaps.
+   * Gets the index of the interval in the query collection and in the subject collection.
+   */
+  typedef std::function<void(size_t query_id, size_t subject_id)> OverlapCallback;
+
 /** Class to store vector of intervals on the genome */
 typedef TInterval<int32_t> GenomicInterval;
 typedef SeqHashMap<int, std::vector<GenomicInterval> > GenomicIntervalMap;
@@ -93,6 +140,51 @@ class GenomicRegionCollection {
    */
   bool ReadVCF(const std::string &file, const SeqLib::BamHeader& hdr);
 
+  /** Read in a BED file on several threads, and coordinate sort the collection.
+   *
+   * The file is decompressed (multi-threaded for bgzip) and parsed in large
+   * chunks, each split across the threads on line boundaries, and each distinct
+   * chromosome name is looked up in hdr only once. Lines with a '#', and track
+   * and browser lines, are skipped, as are chromosomes not in hdr.
+   * @param file Path to BED file (plain, gzip or bgzip)
+   * @param hdr Dictionary for converting chromosome strings in BED file to chr indicies
+   * @param nthreads Number of threads, including the calling thread
+   * @return True if file was succesfully read
+   * @exception Throws invalid_argument on a line without 3 columns or with a bad position
+   */
+  bool ReadBED(const std::string &file, const SeqLib::BamHeader& hdr, int nthreads);
+
+  /** Read in a VCF file on several threads, and coordinate sort the collection. See ReadBED
+   * @param file Path to VCF file. All elements will be width = 1 (just read start point)
+   * @param hdr Dictionary for converting chromosome strings in VCF file to chr indicies
+   * @param nthreads Number of threads, including the calling thread
+   * @return True if file was succesfully read
+   */
+  bool ReadVCF(const std::string &file, const SeqLib::BamHeader& hdr, int nthreads);
+
+  /** Write the collection, with its flat index and contig dictionary, to a binary region index file.
+   *
+   * The file holds the coordinate sorted regions and the flat index in the
+   * layout used in memory, so LoadRegionIndex can map it and query it
+   * straight away instead of re-reading and sorting a BED file. Sorts the
+   * collection and builds the flat index (CreateFlatIndex) first.
+   * @param file Path to write to
+   * @param hdr Dictionary the chr IDs refer to, checked when loading
+   * @return True if the file was written
+   */
+  bool WriteRegionIndex(const std::string& file, const BamHeader& hdr);
+
+  /** Replace the collection with the regions of a region index file (see WriteRegionIndex).
+   *
+   * The file is memory mapped and the flat index is used in place, so
+   * CountOverlaps / FindOverlaps work without building any index. The
+   * regions themselves are copied out of the mapping.
+   * @param file Path to a file from WriteRegionIndex
+   * @param hdr Dictionary to check the file's contigs against. Not checked if empty
+   * @return True if loaded. False if the file is unreadable, invalid, or made with another dictionary
+   */
+  bool LoadRegionIndex(const std::string& file, const BamHeader& hdr);
+
   /** Shuffle the order of the intervals */
  void Shuffle();
 
@@ -113,8 +205,22 @@ class GenomicRegionCollection {
    * A GenomicIntervalTreeMap is an unordered_map of GenomicIntervalTrees for 
    * each chromosome. A GenomicIntervalTree is an interval tree on the ranges
    * defined by the genomic interval, with cargo set at the same GenomicRegion object.
+   * Drops any flat index, so queries go to the new trees.
    */
   void CreateTreeMap();
+
+  /** Create a flat interval index (one sorted array per chromosome) in place of
+   * the interval trees.
+   *
+   * Once built, CountOverlaps, FindOverlaps, FindOverlappedIntervals and 
+   * OverlapSameInterval query the flat index instead of the trees. It takes 
+   * 16 bytes per interval in one block, and a query scans contiguous memory 
+   * rather than following tree nodes around the heap, which matters for 
+   * collections of millions of intervals queried once per read. IDs are the
+   * same as with CreateTreeMap. Queries use whichever of the two was built 
+   * last. See FlatIntervalIndex
+   */
+  void CreateFlatIndex();
   
   /** Reduces the GenomicRegion objects to minimal set by merging overlapping intervals
    * @note This will merge intervals that touch. eg [4,6] and [6,8]
@@ -138,6 +244,7 @@ class GenomicRegionCollection {
    */
   void clear() { m_grv->clear(); 
 		 m_tree->clear(); 
+		 m_flat->clear();
 		 idx = 0;
   }
 
@@ -161,6 +268,9 @@ class GenomicRegionCollection {
  /** Get a const pointer to the genomic interval tree map */
  const GenomicIntervalTreeMap* GetTree() const { return m_tree.get(); }
 
+ /** Get a const pointer to the flat interval index (empty if CreateFlatIndex has not been run) */
+ const FlatIntervalIndex* GetFlatIndex() const { return m_flat.get(); }
+
   /** Retrieve a GenomicRegion at given index. 
    * 
    * Note that this does not move the idx iterator, which is 
@@ -199,6 +309,43 @@ class GenomicRegionCollection {
  template<class K>
  GenomicRegionCollection<GenomicRegion> FindOverlaps(const GenomicRegionCollection<K> &subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand) const;
 
+ /** Stream the overlaps between the collection and the subject collection, without storing them
+  *
+  * Overlaps come in the same order as the query_id / subject_id of FindOverlaps.
+  * If both collections are coordinate sorted (see IsCoordinateSorted), they are
+  * joined with a single sweep over both, and no interval tree is needed. The sweep
+  * takes O((n + m) log m + overlaps), however long the query intervals are. Otherwise 
+  * the subject's flat index or interval tree is queried once per interval here.
+  * @param subject Subject collection of intervals
+  * @param cb Called with the indices of the query (this) and subject interval of each overlap
+  * @param ignore_strand If true, won't exclude overlap if on different strand
+  * @return Number of overlaps
+  * @exception Throws a logic_error if the collections are not both sorted and the
+  * subject has no flat index or interval tree
+  */
+ template<class K>
+ size_t FindOverlaps(const GenomicRegionCollection<K> &subject, const OverlapCallback& cb, bool ignore_strand) const;
+
+ /** Return the overlaps between two coordinate sorted collections, joining each
+  * chromosome on its own thread.
+  * 
+  * The output is the same, and in the same order, as FindOverlaps.
+  * @param subject Coordinate sorted subject collection of intervals
+  * @param query_id Indices of the queries that have an overlap
+  * @param subject_id Indices of the subject that have an overlap
+  * @param ignore_strand If true, won't exclude overlap if on different strand
+  * @param nthreads Number of threads, including the calling thread
+  * @return A collection of overlapping intervals from this collection, trimmed to be contained
+  * inside the query collection
+  * @exception Throws a logic_error if either collection is not coordinate sorted,
+  * and invalid_argument if nthreads < 1
+  */
+ template<class K>
+ GenomicRegionCollection<GenomicRegion> FindOverlapsParallel(const GenomicRegionCollection<K> &subject, std::vector<int32_t>& query_id, std::vector<int32_t>& subject_id, bool ignore_strand, int nthreads) const;
+
+ /** Are the intervals in order of chromosome and then start (eg after CoordinateSort) */
+ bool IsCoordinateSorted() const;
+
  /** Return the overlaps between the collection and the query interval
   * @param gr Query region 
   * @param ignore_strand If true, won't exclude overlap if on different strand
@@ -292,6 +439,9 @@ class GenomicRegionCollection {
  
  // always construct this object any time m_grv is modifed
  SeqPointer<GenomicIntervalTreeMap> m_tree;
+
+ // flat alternative to m_tree, used for queries when not empty
+ SeqPointer<FlatIntervalIndex> m_flat;
  
  // hold the genomic regions
  SeqPointer<std::vector<T> > m_grv; 
@@ -302,6 +452,21 @@ class GenomicRegionCollection {
  // open the memory
  void allocate_grc();
 
+ // add regions read from a file, and sort
+ void add_sorted(std::vector<GenomicRegion>& v);
+
+ // is the flat index built (and so used for queries)
+ bool use_flat() const { return !m_flat->empty(); }
+
+ // call f(query, subject, start, end) on each overlap with subject, by sweep if
+ // both are sorted, else by index. start/end are the overlap clipped to the query
+ template<class K, class F>
+ void for_each_overlap(const GenomicRegionCollection<K> &subject, F& f, bool ignore_strand) const;
+
+ // sweep queries [qb, qe) of this against subject intervals s[sb, se), both sorted
+ template<class K, class F>
+ void sweep_overlaps(size_t qb, size_t qe, typename std::vector<K>::const_iterator s, size_t sb, size_t se, F& f, bool ignore_strand) const;
+
 };
 
 typedef GenomicRegionCollection<GenomicRegion> GRC;
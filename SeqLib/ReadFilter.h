@@ -144,7 +144,7 @@ public:
    * @param val Query value (e.g. mapping quality)
    * @return true if the value passes this Range rule
    */
-  bool isValid(int val) {
+  bool isValid(int val) const {
     if (m_every)
       return true;
     if (!m_inverted)
@@ -190,6 +190,8 @@ private:
  */
 class FlagRule {
 
+  friend struct _CompiledRule;
+
  public:
 
   FlagRule() {
@@ -294,6 +296,7 @@ class AbstractRule {
 
   friend class ReadFilter;
   friend class ReadFilterCollection;
+  friend struct _CompiledRule;
 
  public:
 
@@ -385,6 +388,10 @@ class AbstractRule {
 
   void parseSubLine(const Json::Value& value);
 
+  // the subsample and read group checks, shared with _CompiledRule
+  bool isValidSubsample(const BamRecord& r) const;
+  bool isValidReadGroup(const BamRecord& r) const;
+
 };
 
 class ReadFilterCollection;
@@ -398,6 +405,7 @@ class ReadFilterCollection;
 class ReadFilter {
   
   friend class ReadFilterCollection;
+  friend struct _CompiledFilter;
 
   public:
 
@@ -483,6 +491,92 @@ class ReadFilter {
 
 };
 
+/** An AbstractRule flattened for fast evaluation by ReadFilterCollection.
+ *
+ * Flag requirements (named flags, allflag, pair-mapped for orientation rules)
+ * are folded into a single mask / value pair, inactive Ranges are dropped and
+ * "need" records which read fields must be looked at, so that an empty rule
+ * touches nothing and the sequence is only decoded for motif rules.
+ */
+struct _CompiledRule {
+
+  enum {
+    NEED_MAPQ      = 1 << 0,
+    NEED_ISIZE     = 1 << 1,
+    NEED_SUBSAMPLE = 1 << 2,
+    NEED_RG        = 1 << 3,
+    NEED_INDEL     = 1 << 4,
+    NEED_HARDCLIP  = 1 << 5,
+    NEED_ORIENT    = 1 << 6,
+    NEED_NM        = 1 << 7,
+    NEED_XP        = 1 << 8,
+    NEED_LEN       = 1 << 9,
+    NEED_CLIP      = 1 << 10,
+    NEED_NBASES    = 1 << 11,
+    NEED_MOTIF     = 1 << 12
+  };
+
+  /** Flatten an AbstractRule
+   * @param ar Rule to compile
+   * @param idx Position of the rule in its ReadFilter
+   */
+  _CompiledRule(const AbstractRule& ar, size_t idx);
+
+  /** Evaluate the rule. Is the same as AbstractRule::isValid on the source rule
+   * @param r Read to query
+   * @param ar The rule this was compiled from (for read group, subsampling and motifs)
+   */
+  bool isValid(const BamRecord& r, const AbstractRule& ar) const;
+
+  size_t rule;        ///< Index of the source rule in ReadFilter
+  uint32_t need;      ///< NEED_* bits for the checks this rule has to run
+  bool never;         ///< Flag requirements contradict each other; nothing passes
+
+  uint32_t flag_mask; ///< Pass requires (flag & flag_mask) == flag_val
+  uint32_t flag_val;  ///< See flag_mask
+  uint32_t all_off;   ///< Fail if all of these bits are on
+  uint32_t any_on;    ///< Fail if none of these bits are on
+  uint32_t any_off;   ///< Fail if any of these bits are on
+
+  Range mapq, isize, ins, del, nm, xp, len, clip, nbases; ///< Copies of the source ranges
+  Flag hardclip, ff, fr, rf, rr, ic; ///< Copies of the source flags needing more than the flag field
+
+private:
+
+  void require(uint32_t bit, bool on);
+
+};
+
+/** A ReadFilter flattened for fast evaluation by ReadFilterCollection.
+ *
+ * Regions are stored per chromosome as sorted, merged [start, end] pairs,
+ * so an overlap query is one binary search.
+ */
+struct _CompiledFilter {
+
+  /** Flatten a ReadFilter
+   * @param rf Filter to compile
+   * @param idx Position of the filter in the ReadFilterCollection
+   */
+  _CompiledFilter(const ReadFilter& rf, size_t idx);
+
+  /** Same as ReadFilter::isReadOverlappingRegion on the source filter */
+  bool overlaps(const BamRecord& r) const;
+
+  size_t filter;   ///< Index of the source filter in ReadFilterCollection
+  bool excluder;   ///< Source filter is an excluder
+  bool mate;       ///< Source filter is mate linked
+  bool whole_genome; ///< Source filter has no regions
+
+  std::vector<std::vector<std::pair<int32_t, int32_t> > > regions; ///< Merged intervals, indexed by chr id
+  std::vector<_CompiledRule> rules; ///< Compiled rules, in the order of the source filter
+
+private:
+
+  bool overlaps(int32_t chr, int32_t pos1, int32_t pos2) const;
+
+};
+
 /** A full set of rules across any number of regions
  *
  * Stores the entire set of ReadFilter, each defined on a unique interval.
@@ -497,7 +591,7 @@ class ReadFilterCollection {
   /** Construct an empty ReadFilterCollection 
    * that will pass all reads.
    */
- ReadFilterCollection() : m_count(0), m_count_seen(0) {}
+ ReadFilterCollection() : m_count(0), m_count_seen(0), m_compiled(false) {}
 
   /** Create a new filter collection directly from a JSON 
    * @param script A JSON file or directly as JSON formatted string
@@ -520,8 +614,30 @@ class ReadFilterCollection {
   void addGlobalRule(const std::string& rule);
 
   /** Query a read to see if it passes any one of the
-   * filters contained in this collection */
+   * filters contained in this collection
+   * @note The first call compiles the filters (see Compile)
+   * @note Every filter overlapping the read is run, so the filter and
+   * rule pass counts include all the filters a read passes
+   */
   bool isValid(const BamRecord &r);
+
+  /** Flatten the filters into the form used by isValid.
+   * 
+   * Each rule is reduced to a single flag mask test plus only the
+   * checks it actually sets, and regions to sorted arrays. Is done
+   * on the first call to isValid if not called first, and again after
+   * the filters are changed (AddReadFilter, CheckHasIncluder).
+   */
+  void Compile();
+
+  /** Query the first n reads of a batch (eg from BamReader::GetNextBatch)
+   * and move the ones that pass to the front, keeping their order.
+   * Reads are swapped within the batch, not copied.
+   * @param batch Reads to filter
+   * @param n Number of reads in batch to query
+   * @return Number of reads that passed, now at batch[0, return)
+   */
+  size_t FilterBatch(BamRecordVector& batch, size_t n);
   
   /** Print some basic information about this object */
   friend std::ostream& operator<<(std::ostream& out, const ReadFilterCollection &mr);
@@ -571,6 +687,10 @@ class ReadFilterCollection {
   // store all of the individual filters
   std::vector<ReadFilter> m_regions;
 
+  // m_regions flattened for isValid, excluders first
+  std::vector<_CompiledFilter> m_program;
+  bool m_compiled;
+
   bool ParseFilterObject(const std::string& filterName, const Json::Value& filterObject);
 
 };
@@ -0,0 +1,69 @@
+#ifndef SEQLIB_SEQ_DECODE_H
+#define SEQLIB_SEQ_DECODE_H
+
+#include <stdint.h>
+#include <cstddef>
+
+namespace SeqLib {
+
+  /** Instruction sets the sequence / quality kernels can run with */
+  enum SeqDecodeLevel {
+    SEQ_DECODE_SCALAR = 0, ///< Plain C++, table driven
+    SEQ_DECODE_SSSE3 = 1,  ///< 16 bytes at a time (SSE2, plus SSSE3 for table lookups)
+    SEQ_DECODE_AVX2 = 2    ///< 32 bytes at a time
+  };
+
+  /** Return the best kernel level this CPU (and build) supports */
+  SeqDecodeLevel SeqDecodeBestLevel();
+
+  /** Return the kernel level currently in use. Defaults to SeqDecodeBestLevel() */
+  SeqDecodeLevel GetSeqDecodeLevel();
+
+  /** Cap the kernel level (e.g. to compare against scalar in a benchmark).
+   * @note Is clamped to SeqDecodeBestLevel(). Applies to all threads.
+   * @param l Highest level to use
+   */
+  void SetSeqDecodeLevel(SeqDecodeLevel l);
+
+  /** Decode a 4-bit packed BAM sequence (bam_get_seq) to ASCII
+   * @param packed Packed sequence, two bases per byte
+   * @param n Number of bases
+   * @param out Buffer of at least n chars. Not null terminated
+   */
+  void DecodeBases(const uint8_t* packed, size_t n, char* out);
+
+  /** Decode a 4-bit packed BAM sequence to its reverse complement in ASCII.
+   * Same as rcomplement() on the output of DecodeBases
+   * @param packed Packed sequence, two bases per byte
+   * @param n Number of bases
+   * @param out Buffer of at least n chars. Not null terminated
+   */
+  void DecodeBasesRevComp(const uint8_t* packed, size_t n, char* out);
+
+  /** Convert raw phred scores (bam_get_qual) to ASCII by adding an offset
+   * @param qual Raw phred scores
+   * @param n Number of scores
+   * @param offset Encoding offset (eg 33)
+   * @param out Buffer of at least n chars. Not null terminated
+   */
+  void DecodeQualities(const uint8_t* qual, size_t n, int offset, char* out);
+
+  /** Pack an ASCII sequence into 4-bit BAM encoding. Anything other than
+   * upper case ACGT is stored as N
+   * @param seq ASCII sequence
+   * @param n Number of bases
+   * @param packed Buffer of at least (n+1)/2 bytes
+   */
+  void EncodeBases(const char* seq, size_t n, uint8_t* packed);
+
+  /** Pack the reverse complement of an ASCII sequence into 4-bit BAM encoding.
+   * Anything other than upper case ACGT is stored as N
+   * @param seq ASCII sequence
+   * @param n Number of bases
+   * @param packed Buffer of at least (n+1)/2 bytes
+   */
+  void EncodeBasesRevComp(const char* seq, size_t n, uint8_t* packed);
+
+}
+
+#endif
@@ -10,6 +10,7 @@ extern "C" {
   #include "bwa/utils.h"
   #include "bwa/bwamem.h"
   int is_bwt(ubyte_t *T, int n);
+  int is_sa(const ubyte_t *T, int *SA, int n);
   KSEQ_DECLARE(gzFile)
 }
 
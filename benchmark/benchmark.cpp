@@ -2,6 +2,9 @@
 
 //#define JUMPING_TEST 1
 #define READ_TEST 1
+//#define RECYCLE_TEST 1
+//#define DECODE_TEST 1
+//#define CONSTRUCT_TEST 1
 
 #include "SeqLib/SeqLibUtils.h"
 
@@ -25,6 +28,7 @@ using namespace seqan;
 #ifdef RUN_SEQLIB
 #include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
+#include "SeqLib/BWAWrapper.h"
 #endif
 
 #ifdef RUN_HTSLIB
@@ -139,6 +143,129 @@ int main()
   }
 #endif
 
+#ifdef RECYCLE_TEST
+  // stream reads without keeping them, first allocating a new
+  // bam1_t per read, then recycling one buffer
+  for (int recycle = 0; recycle < 2; ++recycle) {
+    std::cerr << " **** " << (recycle ? "RECYCLED" : "ALLOCATED") << " RECORDS **** " << std::endl;
+    SeqLib::BamReader rr;
+    rr.SetRecycleRecords(recycle);
+    rr.Open(bam);
+    SeqLib::BamRecord rrec;
+    size_t rcount = 0;
+    uint64_t mapq = 0;
+#ifdef USE_BOOST
+    boost::timer::cpu_timer rt;
+#endif
+    while(rr.GetNextRecord(rrec) && rcount++ < limit) 
+      mapq += rrec.MapQuality(); // touch the read so the loop isn't dead
+#ifdef USE_BOOST
+    std::cerr << "...read " << SeqLib::AddCommas(rcount) << " records (sum mapq " << mapq << ") " << rt.format();
+#endif
+  }
+#endif
+
+#ifdef DECODE_TEST
+  // decode sequence and quals of the same reads over and over, first with the
+  // old per-base loops, then with each level of the SIMD kernels
+  {
+    SeqLib::BamReader dr;
+    dr.Open(bam);
+    SeqLib::BamRecordVector drecs;
+    SeqLib::BamRecord drec;
+    while (dr.GetNextRecord(drec) && drecs.size() < 100000)
+      drecs.push_back(drec);
+    const int reps = 20;
+    uint64_t sink = 0;
+
+    std::cerr << " **** DECODE: PER-BASE LOOPS **** " << std::endl;
+    {
+#ifdef USE_BOOST
+      boost::timer::cpu_timer dt;
+#endif
+      for (int k = 0; k < reps; ++k)
+	for (SeqLib::BamRecordVector::const_iterator r = drecs.begin(); r != drecs.end(); ++r) {
+	  bam1_t* b = r->raw();
+	  uint8_t* p = bam_get_seq(b);
+	  uint8_t* q = bam_get_qual(b);
+	  std::string seq(b->core.l_qseq, 'N'), qual(b->core.l_qseq, ' ');
+	  for (int32_t i = 0; i < b->core.l_qseq; ++i) {
+	    seq[i] = BASES[bam_seqi(p,i)];
+	    qual[i] = (char)(q[i] + 33);
+	  }
+	  SeqLib::rcomplement(seq);
+	  sink += seq[0] + qual[0];
+	}
+#ifdef USE_BOOST
+      std::cerr << "...decoded " << SeqLib::AddCommas(drecs.size() * reps) << " reads " << dt.format();
+#endif
+    }
+
+    for (int level = SeqLib::SEQ_DECODE_SCALAR; level <= SeqLib::SeqDecodeBestLevel(); ++level) {
+      SeqLib::SetSeqDecodeLevel(static_cast<SeqLib::SeqDecodeLevel>(level));
+      std::cerr << " **** DECODE: KERNEL LEVEL " << level << " **** " << std::endl;
+#ifdef USE_BOOST
+      boost::timer::cpu_timer dt;
+#endif
+      for (int k = 0; k < reps; ++k)
+	for (SeqLib::BamRecordVector::const_iterator r = drecs.begin(); r != drecs.end(); ++r) {
+	  std::string seq = r->SequenceReverseComplement();
+	  std::string qual = r->Qualities();
+	  sink += seq[0] + qual[0];
+	}
+#ifdef USE_BOOST
+      std::cerr << "...decoded " << SeqLib::AddCommas(drecs.size() * reps) << " reads " << dt.format();
+#endif
+    }
+    SeqLib::SetSeqDecodeLevel(SeqLib::SeqDecodeBestLevel());
+    std::cerr << "(checksum " << sink << ")" << std::endl;
+  }
+#endif
+
+#ifdef CONSTRUCT_TEST
+  // in-memory bwa index construction, 1kb to 10Mb references. 
+  // Run at the commit before ConstructIndexes (minus that section) for the old path
+  {
+    std::string ref;
+    uint32_t x = 12345;
+    for (size_t i = 0; i < 10000000; ++i) {
+      x = x * 1103515245 + 12345;
+      ref += "ACGT"[(x >> 16) & 3];
+    }
+    for (size_t len = 1000; len <= ref.length(); len *= 10) {
+      SeqLib::UnalignedSequenceVector usv;
+      usv.push_back(SeqLib::UnalignedSequence("ref", ref.substr(0, len)));
+      const size_t reps = std::max<size_t>(1, 1000000 / len);
+      std::cerr << " **** CONSTRUCT: " << SeqLib::AddCommas(len) << " bp x " << reps << " **** " << std::endl;
+#ifdef USE_BOOST
+      boost::timer::cpu_timer ct;
+#endif
+      for (size_t k = 0; k < reps; ++k) {
+	SeqLib::BWAWrapper bw;
+	bw.ConstructIndex(usv);
+      }
+#ifdef USE_BOOST
+      std::cerr << "...serial " << ct.format();
+#endif
+
+      // same, many at once
+      std::vector<SeqLib::BWAWrapper*> w;
+      std::vector<SeqLib::UnalignedSequenceVector> refs(reps, usv);
+      for (size_t k = 0; k < reps; ++k)
+	w.push_back(new SeqLib::BWAWrapper());
+#ifdef USE_BOOST
+      boost::timer::cpu_timer cpt;
+#endif
+      SeqLib::BWAWrapper::ConstructIndexes(w, refs, 8);
+#ifdef USE_BOOST
+      std::cerr << "...8 threads " << cpt.format();
+#endif
+      for (size_t k = 0; k < reps; ++k)
+	delete w[k];
+    }
+  }
+#endif
+
 #endif
 
 #ifdef RUN_SEQAN
@@ -12,6 +12,8 @@
 #include "SeqLib/FermiAssembler.h"
 #include "SeqLib/SeqPlot.h"
 #include "SeqLib/RefGenome.h"
+#include "SeqLib/FlatIntervalIndex.h"
+#include "non_api/STCoverage.h"
 
 #define GZBED "test_data/test.bed.gz"
 #define GZVCF "test_data/test.vcf.gz"
@@ -29,6 +31,7 @@ using namespace SeqLib::Filter;
 using namespace SeqLib;
 
 #include <fstream>
+#include <utime.h>
 #include "SeqLib/BFC.h"
 
 BOOST_AUTO_TEST_CASE( read_gzbed ) {
@@ -1457,6 +1460,1502 @@ BOOST_AUTO_TEST_CASE( bam_poly ) {
 }
 
 
+BOOST_AUTO_TEST_CASE( bam_poly_merge_order ) {
+
+  // merging two files should give coordinate-sorted output, with
+  // ties broken by the order the files were opened
+  SeqLib::BamReader r;
+  BOOST_CHECK(r.Open("test_data/small.bam"));
+  BOOST_CHECK(r.Open("test_data/small.cram"));
+
+  SeqLib::BamRecord rec;
+  uint32_t last_chr = 0;
+  int32_t last_pos = -1;
+  size_t count = 0;
+  std::vector<std::string> names;
+  while(r.GetNextRecord(rec) && count++ < 20000) {
+    uint32_t chr = rec.ChrID();
+    BOOST_CHECK(chr > last_chr || (chr == last_chr && rec.Position() >= last_pos));
+    last_chr = chr;
+    last_pos = rec.Position();
+    names.push_back(rec.Qname());
+  }
+
+  // should be reproducible from a fresh reader
+  SeqLib::BamReader r2;
+  BOOST_CHECK(r2.Open("test_data/small.bam"));
+  BOOST_CHECK(r2.Open("test_data/small.cram"));
+  count = 0;
+  while(r2.GetNextRecord(rec) && count < names.size()) 
+    BOOST_CHECK_EQUAL(rec.Qname(), names[count++]);
+  BOOST_CHECK_EQUAL(count, names.size());
+
+}
+
+BOOST_AUTO_TEST_CASE( bam_reader_copy ) {
+
+  // reference order of the merged reads
+  std::vector<std::string> names;
+  SeqLib::BamReader ref;
+  BOOST_CHECK(ref.Open("test_data/small.bam"));
+  BOOST_CHECK(ref.Open("test_data/small.cram"));
+  SeqLib::BamRecord rec;
+  while (ref.GetNextRecord(rec) && names.size() < 2000)
+    names.push_back(rec.Qname());
+
+  // a copy made part way through carries on from the same place,
+  // with its own merge state, after the original is gone
+  SeqLib::BamReader* src = new SeqLib::BamReader;
+  BOOST_CHECK(src->Open("test_data/small.bam"));
+  BOOST_CHECK(src->Open("test_data/small.cram"));
+  size_t count = 0;
+  for (; count < 500; ++count) {
+    BOOST_REQUIRE(src->GetNextRecord(rec));
+    BOOST_CHECK_EQUAL(rec.Qname(), names[count]);
+  }
+  SeqLib::BamReader cp(*src);
+  delete src;
+  for (; count < 1000; ++count) {
+    BOOST_REQUIRE(cp.GetNextRecord(rec));
+    BOOST_CHECK_EQUAL(rec.Qname(), names[count]);
+  }
+
+  // same for assignment
+  SeqLib::BamReader as;
+  as = cp;
+  cp = SeqLib::BamReader();
+  for (; count < names.size(); ++count) {
+    BOOST_REQUIRE(as.GetNextRecord(rec));
+    BOOST_CHECK_EQUAL(rec.Qname(), names[count]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( bam_reader_recycle ) {
+
+  SeqLib::BamReader r, rr;
+  r.Open(SBAM);
+  rr.SetRecycleRecords(true);
+  rr.Open(SBAM);
+
+  SeqLib::BamRecord a, b;
+  BamRecordVector kept;
+  size_t count = 0;
+  bam1_t* last = NULL;
+  size_t same_buffer = 0;
+  while (r.GetNextRecord(a) && rr.GetNextRecord(b) && count++ < 1000) {
+    BOOST_CHECK_EQUAL(a.Qname(), b.Qname());
+    BOOST_CHECK_EQUAL(a.Sequence(), b.Sequence());
+    BOOST_CHECK_EQUAL(a.Position(), b.Position());
+
+    // buffers are traded back and forth when nothing else holds them
+    if (b.raw() == last)
+      ++same_buffer;
+    if (count % 2 == 0)
+      last = b.raw();
+
+    // a kept copy must not be overwritten by later reads
+    if (count == 10)
+      kept.push_back(b);
+  }
+  BOOST_CHECK(same_buffer > 0);
+  BOOST_CHECK_EQUAL(kept.size(), 1);
+
+  SeqLib::BamReader r2;
+  r2.Open(SBAM);
+  for (size_t i = 0; i < 10; ++i)
+    r2.GetNextRecord(a);
+  BOOST_CHECK_EQUAL(kept[0].Qname(), a.Qname());
+  BOOST_CHECK_EQUAL(kept[0].Sequence(), a.Sequence());
+}
+
+BOOST_AUTO_TEST_CASE( bam_reader_batch ) {
+
+  SeqLib::BamReader r, rb;
+  r.Open(SBAM);
+  rb.Open(SBAM);
+
+  // batches should match one-at-a-time reads
+  BamRecordVector batch;
+  SeqLib::BamRecord rec;
+  size_t total = 0;
+  for (int k = 0; k < 5; ++k) {
+    size_t n = rb.GetNextBatch(batch, 1000);
+    BOOST_CHECK_EQUAL(n, 1000);
+    BOOST_CHECK_EQUAL(batch.size(), 1000);
+    for (size_t i = 0; i < n; ++i) {
+      BOOST_CHECK(r.GetNextRecord(rec));
+      BOOST_CHECK_EQUAL(rec.Qname(), batch[i].Qname());
+      BOOST_CHECK_EQUAL(rec.Position(), batch[i].Position());
+    }
+    total += n;
+  }
+  BOOST_CHECK_EQUAL(total, 5000);
+
+  // filter the last batch in place
+  ReadFilterCollection rfc;
+  ReadFilter rf;
+  AbstractRule ar;
+  ar.mapq = Range(10, 1000, false);
+  rf.AddRule(ar);
+  rfc.AddReadFilter(rf);
+
+  size_t expected = 0;
+  for (size_t i = 0; i < batch.size(); ++i)
+    if (batch[i].MapQuality() >= 10)
+      ++expected;
+  size_t kept = rfc.FilterBatch(batch, batch.size());
+  BOOST_CHECK_EQUAL(kept, expected);
+  for (size_t i = 0; i < kept; ++i)
+    BOOST_CHECK(batch[i].MapQuality() >= 10);
+
+  // drain the rest, last batch is short
+  size_t n;
+  while ((n = rb.GetNextBatch(batch, 1000)) == 1000) {}
+  BOOST_CHECK(n < 1000);
+  BOOST_CHECK_EQUAL(rb.GetNextBatch(batch, 1000), 0);
+}
+
+BOOST_AUTO_TEST_CASE( bam_reader_prefetch ) {
+
+  SeqLib::BamReader r, rp;
+  r.Open(SBAM);
+  rp.SetPrefetch(64);
+  rp.Open(SBAM);
+
+  SeqLib::BamRecord a, b;
+  size_t count = 0;
+  while (r.GetNextRecord(a)) {
+    BOOST_CHECK(rp.GetNextRecord(b));
+    BOOST_CHECK_EQUAL(a.Qname(), b.Qname());
+    BOOST_CHECK_EQUAL(a.Position(), b.Position());
+    ++count;
+  }
+  BOOST_CHECK(!rp.GetNextRecord(b));
+
+  SeqLib::PrefetchStats st = rp.GetPrefetchStats();
+  BOOST_CHECK_EQUAL(st.depth, 64);
+  BOOST_CHECK_EQUAL(st.reads, count);
+  BOOST_CHECK_EQUAL(st.queued, 0);
+
+  // setting a region drops the queue and restarts the thread
+  SeqLib::GenomicRegion gr(rp.Header().Name2ID("X"), 1001000, 1001100);
+  BOOST_CHECK(r.SetRegion(gr));
+  BOOST_CHECK(rp.SetRegion(gr));
+  while (r.GetNextRecord(a)) {
+    BOOST_CHECK(rp.GetNextRecord(b));
+    BOOST_CHECK_EQUAL(a.Qname(), b.Qname());
+  }
+  BOOST_CHECK(!rp.GetNextRecord(b));
+
+  // after the end of the input, resetting or opening a file reads again
+  SeqLib::BamReader rr;
+  rr.SetPrefetch(16);
+  rr.Open(SBAM);
+  size_t n = 0;
+  while (rr.GetNextRecord(b))
+    ++n;
+  BOOST_CHECK_EQUAL(n, count);
+
+  BOOST_CHECK(rr.Reset(SBAM));
+  n = 0;
+  while (rr.GetNextRecord(b))
+    ++n;
+  BOOST_CHECK_EQUAL(n, count);
+
+  rr.Reset();
+  n = 0;
+  while (rr.GetNextRecord(b))
+    ++n;
+  BOOST_CHECK_EQUAL(n, count);
+
+  // a reset part way through hands out the first read again, not queued ones
+  rr.Reset();
+  for (int i = 0; i < 100; ++i)
+    BOOST_REQUIRE(rr.GetNextRecord(b));
+  BOOST_CHECK(rr.Reset(SBAM));
+  r.Reset();
+  BOOST_REQUIRE(r.GetNextRecord(a));
+  BOOST_REQUIRE(rr.GetNextRecord(b));
+  BOOST_CHECK_EQUAL(a.Qname(), b.Qname());
+  BOOST_CHECK_EQUAL(a.Position(), b.Position());
+
+  // changing the depth part way keeps the reads already queued
+  rr.Reset();
+  r.Reset();
+  n = 0;
+  bool same = true;
+  while (r.GetNextRecord(a)) {
+    if (n == 50)
+      rr.SetPrefetch(4);
+    else if (n == 100)
+      rr.SetPrefetch(0);
+    else if (n == 150)
+      rr.SetPrefetch(32);
+    BOOST_REQUIRE(rr.GetNextRecord(b));
+    same = same && a.Qname() == b.Qname() && a.Position() == b.Position();
+    ++n;
+  }
+  BOOST_CHECK(same);
+  BOOST_CHECK(!rr.GetNextRecord(b));
+
+  // opening another file after the end of the input
+  while (rr.GetNextRecord(b)) {}
+  {
+    std::ifstream in(SBAM, std::ios::binary);
+    std::ofstream out("tmp_prefetch.bam", std::ios::binary);
+    out << in.rdbuf();
+  }
+  BOOST_CHECK(rr.Open("tmp_prefetch.bam"));
+  n = 0;
+  while (rr.GetNextRecord(b))
+    ++n;
+  BOOST_CHECK_EQUAL(n, count);
+}
+
+BOOST_AUTO_TEST_CASE( bam_reader_parallel_regions ) {
+
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+
+  SeqLib::GRC grc;
+  int chr = r.Header().Name2ID("X");
+  for (int i = 0; i < 8; ++i)
+    grc.add(SeqLib::GenomicRegion(chr, 1000000 + i * 2000, 1000000 + i * 2000 + 1000));
+
+  // reference answer from a plain region walk
+  SeqLib::BamReader s;
+  s.Open(SBAM);
+  BOOST_CHECK(s.SetMultipleRegions(grc));
+  std::vector<std::string> expected;
+  SeqLib::BamRecord rec;
+  while (s.GetNextRecord(rec))
+    expected.push_back(rec.Qname() + ":" + SeqLib::tostring(rec.Position()));
+
+  // ordered mode calls back on this thread, in region order
+  std::vector<std::string> got;
+  size_t last_region = 0;
+  size_t n = r.ForEachRegionParallel(grc, [&](const SeqLib::BamRecord& b, size_t region) {
+      BOOST_CHECK(region >= last_region);
+      last_region = region;
+      got.push_back(b.Qname() + ":" + SeqLib::tostring(b.Position()));
+    }, 3, true);
+  BOOST_CHECK_EQUAL(n, expected.size());
+  BOOST_CHECK(got == expected);
+
+  // unordered mode visits the same reads
+  std::atomic<size_t> count(0);
+  BOOST_CHECK_EQUAL(r.ForEachRegionParallel(grc, [&](const SeqLib::BamRecord& b, size_t region) { ++count; }, 4), n);
+  BOOST_CHECK_EQUAL(count, n);
+
+  // errors on the callback make it back to the caller
+  BOOST_CHECK_THROW(r.ForEachRegionParallel(grc, [](const SeqLib::BamRecord& b, size_t region) {
+	throw std::runtime_error("stop"); }, 2), std::runtime_error);
+  BOOST_CHECK_THROW(r.ForEachRegionParallel(grc, [](const SeqLib::BamRecord& b, size_t region) {}, 0), std::invalid_argument);
+
+  // the reader's own stream is untouched
+  SeqLib::BamReader t;
+  t.Open(SBAM);
+  BOOST_CHECK(t.GetNextRecord(rec));
+  SeqLib::BamRecord first;
+  BOOST_CHECK(r.GetNextRecord(first));
+  BOOST_CHECK_EQUAL(rec.Qname(), first.Qname());
+}
+
+BOOST_AUTO_TEST_CASE( bam_index_cache ) {
+
+  SeqLib::BamIndexCache::Clear();
+  BOOST_CHECK_EQUAL(SeqLib::BamIndexCache::Size(), 0);
+  BOOST_CHECK(!SeqLib::BamIndexCache::Preload("no_file.bam"));
+  BOOST_CHECK(!SeqLib::BamIndexCache::Preload("test_data/small.cram")); // CRAM indices are per-handle
+  BOOST_CHECK(SeqLib::BamIndexCache::Preload(SBAM));
+  BOOST_CHECK_EQUAL(SeqLib::BamIndexCache::Size(), 1);
+
+  // readers on the same file pick up the cached index
+  SeqLib::BamReader r1, r2;
+  r1.Open(SBAM);
+  r2.Open(SBAM);
+  SeqLib::GenomicRegion gr(r1.Header().Name2ID("X"), 1001000, 1001100);
+  BOOST_CHECK(r1.SetRegion(gr));
+  BOOST_CHECK(r2.SetRegion(gr));
+  BOOST_CHECK_EQUAL(SeqLib::BamIndexCache::Size(), 1);
+  SeqLib::BamRecord a, b;
+  while (r1.GetNextRecord(a)) {
+    BOOST_CHECK(r2.GetNextRecord(b));
+    BOOST_CHECK_EQUAL(a.Qname(), b.Qname());
+  }
+
+  // evicting doesn't pull the index out from under open readers
+  BOOST_CHECK(SeqLib::BamIndexCache::Evict(SBAM));
+  BOOST_CHECK(!SeqLib::BamIndexCache::Evict(SBAM));
+  BOOST_CHECK_EQUAL(SeqLib::BamIndexCache::Size(), 0);
+  BOOST_CHECK(r1.SetRegion(gr));
+  BOOST_CHECK(r1.GetNextRecord(a));
+
+  // a reader with its own index
+  BOOST_CHECK(r2.GetHTSFile(SBAM));
+  BOOST_CHECK_THROW(r2.GetHTSFile("no_file.bam"), std::runtime_error);
+  SeqLib::SharedIndex idx(sam_index_load(r2.GetHTSFile().get(), SBAM), idx_delete());
+  BOOST_CHECK(r2.SetPreloadedIndex(SBAM, idx));
+  BOOST_CHECK(!r2.SetPreloadedIndex("no_file.bam", idx));
+  BOOST_CHECK(r2.SetRegion(gr));
+  BOOST_CHECK(r2.GetNextRecord(b));
+  BOOST_CHECK_EQUAL(a.Qname(), b.Qname());
+  BOOST_CHECK_EQUAL(SeqLib::BamIndexCache::Size(), 0);
+
+  // rewriting just the index reloads it
+  const char* files[][2] = { { SBAM, "tmp_index_cache.bam" }, { SBAM ".bai", "tmp_index_cache.bam.bai" } };
+  for (size_t i = 0; i < 2; ++i) {
+    std::ifstream in(files[i][0], std::ios::binary);
+    std::ofstream out(files[i][1], std::ios::binary);
+    out << in.rdbuf();
+  }
+  SeqLib::BamReader r3;
+  BOOST_REQUIRE(r3.Open("tmp_index_cache.bam"));
+  htsFile* fp = r3.GetHTSFile().get();
+  SeqLib::SharedIndex i1 = SeqLib::BamIndexCache::Get("tmp_index_cache.bam", fp);
+  BOOST_CHECK(i1);
+  BOOST_CHECK(SeqLib::BamIndexCache::Get("tmp_index_cache.bam", fp) == i1);
+  struct utimbuf ut;
+  ut.actime = ut.modtime = time(NULL) + 100;
+  BOOST_REQUIRE(utime("tmp_index_cache.bam.bai", &ut) == 0);
+  SeqLib::SharedIndex i2 = SeqLib::BamIndexCache::Get("tmp_index_cache.bam", fp);
+  BOOST_CHECK(i2);
+  BOOST_CHECK(i2 != i1);
+  SeqLib::BamIndexCache::Clear();
+}
+
+BOOST_AUTO_TEST_CASE( bam_reader_coalesce_regions ) {
+
+  SeqLib::BamReader r, c;
+  r.Open(SBAM);
+  c.Open(SBAM);
+
+  // overlapping, touching and nearby regions, out of order
+  int chr = r.Header().Name2ID("X");
+  SeqLib::GRC grc;
+  grc.add(SeqLib::GenomicRegion(chr, 1010000, 1011000));
+  grc.add(SeqLib::GenomicRegion(chr, 1000000, 1001000));
+  grc.add(SeqLib::GenomicRegion(chr, 1000500, 1001500));
+  grc.add(SeqLib::GenomicRegion(chr, 1001500, 1002000));
+  grc.add(SeqLib::GenomicRegion(chr, 1002100, 1003000));
+
+  // a plain walk returns reads in overlapping regions more than once
+  BOOST_CHECK(r.SetMultipleRegions(grc));
+  std::set<std::string> expected;
+  SeqLib::BamRecord rec;
+  size_t plain = 0;
+  while (r.GetNextRecord(rec)) {
+    expected.insert(rec.Qname() + ":" + SeqLib::tostring(rec.AlignmentFlag()) + ":" + SeqLib::tostring(rec.Position()));
+    ++plain;
+  }
+  BOOST_CHECK(plain >= expected.size());
+
+  c.SetRegionCoalescing(500);
+  BOOST_CHECK(c.SetMultipleRegions(grc));
+  SeqLib::RegionPlanStats st = c.GetRegionPlanStats();
+  BOOST_CHECK_EQUAL(st.regions, 5);
+  BOOST_CHECK(st.queries <= 2);
+  BOOST_CHECK_EQUAL(st.seeks_saved, st.regions - st.queries);
+
+  // the same reads, each once
+  std::set<std::string> got;
+  size_t n = 0;
+  while (c.GetNextRecord(rec)) {
+    got.insert(rec.Qname() + ":" + SeqLib::tostring(rec.AlignmentFlag()) + ":" + SeqLib::tostring(rec.Position()));
+    ++n;
+  }
+  BOOST_CHECK_EQUAL(n, got.size());
+  BOOST_CHECK(got == expected);
+
+  // a single region drops the plan
+  BOOST_CHECK(c.SetRegion(grc[0]));
+  BOOST_CHECK_EQUAL(c.GetRegionPlanStats().queries, 0);
+}
+
+BOOST_AUTO_TEST_CASE( bam_record_views ) {
+
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (r.GetNextRecord(rec) && count++ < 1000) {
+
+    // sequence view decodes the same bases
+    SeqLib::SequenceView sv = rec.GetSequenceView();
+    std::string seq = rec.Sequence();
+    BOOST_CHECK_EQUAL(sv.size(), seq.length());
+    BOOST_CHECK_EQUAL(sv.str(), seq);
+    BOOST_CHECK(std::equal(sv.begin(), sv.end(), seq.begin()));
+    if (sv.size())
+      BOOST_CHECK_EQUAL(sv[sv.size() - 1], seq[seq.length() - 1]);
+
+    // cigar view matches the owning copy
+    SeqLib::CigarView cv = rec.GetCigarView();
+    SeqLib::Cigar cig = rec.GetCigar();
+    BOOST_CHECK_EQUAL(cv.size(), cig.size());
+    BOOST_CHECK(cv.AsCigar() == cig);
+    BOOST_CHECK_EQUAL(cv.NumQueryConsumed(), cig.NumQueryConsumed());
+    BOOST_CHECK_EQUAL(cv.NumReferenceConsumed(), cig.NumReferenceConsumed());
+    size_t k = 0;
+    for (SeqLib::CigarView::const_iterator c = cv.begin(); c != cv.end(); ++c, ++k)
+      BOOST_CHECK(*c == cig[k]);
+
+    // tag views
+    std::string rg;
+    SeqLib::TagView tv = rec.GetTagView("RG");
+    BOOST_CHECK_EQUAL(tv.Found(), rec.GetZTag("RG", rg));
+    if (tv.Found()) {
+      BOOST_CHECK(tv == rg);
+      BOOST_CHECK_EQUAL(tv.size(), rg.length());
+    }
+    int32_t nm = 0;
+    if (rec.GetIntTag("NM", nm))
+      BOOST_CHECK_EQUAL(rec.GetTagView("NM").AsInt(), nm);
+  }
+
+  // missing tags and empty records
+  BOOST_CHECK(!rec.GetTagView("ZZ").Found());
+  BOOST_CHECK_EQUAL(rec.GetTagView("ZZ").AsInt(), 0);
+  BOOST_CHECK_EQUAL(std::string(rec.GetTagView("ZZ").c_str()), "");
+  SeqLib::BamRecord empty;
+  BOOST_CHECK(empty.GetSequenceView().empty());
+  BOOST_CHECK(empty.GetCigarView().empty());
+  BOOST_CHECK(!empty.GetTagView("RG").Found());
+
+  // string tag compares and counts without copying
+  rec.AddZTag("XA", "chr1,+100,50M,0;chr2,-200,50M,1;");
+  BOOST_CHECK_EQUAL(rec.GetTagView("XA").Count(';'), 2);
+  BOOST_CHECK_EQUAL(rec.CountBWASecondaryAlignments(), 2);
+  BOOST_CHECK(rec.GetTagView("XA") == "chr1,+100,50M,0;chr2,-200,50M,1;");
+}
+
+BOOST_AUTO_TEST_CASE( seq_decode_kernels ) {
+
+  // every level should match the per-base loops, for all lengths around the vector widths
+  std::string alpha = "ACGTNacgX";
+  for (int level = SeqLib::SEQ_DECODE_SCALAR; level <= SeqLib::SeqDecodeBestLevel(); ++level) {
+    SeqLib::SetSeqDecodeLevel(static_cast<SeqLib::SeqDecodeLevel>(level));
+    BOOST_CHECK_EQUAL(SeqLib::GetSeqDecodeLevel(), level);
+    for (size_t n = 0; n < 200; ++n) {
+
+      std::string seq(n, 'N');
+      for (size_t i = 0; i < n; ++i)
+	seq[i] = alpha[(i * 7 + n) % alpha.length()];
+      std::string clean = seq; // what comes back out: ACGT or N
+      for (size_t i = 0; i < n; ++i)
+	if (clean[i] != 'A' && clean[i] != 'C' && clean[i] != 'G' && clean[i] != 'T')
+	  clean[i] = 'N';
+
+      std::vector<uint8_t> packed((n + 1) / 2 + 1, 0), rpacked((n + 1) / 2 + 1, 0);
+      SeqLib::EncodeBases(seq.data(), n, packed.data());
+      SeqLib::EncodeBasesRevComp(seq.data(), n, rpacked.data());
+
+      std::string out(n, ' '), rout(n, ' '), rrout(n, ' ');
+      SeqLib::DecodeBases(packed.data(), n, &out[0]);
+      SeqLib::DecodeBases(rpacked.data(), n, &rout[0]);
+      SeqLib::DecodeBasesRevComp(packed.data(), n, &rrout[0]);
+      BOOST_CHECK_EQUAL(out, clean);
+      std::string rc = clean;
+      SeqLib::rcomplement(rc);
+      BOOST_CHECK_EQUAL(rout, rc);
+      BOOST_CHECK_EQUAL(rrout, rc);
+
+      std::vector<uint8_t> q(n);
+      for (size_t i = 0; i < n; ++i)
+	q[i] = (i * 13) % 42;
+      std::string qout(n, ' ');
+      SeqLib::DecodeQualities(q.data(), n, 33, &qout[0]);
+      for (size_t i = 0; i < n; ++i)
+	BOOST_CHECK_EQUAL(qout[i], (char)(q[i] + 33));
+    }
+  }
+
+  // and on real reads
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+  SeqLib::BamRecord rec;
+  size_t count = 0;
+  while (r.GetNextRecord(rec) && count++ < 1000) {
+    std::string seq = rec.Sequence();
+    std::string qual = rec.Qualities();
+    for (int level = SeqLib::SEQ_DECODE_SCALAR; level <= SeqLib::SeqDecodeBestLevel(); ++level) {
+      SeqLib::SetSeqDecodeLevel(static_cast<SeqLib::SeqDecodeLevel>(level));
+      BOOST_CHECK_EQUAL(rec.Sequence(), seq);
+      BOOST_CHECK_EQUAL(rec.Qualities(), qual);
+      std::string rc = seq;
+      SeqLib::rcomplement(rc);
+      BOOST_CHECK_EQUAL(rec.SequenceReverseComplement(), rc);
+    }
+  }
+  SeqLib::SetSeqDecodeLevel(SeqLib::SeqDecodeBestLevel());
+}
+
+BOOST_AUTO_TEST_CASE( read_filter_compiled ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamHeader h = br.Header();
+
+  SeqLib::GRC g;
+  g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1100000, 1800000));
+  g.add(SeqLib::GenomicRegion(h.Name2ID("X"), 1700000, 2200000));
+  g.CreateTreeMap();
+
+  // includer on a region with flag, mapq and orientation rules
+  ReadFilter inc;
+  inc.setRegions(g);
+  inc.SetMateLinked(true);
+  AbstractRule ar;
+  ar.mapq = Range(10, 60, false);
+  ar.fr.dup.setOff();
+  ar.fr.fr.setOn();
+  inc.AddRule(ar);
+  AbstractRule ar2;
+  ar2.clip = Range(5, 1000, false);
+  ar2.len = Range(50, 1000, false);
+  inc.AddRule(ar2);
+
+  // excluder on whole genome
+  ReadFilter exc;
+  exc.SetExcluder(true);
+  AbstractRule ar3;
+  ar3.fr.setAnyOnFlag(BAM_FQCFAIL | BAM_FSECONDARY);
+  exc.AddRule(ar3);
+
+  // contradicting flags can never pass
+  ReadFilter none;
+  AbstractRule ar4;
+  ar4.fr.setAllOnFlag(BAM_FUNMAP);
+  ar4.fr.mapped.setOn();
+  none.AddRule(ar4);
+
+  ReadFilterCollection rfc;
+  rfc.AddReadFilter(inc);
+  rfc.AddReadFilter(exc);
+  rfc.AddReadFilter(none);
+
+  // compiled result must match the rule-by-rule result
+  SeqLib::BamRecord rec;
+  size_t count = 0, passed = 0;
+  while (br.GetNextRecord(rec) && count++ < 10000) {
+    bool excluded = exc.isReadOverlappingRegion(rec) && exc.isValid(rec);
+    bool included = (inc.isReadOverlappingRegion(rec) && inc.isValid(rec)) ||
+      (none.isReadOverlappingRegion(rec) && none.isValid(rec));
+    BOOST_CHECK_EQUAL(rfc.isValid(rec), included && !excluded);
+    BOOST_CHECK(!none.isValid(rec));
+    passed += rfc.isValid(rec);
+  }
+  BOOST_CHECK(passed > 0);
+
+  // adding a filter recompiles
+  ReadFilter all;
+  rfc.AddReadFilter(all);
+  br.Reset();
+  count = 0;
+  while (br.GetNextRecord(rec) && count++ < 1000) 
+    BOOST_CHECK_EQUAL(rfc.isValid(rec), !(exc.isReadOverlappingRegion(rec) && exc.isValid(rec)));
+}
+
+BOOST_AUTO_TEST_CASE( bwa_wrapper_batch ) {
+
+  SeqLib::BWAWrapper bwa;
+  SeqLib::UnalignedSequenceVector usv;
+  usv.push_back(SeqLib::UnalignedSequence("ref3","ACATGGCGAGCACTTCTAGCATCAGCTAGCTACGATCGATCGATCGATCGTAGC", std::string()));
+  usv.push_back(SeqLib::UnalignedSequence("ref4","CTACTTTATCATCTACACACTGCCTGACTGCGGCGACGAGCGAGCAGCTACTATCGACT", std::string()));
+  usv.push_back(SeqLib::UnalignedSequence("ref5","CGATCGTAGCTAGCTGATGCTAGAAGTGCTCGCCATGT", std::string()));
+
+  // no index is no hits, but one (empty) result per query
+  std::vector<SeqLib::BamRecordVector> out;
+  bwa.AlignSequences(usv, out, false, 0.9, 10, 2);
+  BOOST_CHECK_EQUAL(out.size(), usv.size());
+  BOOST_CHECK(out[0].empty());
+
+  bwa.ConstructIndex(usv);
+  BOOST_CHECK_THROW(bwa.AlignSequences(usv, out, false, 0.9, 10, 0), std::invalid_argument);
+
+  // many queries, more than threads
+  SeqLib::UnalignedSequenceVector q;
+  for (size_t i = 0; i < 200; ++i) {
+    const SeqLib::UnalignedSequence& u = usv[i % usv.size()];
+    q.push_back(SeqLib::UnalignedSequence("q" + SeqLib::tostring(i), u.Seq.substr(i % 7, 30), std::string()));
+  }
+
+  std::vector<SeqLib::BamRecordVector> one, four;
+  bwa.AlignSequences(q, one, false, 0.9, 10, 1);
+  bwa.AlignSequences(q, four, false, 0.9, 10, 4);
+  BOOST_REQUIRE_EQUAL(one.size(), q.size());
+  BOOST_REQUIRE_EQUAL(four.size(), q.size());
+  for (size_t i = 0; i < q.size(); ++i) {
+    BOOST_REQUIRE(!one[i].empty());
+    BOOST_REQUIRE_EQUAL(one[i].size(), four[i].size());
+    // input order is kept, and thread count does not change hits
+    BOOST_CHECK_EQUAL(one[i][0].Qname(), q[i].Name);
+    BOOST_CHECK_EQUAL(four[i][0].Qname(), q[i].Name);
+    BOOST_CHECK_EQUAL(one[i][0].ChrID(), four[i][0].ChrID());
+    BOOST_CHECK_EQUAL(one[i][0].Position(), four[i][0].Position());
+    BOOST_CHECK_EQUAL(one[i][0].CigarString(), four[i][0].CigarString());
+
+    // same hits as aligning them one at a time (order of tied hits may differ)
+    SeqLib::BamRecordVector single;
+    bwa.AlignSequence(q[i], single, false, 0.9, 10);
+    BOOST_CHECK_EQUAL(single.size(), one[i].size());
+    BOOST_CHECK_EQUAL(single[0].GetTagView("AS").AsInt(), one[i][0].GetTagView("AS").AsInt());
+  }
+}
+
+BOOST_AUTO_TEST_CASE( bwa_wrapper_pairs ) {
+
+  // random reference, so that reads map uniquely
+  std::string ref;
+  uint32_t x = 12345;
+  for (size_t i = 0; i < 20000; ++i) {
+    x = x * 1103515245 + 12345;
+    ref += "ACGT"[(x >> 16) & 3];
+  }
+  SeqLib::UnalignedSequenceVector usv;
+  usv.push_back(SeqLib::UnalignedSequence("chr1", ref, std::string()));
+
+  SeqLib::BWAWrapper bwa;
+  SeqLib::UnalignedSequenceVector r1, r2;
+  SeqLib::BamRecordVector brv;
+  bwa.AlignPairs(r1, r2, brv, 1); // no index
+  BOOST_CHECK(brv.empty());
+
+  bwa.ConstructIndex(usv);
+
+  // FR pairs, 100bp reads, insert size 300-400
+  for (size_t i = 0; i < 300; ++i) {
+    size_t pos = (i * 61) % (ref.length() - 500);
+    size_t isize = 300 + (i % 100);
+    std::string name = "pair" + SeqLib::tostring(i);
+    std::string mate = ref.substr(pos + isize - 100, 100);
+    SeqLib::rcomplement(mate);
+    r1.push_back(SeqLib::UnalignedSequence(name, ref.substr(pos, 100), std::string(100, 'I')));
+    r2.push_back(SeqLib::UnalignedSequence(name, mate, std::string(100, 'I')));
+  }
+
+  BOOST_CHECK_THROW(bwa.AlignPairs(r1, SeqLib::UnalignedSequenceVector(), brv, 1), std::invalid_argument);
+  BOOST_CHECK_THROW(bwa.AlignPairs(r1, r2, brv, 0), std::invalid_argument);
+
+  bwa.AlignPairs(r1, r2, brv, 2);
+  BOOST_REQUIRE(brv.size() >= r1.size() * 2);
+
+  size_t proper = 0, n = 0;
+  for (SeqLib::BamRecordVector::const_iterator b = brv.begin(); b != brv.end(); ++b) {
+    if (b->SecondaryFlag() || b->SupplementaryFlag())
+      continue;
+    BOOST_CHECK(b->PairedFlag());
+    BOOST_CHECK(b->FirstFlag() != ((b->AlignmentFlag() & BAM_FREAD2) != 0));
+    // output is in input order
+    BOOST_CHECK_EQUAL(b->Qname(), r1[n / 2].Name);
+    if (b->ProperPair()) {
+      ++proper;
+      BOOST_CHECK_EQUAL(b->MateChrID(), b->ChrID());
+      BOOST_CHECK(std::abs(b->InsertSize()) >= 300 && std::abs(b->InsertSize()) < 400);
+      BOOST_CHECK_EQUAL(b->ReverseFlag(), !b->MateReverseFlag());
+    }
+    ++n;
+  }
+  BOOST_CHECK_EQUAL(n, r1.size() * 2);
+  BOOST_CHECK(proper > n * 9 / 10);
+}
+
+BOOST_AUTO_TEST_CASE( bwa_wrapper_index_image ) {
+
+  SeqLib::BWAWrapper bwa;
+  SeqLib::UnalignedSequenceVector usv;
+  usv.push_back(SeqLib::UnalignedSequence("ref3","ACATGGCGAGCACTTCTAGCATCAGCTAGCTACGATCGATCGATCGATCGTAGC", std::string()));
+  usv.push_back(SeqLib::UnalignedSequence("ref4","CTACTTTATCATCTACACACTGCCTGACTGCGGCGACGAGCGAGCAGCTACTATCGACT", std::string()));
+
+  const std::string img = "tmp_output.bwaimg";
+  BOOST_CHECK(!bwa.WriteIndexImage(img)); // no index
+  bwa.ConstructIndex(usv);
+  BOOST_CHECK(bwa.WriteIndexImage(img));
+
+  // still usable after being packed
+  SeqLib::BamRecordVector brv;
+  bwa.AlignSequence("CTACTTTATCATCTACACACTGCCTGACTGCGG", "q", brv, false, 0.9, 1);
+  BOOST_REQUIRE(brv.size());
+  BOOST_CHECK_EQUAL(brv[0].ChrID(), 1);
+
+  // two mappings of the same image
+  SeqLib::BWAWrapper m1, m2;
+  BOOST_CHECK(!m1.LoadIndexImage("test_data/small.bam"));
+  BOOST_CHECK(!m1.LoadIndexImage("nonexistent_file.bwaimg"));
+  BOOST_CHECK(m1.LoadIndexImage(img));
+  BOOST_CHECK(m2.LoadIndexImage(img));
+  BOOST_CHECK_EQUAL(m1.NumSequences(), 2);
+  BOOST_CHECK_EQUAL(m2.ChrIDToName(1), "ref4");
+  BOOST_CHECK(!m1.WriteIndexImage(img)); // read-only
+
+  SeqLib::BamRecordVector b1, b2;
+  m1.AlignSequence("CTACTTTATCATCTACACACTGCCTGACTGCGG", "q", b1, false, 0.9, 1);
+  m2.AlignSequence("CTACTTTATCATCTACACACTGCCTGACTGCGG", "q", b2, false, 0.9, 1);
+  BOOST_REQUIRE(b1.size() && b2.size());
+  BOOST_CHECK_EQUAL(b1[0].ChrID(), brv[0].ChrID());
+  BOOST_CHECK_EQUAL(b1[0].Position(), brv[0].Position());
+  BOOST_CHECK_EQUAL(b1[0].CigarString(), b2[0].CigarString());
+
+  // replacing a mapped index unmaps it
+  m1.ConstructIndex(usv);
+  BOOST_CHECK_EQUAL(m1.NumSequences(), 2);
+
+  // images whose layout doesn't add up are refused, with a valid header
+  std::string good;
+  {
+    std::ifstream in(img.c_str(), std::ios::binary);
+    good.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  BOOST_REQUIRE(good.size() > 16 + sizeof(bwt_t));
+  std::string bad = good;
+  uint64_t huge = (uint64_t)1 << 40;
+  memcpy(&bad[16 + offsetof(bwt_t, bwt_size)], &huge, sizeof(huge));
+  {
+    std::ofstream out("tmp_output_bad.bwaimg", std::ios::binary);
+    out << bad;
+  }
+  SeqLib::BWAWrapper m3;
+  BOOST_CHECK(!m3.LoadIndexImage("tmp_output_bad.bwaimg"));
+
+  bad = good.substr(0, good.size() - 4);
+  uint64_t l_mem = bad.size() - 16;
+  memcpy(&bad[8], &l_mem, sizeof(l_mem));
+  {
+    std::ofstream out("tmp_output_bad.bwaimg", std::ios::binary);
+    out << bad;
+  }
+  BOOST_CHECK(!m3.LoadIndexImage("tmp_output_bad.bwaimg"));
+  BOOST_CHECK(m3.LoadIndexImage(img));
+}
+
+BOOST_AUTO_TEST_CASE( bwa_wrapper_construct_many ) {
+
+  // small local references, as when realigning contigs
+  std::vector<SeqLib::UnalignedSequenceVector> refs;
+  uint32_t x = 777;
+  for (size_t k = 0; k < 20; ++k) {
+    std::string seq;
+    for (size_t i = 0; i < 500 + k * 100; ++i) {
+      x = x * 1103515245 + 12345;
+      seq += "ACGT"[(x >> 16) & 3];
+    }
+    if (k % 5 == 0)
+      seq.replace(100, 20, std::string(20, 'N'));
+    SeqLib::UnalignedSequenceVector usv;
+    usv.push_back(SeqLib::UnalignedSequence("c" + SeqLib::tostring(k), seq, std::string()));
+    refs.push_back(usv);
+  }
+
+  std::vector<SeqLib::BWAWrapper*> w;
+  for (size_t k = 0; k < refs.size(); ++k)
+    w.push_back(new SeqLib::BWAWrapper());
+
+  BOOST_CHECK_THROW(SeqLib::BWAWrapper::ConstructIndexes(w, std::vector<SeqLib::UnalignedSequenceVector>(), 2), std::invalid_argument);
+  BOOST_CHECK_THROW(SeqLib::BWAWrapper::ConstructIndexes(w, refs, 0), std::invalid_argument);
+  SeqLib::BWAWrapper::ConstructIndexes(w, refs, 4);
+
+  for (size_t k = 0; k < refs.size(); ++k) {
+    BOOST_REQUIRE(!w[k]->IsEmpty());
+    BOOST_CHECK_EQUAL(w[k]->ChrIDToName(0), refs[k][0].Name);
+
+    // a piece of the reference maps back to where it came from, on both strands
+    std::string q = refs[k][0].Seq.substr(200, 80);
+    SeqLib::BamRecordVector brv;
+    w[k]->AlignSequence(q, "q", brv, false, 0.9, 1);
+    BOOST_REQUIRE(brv.size());
+    BOOST_CHECK_EQUAL(brv[0].Position(), 200);
+    BOOST_CHECK_EQUAL(brv[0].CigarString(), "80M");
+    BOOST_CHECK(!brv[0].ReverseFlag());
+    SeqLib::rcomplement(q);
+    brv.clear();
+    w[k]->AlignSequence(q, "q", brv, false, 0.9, 1);
+    BOOST_REQUIRE(brv.size());
+    BOOST_CHECK_EQUAL(brv[0].Position(), 200);
+    BOOST_CHECK(brv[0].ReverseFlag());
+
+    // same as building it alone
+    SeqLib::BWAWrapper single;
+    single.ConstructIndex(refs[k]);
+    BOOST_CHECK_EQUAL(single.GetIndex()->bwt->primary, w[k]->GetIndex()->bwt->primary);
+    BOOST_CHECK_EQUAL(single.GetIndex()->bwt->sa[1], w[k]->GetIndex()->bwt->sa[1]);
+    delete w[k];
+  }
+}
+
+BOOST_AUTO_TEST_CASE( bwa_wrapper_record_layout ) {
+
+  std::string ref;
+  uint32_t x = 4242;
+  for (size_t i = 0; i < 2000; ++i) {
+    x = x * 1103515245 + 12345;
+    ref += "ACGT"[(x >> 16) & 3];
+  }
+  SeqLib::UnalignedSequenceVector usv;
+  usv.push_back(SeqLib::UnalignedSequence("ref", ref, std::string()));
+  SeqLib::BWAWrapper bwa;
+  bwa.ConstructIndex(usv);
+
+  // 60bp of the reference with 20bp of junk on each side, reverse strand.
+  // junk is picked to mismatch the reference bases next to it
+  std::string flank5 = ref.substr(480, 20), flank3 = ref.substr(560, 20);
+  std::string j5 = flank5, j3 = flank3;
+  for (size_t i = 0; i < 20; ++i) {
+    j5[i] = flank5[i] == 'A' ? 'C' : 'A';
+    j3[i] = flank3[i] == 'G' ? 'T' : 'G';
+  }
+  SeqLib::rcomplement(j5);
+  SeqLib::rcomplement(j3);
+  const std::string junk1 = j3, junk2 = j5;
+  std::string aligned = ref.substr(500, 60);
+  SeqLib::rcomplement(aligned);
+  const std::string q = junk1 + aligned + junk2;
+
+  SeqLib::BamRecordVector soft, hard;
+  bwa.AlignSequence(q, "split_read", soft, false, 0.9, 10);
+  bwa.AlignSequence(q, "split_read", hard, true, 0.9, 10);
+  BOOST_REQUIRE(soft.size() && hard.size());
+
+  BOOST_CHECK_EQUAL(soft[0].Qname(), "split_read");
+  BOOST_CHECK(soft[0].ReverseFlag());
+  BOOST_CHECK_EQUAL(soft[0].Position(), 500);
+  BOOST_CHECK_EQUAL(soft[0].CigarString(), "20S60M20S");
+  BOOST_CHECK_EQUAL(hard[0].CigarString(), "20H60M20H");
+
+  // stored sequence is in reference orientation
+  std::string rc = q;
+  SeqLib::rcomplement(rc);
+  BOOST_CHECK_EQUAL(soft[0].Sequence(), rc);
+  BOOST_CHECK_EQUAL(hard[0].Sequence(), ref.substr(500, 60));
+  BOOST_CHECK_EQUAL(hard[0].Length(), 60);
+
+  // all tags are readable, and the record can still grow
+  int32_t t;
+  BOOST_CHECK(hard[0].GetIntTag("NA", t));
+  BOOST_CHECK(hard[0].GetIntTag("NM", t) && t == 0);
+  BOOST_CHECK(hard[0].GetIntTag("AS", t) && t == 60);
+  BOOST_CHECK(hard[0].GetIntTag("SQ", t) && t == 0);
+  hard[0].AddZTag("XX", "grown");
+  std::string z;
+  BOOST_CHECK(hard[0].GetZTag("XX", z) && z == "grown");
+  BOOST_CHECK(hard[0].GetIntTag("AS", t) && t == 60);
+
+  // earlier records in the vector are left alone
+  size_t before = soft.size();
+  bwa.AlignSequence(q, "again", soft, false, 0.9, 10);
+  BOOST_CHECK_EQUAL(soft.size(), before * 2);
+  BOOST_CHECK_EQUAL(soft[0].Qname(), "split_read");
+  BOOST_CHECK_EQUAL(soft[before].Qname(), "again");
+}
+
+BOOST_AUTO_TEST_CASE( fermi_assemble_many ) {
+
+  SeqLib::FermiAssembler f;
+  BOOST_CHECK_THROW(f.SetThreads(0), std::invalid_argument);
+  f.SetThreads(2);
+  BOOST_CHECK_EQUAL(f.GetThreads(), 2);
+
+  // consecutive chunks of reads as independent windows
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamRecord r;
+  std::vector<SeqLib::BamRecordVector> windows(12);
+  size_t count = 0;
+  while (br.GetNextRecord(r) && count < 6000)
+    windows[count++ / 500].push_back(r);
+  windows.push_back(SeqLib::BamRecordVector()); // an empty window
+
+  BOOST_CHECK_THROW(f.AssembleMany(windows, 0), std::invalid_argument);
+  std::vector<std::vector<std::string> > many = f.AssembleMany(windows, 4);
+  BOOST_REQUIRE_EQUAL(many.size(), windows.size());
+  BOOST_CHECK(many.back().empty());
+
+  // same as assembling each window on its own
+  for (size_t i = 0; i + 1 < windows.size(); ++i) {
+    SeqLib::FermiAssembler one;
+    one.AddReads(windows[i]);
+    one.PerformAssembly();
+    std::vector<std::string> c = one.GetContigs();
+    BOOST_REQUIRE_EQUAL(c.size(), many[i].size());
+    for (size_t k = 0; k < c.size(); ++k)
+      BOOST_CHECK_EQUAL(c[k], many[i][k]);
+  }
+
+  // and with unaligned sequences
+  std::vector<SeqLib::UnalignedSequenceVector> uwin(2);
+  for (size_t i = 0; i < 2; ++i)
+    for (SeqLib::BamRecordVector::const_iterator b = windows[i].begin(); b != windows[i].end(); ++b)
+      uwin[i].push_back(SeqLib::UnalignedSequence(b->Qname(), b->Sequence(), b->Qualities()));
+  std::vector<std::vector<std::string> > umany = f.AssembleMany(uwin, 2);
+  BOOST_CHECK_EQUAL(umany[0].size(), many[0].size());
+  BOOST_CHECK_EQUAL(umany[1].size(), many[1].size());
+}
+
+BOOST_AUTO_TEST_CASE( fermi_read_store ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamRecord r;
+  SeqLib::BamRecordVector brv;
+  SeqLib::UnalignedSequenceVector usv;
+  while (br.GetNextRecord(r) && brv.size() < 2000) {
+    brv.push_back(r);
+    usv.push_back(SeqLib::UnalignedSequence(r.Qname(), r.Sequence(), r.Qualities()));
+  }
+
+  // decoded straight from the records
+  SeqLib::FermiAssembler f;
+  f.AddReads(brv);
+  BOOST_REQUIRE_EQUAL(f.NumSequences(), brv.size());
+  SeqLib::UnalignedSequenceVector got = f.GetSequences();
+  for (size_t i = 0; i < brv.size(); ++i) {
+    BOOST_CHECK_EQUAL(got[i].Seq, brv[i].Sequence());
+    BOOST_CHECK_EQUAL(got[i].Name, brv[i].Qname());
+  }
+
+  // clearing resets everything, and the store can be refilled
+  f.ClearReads();
+  BOOST_CHECK_EQUAL(f.NumSequences(), 0);
+  BOOST_CHECK_EQUAL(f.GetSequences().size(), 0);
+  for (size_t i = 0; i < 10; ++i)
+    f.AddRead(brv[i]);
+  f.AddReads(usv);
+  BOOST_CHECK_EQUAL(f.NumSequences(), usv.size() + 10);
+  BOOST_CHECK_EQUAL(f.GetSequences()[10].Seq, usv[0].Seq);
+
+  // moving in assembles the same as going through strings
+  SeqLib::FermiAssembler a, b;
+  a.AddReads(usv);
+  a.PerformAssembly();
+  SeqLib::BamRecordVector moved = brv;
+  b.MoveReads(moved);
+  BOOST_CHECK(moved.empty());
+  BOOST_CHECK_EQUAL(b.NumSequences(), usv.size());
+  b.PerformAssembly();
+  BOOST_CHECK(a.GetContigs() == b.GetContigs());
+}
+
+BOOST_AUTO_TEST_CASE( fermi_visit_unitigs ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamRecord r;
+  SeqLib::BamRecordVector brv;
+  while (br.GetNextRecord(r) && brv.size() < 3000)
+    brv.push_back(r);
+
+  SeqLib::FermiAssembler f;
+  f.AddReads(brv);
+  f.PerformAssembly();
+  std::vector<std::string> contigs = f.GetContigs();
+
+  // visiting matches GetContigs, and edges match the GFA L lines
+  std::vector<std::string> seen;
+  size_t edges = 0;
+  size_t n = f.VisitUnitigs([&seen](const SeqLib::FermiUnitig& u) {
+      BOOST_CHECK_EQUAL(u.len, (int)strlen(u.seq));
+      seen.push_back(u.seq);
+      return true;
+    },
+    [&edges](const SeqLib::FermiEdge& e) {
+      BOOST_CHECK(e.from < e.to);
+      ++edges;
+    });
+  BOOST_CHECK_EQUAL(n, contigs.size());
+  BOOST_CHECK(seen == contigs);
+
+  std::stringstream gfa;
+  f.WriteGFA(gfa);
+  size_t s_lines = 0, l_lines = 0;
+  std::string line;
+  while (std::getline(gfa, line)) {
+    if (line[0] == 'S') ++s_lines;
+    if (line[0] == 'L') ++l_lines;
+  }
+  BOOST_CHECK_EQUAL(s_lines, contigs.size());
+  BOOST_CHECK_EQUAL(l_lines, edges);
+
+  // stopping early
+  if (contigs.size() > 1)
+    BOOST_CHECK_EQUAL(f.VisitUnitigs([](const SeqLib::FermiUnitig& u) { return false; }), 1);
+
+  // releasing writes the same GFA, then drops the contigs
+  std::stringstream gfa2;
+  f.WriteGFA(gfa2, true);
+  BOOST_CHECK_EQUAL(gfa2.str(), gfa.str());
+  BOOST_CHECK_EQUAL(f.GetContigs().size(), 0);
+  BOOST_CHECK_EQUAL(f.VisitUnitigs([](const SeqLib::FermiUnitig& u) { return true; }), 0);
+}
+
+BOOST_AUTO_TEST_CASE( bfc_stream ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamRecord rec;
+  BamRecordVector sample;
+  while (br.GetNextRecord(rec) && sample.size() < 10000)
+    if (rec.Length())
+      sample.push_back(rec);
+
+  BFC b;
+  BOOST_CHECK_THROW(b.SetThreads(0), std::invalid_argument);
+  b.SetThreads(2);
+  BOOST_CHECK_EQUAL(b.GetThreads(), 2);
+
+  // must be trained first
+  SeqLib::BamReader untrained;
+  untrained.Open(SBAM);
+  BOOST_CHECK_THROW(b.CorrectStream(untrained, [](const UnalignedSequence& u) {}), std::runtime_error);
+
+  for (auto& r : sample)
+    b.AddSequence(r.Sequence().c_str(), r.Qualities().c_str(), r.Qname().c_str());
+  b.Train();
+  b.clear();
+
+  // stream the first reads back through in small chunks
+  std::vector<UnalignedSequence> streamed;
+  SeqLib::BamReader br2;
+  br2.Open(SBAM);
+  BOOST_CHECK_THROW(b.CorrectStream(br2, [](const UnalignedSequence& u) {}, 0), std::invalid_argument);
+  size_t n = b.CorrectStream(br2, [&streamed](const UnalignedSequence& u) {
+      if (streamed.size() < 3000)
+	streamed.push_back(u);
+    }, 700);
+  BOOST_CHECK(n >= sample.size());
+  BOOST_REQUIRE_EQUAL(streamed.size(), 3000);
+
+  // same as correcting them in memory with the same table
+  for (size_t i = 0; i < 3000; ++i)
+    b.AddSequence(sample[i].Sequence().c_str(), sample[i].Qualities().c_str(), sample[i].Qname().c_str());
+  b.ErrorCorrect();
+  std::string seq, name;
+  size_t i = 0;
+  while (b.GetSequence(seq, name)) {
+    BOOST_CHECK_EQUAL(seq, streamed[i].Seq);
+    BOOST_CHECK_EQUAL(name, streamed[i].Name);
+    ++i;
+  }
+  BOOST_CHECK_EQUAL(i, 3000);
+  b.clear();
+
+  // and from FASTA, with a different thread count
+  {
+    std::ofstream fa("tmp_bfc_stream.fa");
+    for (size_t k = 0; k < 2500; ++k)
+      fa << ">" << sample[k].Qname() << std::endl << sample[k].Sequence() << std::endl;
+  }
+  b.SetThreads(1);
+  SeqLib::FastqReader fq("tmp_bfc_stream.fa");
+  size_t fcount = 0;
+  n = b.CorrectStream(fq, [&](const UnalignedSequence& u) {
+      BOOST_CHECK_EQUAL(u.Name, sample[fcount].Qname());
+      BOOST_CHECK_EQUAL(u.Seq.length(), sample[fcount].Sequence().length());
+      ++fcount;
+    }, 1000);
+  BOOST_CHECK_EQUAL(n, 2500);
+  BOOST_CHECK_EQUAL(fcount, 2500);
+}
+
+BOOST_AUTO_TEST_CASE( bfc_table ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  SeqLib::BamRecord rec;
+  BamRecordVector brv;
+  while (br.GetNextRecord(rec) && brv.size() < 10000)
+    if (rec.Length())
+      brv.push_back(rec);
+
+  BFC trained, loaded;
+  BOOST_CHECK(!trained.WriteTable("tmp_bfc.table")); // nothing trained
+  BOOST_CHECK(!loaded.LoadTable("test_data/small.bam")); // not a table
+  BOOST_CHECK(!loaded.LoadTable("does_not_exist"));
+
+  for (auto& r : brv)
+    trained.AddSequence(r.Sequence().c_str(), r.Qualities().c_str(), r.Qname().c_str());
+  trained.Train();
+  BOOST_REQUIRE(trained.WriteTable("tmp_bfc.table"));
+
+  BOOST_REQUIRE(loaded.LoadTable("tmp_bfc.table"));
+  BOOST_CHECK_EQUAL(loaded.GetKMer(), trained.GetKMer());
+  BOOST_CHECK_EQUAL(loaded.GetKCov(), trained.GetKCov());
+
+  // a mapped table writes back out the same
+  BOOST_REQUIRE(loaded.WriteTable("tmp_bfc2.table"));
+  std::ifstream t1("tmp_bfc.table", std::ios::binary), t2("tmp_bfc2.table", std::ios::binary);
+  std::string s1((std::istreambuf_iterator<char>(t1)), std::istreambuf_iterator<char>());
+  std::string s2((std::istreambuf_iterator<char>(t2)), std::istreambuf_iterator<char>());
+  BOOST_CHECK(s1 == s2);
+
+  // and corrects the same
+  for (auto& r : brv)
+    loaded.AddSequence(r.Sequence().c_str(), r.Qualities().c_str(), r.Qname().c_str());
+  trained.ErrorCorrect();
+  loaded.ErrorCorrect();
+  std::string seq1, name1, seq2, name2;
+  size_t n = 0;
+  while (trained.GetSequence(seq1, name1)) {
+    BOOST_REQUIRE(loaded.GetSequence(seq2, name2));
+    BOOST_CHECK_EQUAL(seq1, seq2);
+    ++n;
+  }
+  BOOST_CHECK_EQUAL(n, brv.size());
+
+  // single sequences against the mapped table
+  loaded.clear();
+  std::string str = brv[0].Sequence();
+  BOOST_CHECK(loaded.CorrectSequence(str, brv[0].Qualities()));
+  BOOST_CHECK_EQUAL(str.length(), brv[0].Sequence().length());
+}
+
+BOOST_AUTO_TEST_CASE( flat_interval_index ) {
+
+  // random intervals, checked against brute force
+  srand(42);
+  SeqLib::FlatIntervalIndex fi;
+  std::vector<SeqLib::GenomicRegion> all;
+  for (int i = 0; i < 5000; ++i) {
+    int chr = rand() % 3;
+    int s = rand() % 100000;
+    int e = s + rand() % (i % 50 == 0 ? 20000 : 500);
+    fi.Add(chr, s, e, i);
+    all.push_back(SeqLib::GenomicRegion(chr, s, e));
+  }
+  fi.Add(-1, 0, 10, 5000); // not stored
+  BOOST_CHECK(!fi.IsIndexed());
+  fi.Index();
+  BOOST_CHECK(fi.IsIndexed());
+  BOOST_CHECK_EQUAL(fi.size(), 5000);
+
+  for (int q = 0; q < 500; ++q) {
+    int chr = rand() % 4; // chr 3 has no intervals
+    int s = rand() % 110000;
+    int e = s + rand() % 2000;
+    std::vector<int> expected;
+    for (size_t i = 0; i < all.size(); ++i)
+      if (all[i].chr == chr && all[i].pos1 <= e && all[i].pos2 >= s)
+	expected.push_back(i);
+    std::vector<SeqLib::FlatInterval> got;
+    BOOST_CHECK_EQUAL(fi.FindOverlapping(chr, s, e, got), expected.size());
+    BOOST_CHECK_EQUAL(fi.CountOverlapping(chr, s, e), expected.size());
+    BOOST_CHECK_EQUAL(fi.AnyOverlapping(chr, s, e), !expected.empty());
+    std::vector<int> vals;
+    for (size_t i = 0; i < got.size(); ++i) {
+      vals.push_back(got[i].value);
+      if (i)
+	BOOST_CHECK(got[i-1].start <= got[i].start);
+    }
+    std::sort(vals.begin(), vals.end());
+    BOOST_CHECK(vals == expected);
+  }
+
+  // closed intervals, as GenomicRegion
+  SeqLib::FlatIntervalIndex one;
+  one.Add(0, 100, 200, 7);
+  one.Index();
+  BOOST_CHECK(one.AnyOverlapping(0, 200, 300));
+  BOOST_CHECK(one.AnyOverlapping(0, 0, 100));
+  BOOST_CHECK(!one.AnyOverlapping(0, 201, 300));
+  BOOST_CHECK(!one.AnyOverlapping(1, 100, 200));
+  one.clear();
+  BOOST_CHECK(one.empty());
+  BOOST_CHECK(!one.AnyOverlapping(0, 100, 200));
+
+  // a collection gives the same answers with either index
+  SeqLib::GRC tree, flat;
+  for (size_t i = 0; i < all.size(); ++i) {
+    SeqLib::GenomicRegion g = all[i];
+    g.strand = i % 2 ? '+' : '-';
+    tree.add(g);
+    flat.add(g);
+  }
+  tree.CreateTreeMap();
+  flat.CreateFlatIndex();
+  BOOST_CHECK_EQUAL(flat.NumTree(), 0);
+  for (int q = 0; q < 300; ++q) {
+    SeqLib::GenomicRegion g(rand() % 3, 0, 0);
+    g.pos1 = rand() % 100000;
+    g.pos2 = g.pos1 + rand() % 3000;
+    g.strand = '+';
+    BOOST_CHECK_EQUAL(tree.CountOverlaps(g), flat.CountOverlaps(g));
+    std::vector<int> t1 = tree.FindOverlappedIntervals(g, false), f1 = flat.FindOverlappedIntervals(g, false);
+    std::sort(t1.begin(), t1.end());
+    BOOST_CHECK(t1 == f1);
+    BOOST_CHECK_EQUAL(tree.FindOverlaps(g, true).TotalWidth(), flat.FindOverlaps(g, true).TotalWidth());
+    SeqLib::GenomicRegion g2(g.chr, g.pos1 + 100, g.pos2 + 100);
+    BOOST_CHECK_EQUAL(tree.OverlapSameInterval(g, g2), flat.OverlapSameInterval(g, g2));
+  }
+
+  // collection against collection
+  SeqLib::GRC queries;
+  for (int q = 0; q < 200; ++q)
+    queries.add(SeqLib::GenomicRegion(rand() % 3, q * 500, q * 500 + 300));
+  std::vector<int32_t> qt, st, qf, sf;
+  SeqLib::GRC ot = queries.FindOverlaps(tree, qt, st, true);
+  SeqLib::GRC of = queries.FindOverlaps(flat, qf, sf, true);
+  BOOST_CHECK_EQUAL(ot.size(), of.size());
+  BOOST_CHECK_EQUAL(ot.TotalWidth(), of.TotalWidth());
+  BOOST_CHECK(qt == qf);
+
+  // merging drops the index
+  flat.MergeOverlappingIntervals();
+  BOOST_CHECK(flat.GetFlatIndex()->empty());
+
+  // and the trees take over once built again
+  tree.CreateFlatIndex();
+  BOOST_CHECK(!tree.GetFlatIndex()->empty());
+  tree.CreateTreeMap();
+  BOOST_CHECK(tree.GetFlatIndex()->empty());
+}
+
+BOOST_AUTO_TEST_CASE( sweep_overlaps ) {
+
+  srand(7);
+  SeqLib::GRC a, b;
+  for (int i = 0; i < 3000; ++i) {
+    SeqLib::GenomicRegion g(rand() % 4, 0, 0);
+    g.pos1 = rand() % 50000;
+    g.pos2 = g.pos1 + rand() % (i % 100 == 0 ? 5000 : 150);
+    g.strand = rand() % 2 ? '+' : '-';
+    a.add(g);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    SeqLib::GenomicRegion g(rand() % 3 + 1, 0, 0); // no chr 0, plus a chr 3 
+    g.pos1 = rand() % 50000;
+    g.pos2 = g.pos1 + rand() % 1000;
+    g.strand = rand() % 2 ? '+' : '-';
+    b.add(g);
+  }
+
+  // unsorted, and no index on the subject
+  BOOST_CHECK(!a.IsCoordinateSorted());
+  std::vector<int32_t> q, s;
+  BOOST_CHECK_THROW(a.FindOverlaps(b, [](size_t, size_t) {}, true), std::logic_error);
+  BOOST_CHECK_THROW(a.FindOverlapsParallel(b, q, s, true, 2), std::logic_error);
+
+  a.CoordinateSort();
+  b.CoordinateSort();
+  BOOST_CHECK(a.IsCoordinateSorted() && b.IsCoordinateSorted());
+
+  // brute force, in query then subject order
+  std::vector<std::pair<int32_t, int32_t> > expected;
+  for (size_t i = 0; i < a.size(); ++i)
+    for (size_t j = 0; j < b.size(); ++j)
+      if (a[i].chr == b[j].chr && a[i].pos1 <= b[j].pos2 && a[i].pos2 >= b[j].pos1 && a[i].strand == b[j].strand)
+	expected.push_back(std::pair<int32_t, int32_t>(i, j));
+  BOOST_REQUIRE(expected.size() > 100);
+
+  // sweep, with no tree on either side
+  SeqLib::GRC out = a.FindOverlaps(b, q, s, false);
+  BOOST_REQUIRE_EQUAL(q.size(), expected.size());
+  BOOST_REQUIRE_EQUAL(out.size(), expected.size());
+  for (size_t k = 0; k < expected.size(); ++k) {
+    BOOST_CHECK_EQUAL(q[k], expected[k].first);
+    BOOST_CHECK_EQUAL(s[k], expected[k].second);
+    BOOST_CHECK_EQUAL(out[k].pos1, std::max(a[q[k]].pos1, b[s[k]].pos1));
+    BOOST_CHECK_EQUAL(out[k].pos2, std::min(a[q[k]].pos2, b[s[k]].pos2));
+  }
+
+  // streaming
+  std::vector<std::pair<int32_t, int32_t> > streamed;
+  size_t n = a.FindOverlaps(b, [&streamed](size_t i, size_t j) {
+      streamed.push_back(std::pair<int32_t, int32_t>(i, j));
+    }, false);
+  BOOST_CHECK_EQUAL(n, expected.size());
+  BOOST_CHECK(streamed == expected);
+
+  // per chromosome, in parallel
+  for (int t = 1; t <= 8; t *= 2) {
+    std::vector<int32_t> pq, ps;
+    SeqLib::GRC pout = a.FindOverlapsParallel(b, pq, ps, false, t);
+    BOOST_CHECK(pq == q);
+    BOOST_CHECK(ps == s);
+    BOOST_CHECK_EQUAL(pout.size(), out.size());
+    BOOST_CHECK_EQUAL(pout.TotalWidth(), out.TotalWidth());
+  }
+  BOOST_CHECK_THROW(a.FindOverlapsParallel(b, q, s, false, 0), std::invalid_argument);
+
+  // same overlaps through the interval tree, once the query is out of order
+  SeqLib::GRC shuffled;
+  for (size_t i = 0; i < a.size(); ++i)
+    shuffled.add(a[i]);
+  shuffled.Shuffle();
+  b.CreateTreeMap();
+  size_t via_tree = shuffled.FindOverlaps(b, [](size_t, size_t) {}, false);
+  BOOST_CHECK_EQUAL(via_tree, expected.size());
+}
+
+BOOST_AUTO_TEST_CASE( threaded_region_files ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  const SeqLib::BamHeader& h = br.Header();
+
+  // same regions as the line by line readers, but sorted
+  const char* beds[] = { BEDFILE, GZBED };
+  for (int f = 0; f < 2; ++f) {
+    SeqLib::GRC old;
+    old.ReadBED(beds[f], h);
+    old.CoordinateSort();
+    for (int t = 1; t <= 4; t += 3) {
+      SeqLib::GRC fast;
+      BOOST_REQUIRE(fast.ReadBED(beds[f], h, t));
+      BOOST_CHECK(fast.IsCoordinateSorted());
+      BOOST_REQUIRE_EQUAL(fast.size(), old.size());
+      for (size_t i = 0; i < old.size(); ++i)
+	BOOST_CHECK(fast[i] == old[i]);
+    }
+  }
+  const char* vcfs[] = { VCFFILE, GZVCF };
+  for (int f = 0; f < 2; ++f) {
+    SeqLib::GRC old, fast;
+    old.ReadVCF(vcfs[f], h);
+    old.CoordinateSort();
+    BOOST_REQUIRE(fast.ReadVCF(vcfs[f], h, 3));
+    BOOST_REQUIRE_EQUAL(fast.size(), old.size());
+    for (size_t i = 0; i < old.size(); ++i)
+      BOOST_CHECK(fast[i] == old[i]);
+  }
+
+  // a larger file, split over many lines and chromosomes
+  {
+    std::ofstream out("tmp_regions.bed");
+    out << "track name=test" << std::endl << "# comment" << std::endl << std::endl;
+    for (int i = 0; i < 100000; ++i)
+      out << h.IDtoName(i % 3) << "\t" << (i * 7) % 100000 << "\t" << (i * 7) % 100000 + 50 << "\tname" << i << std::endl;
+    out << "not_a_chr\t1\t10" << std::endl;
+    out << h.IDtoName(1) << "\t5\t6"; // no final newline
+  }
+  SeqLib::GRC big;
+  BOOST_REQUIRE(big.ReadBED("tmp_regions.bed", h, 4));
+  BOOST_CHECK_EQUAL(big.size(), 100001);
+  BOOST_CHECK(big.IsCoordinateSorted());
+  BOOST_CHECK_EQUAL(big[0].chr, 0);
+  BOOST_CHECK_EQUAL(big[big.size() - 1].chr, 2);
+
+  // appending keeps the whole collection sorted
+  big.ReadBED("tmp_regions.bed", h, 2);
+  BOOST_CHECK_EQUAL(big.size(), 200002);
+  BOOST_CHECK(big.IsCoordinateSorted());
+
+  // errors
+  SeqLib::GRC bad;
+  BOOST_CHECK(!bad.ReadBED("does_not_exist.bed", h, 2));
+  {
+    std::ofstream out("tmp_bad.bed");
+    out << h.IDtoName(0) << "\t10\t20" << std::endl << h.IDtoName(0) << "\tten\t20" << std::endl;
+  }
+  BOOST_CHECK_THROW(bad.ReadBED("tmp_bad.bed", h, 2), std::invalid_argument);
+  BOOST_CHECK_THROW(bad.ReadBED("tmp_bad.bed", h, 0), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( region_index_file ) {
+
+  SeqLib::BamReader br;
+  br.Open(SBAM);
+  const SeqLib::BamHeader& h = br.Header();
+
+  SeqLib::GRC grc;
+  for (int i = 0; i < 20000; ++i)
+    grc.add(SeqLib::GenomicRegion(i % 3, (i * 37) % 50000, (i * 37) % 50000 + i % 200, i % 2 ? '+' : '-'));
+  BOOST_REQUIRE(grc.WriteRegionIndex("tmp_regions.idx", h));
+  BOOST_CHECK(grc.IsCoordinateSorted());
+
+  SeqLib::GRC loaded;
+  loaded.add(SeqLib::GenomicRegion(0, 1, 2)); // replaced by the load
+  BOOST_REQUIRE(loaded.LoadRegionIndex("tmp_regions.idx", h));
+  BOOST_REQUIRE_EQUAL(loaded.size(), grc.size());
+  BOOST_CHECK_EQUAL(loaded.GetFlatIndex()->size(), grc.size());
+  BOOST_CHECK(loaded.IsCoordinateSorted());
+  for (size_t i = 0; i < grc.size(); ++i) {
+    BOOST_CHECK(loaded[i] == grc[i]);
+    BOOST_CHECK_EQUAL(loaded[i].strand, grc[i].strand);
+  }
+
+  // queries go straight to the mapped index
+  for (int i = 0; i < 500; ++i) {
+    SeqLib::GenomicRegion q(i % 4, i * 101, i * 101 + 300);
+    BOOST_CHECK_EQUAL(loaded.CountOverlaps(q), grc.CountOverlaps(q));
+    std::vector<int> a = loaded.FindOverlappedIntervals(q, true);
+    std::vector<int> b = grc.FindOverlappedIntervals(q, true);
+    BOOST_CHECK(a == b);
+  }
+  SeqLib::GRC sub; // unsorted, so the subject's index is used
+  sub.add(SeqLib::GenomicRegion(2, 40000, 40100));
+  sub.add(SeqLib::GenomicRegion(1, 1000, 5000));
+  std::vector<int32_t> q1, s1, q2, s2;
+  sub.FindOverlaps(loaded, q1, s1, true);
+  sub.FindOverlaps(grc, q2, s2, true);
+  BOOST_CHECK(q1.size() > 0);
+  BOOST_CHECK(q1 == q2);
+  BOOST_CHECK(s1 == s2);
+
+  // an empty header skips the dictionary check
+  SeqLib::GRC nohdr;
+  BOOST_CHECK(nohdr.LoadRegionIndex("tmp_regions.idx", SeqLib::BamHeader()));
+  BOOST_CHECK_EQUAL(nohdr.size(), grc.size());
+
+  // another dictionary
+  SeqLib::BamHeader other("@SQ\tSN:other\tLN:100\n");
+  SeqLib::GRC bad;
+  BOOST_CHECK(!bad.LoadRegionIndex("tmp_regions.idx", other));
+
+  // not an index, or cut short
+  BOOST_CHECK(!bad.LoadRegionIndex("does_not_exist.idx", h));
+  BOOST_CHECK(!bad.LoadRegionIndex(BEDFILE, h));
+  {
+    std::ifstream in("tmp_regions.idx", std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::ofstream out("tmp_short.idx", std::ios::binary);
+    out << data.substr(0, data.size() - 16);
+  }
+  BOOST_CHECK(!bad.LoadRegionIndex("tmp_short.idx", h));
+  BOOST_CHECK(bad.IsEmpty());
+}
+
+BOOST_AUTO_TEST_CASE( stcoverage ) {
+
+  SeqLib::BamReader r;
+  r.Open(SBAM);
+
+  // count each base of each read directly
+  SeqLib::STCoverage cov;
+  std::map<std::pair<int,int>, int> truth;
+  SeqLib::BamRecord rec;
+  int n = 0;
+  while (r.GetNextRecord(rec) && n < 4000) {
+    if (!rec.MappedFlag())
+      continue;
+    cov.addRead(rec, 0, false);
+    for (int p = rec.Position(); p <= rec.PositionEnd(); ++p)
+      ++truth[std::make_pair(rec.ChrID(), p)];
+    ++n;
+
+    // query part way, so later reads land on settled blocks
+    if (n == 2000) {
+      std::map<std::pair<int,int>, int>::const_iterator t = truth.begin();
+      BOOST_CHECK_EQUAL(cov.getCoverageAtPosition(t->first.first, t->first.second), t->second);
+    }
+  }
+  BOOST_REQUIRE(truth.size());
+
+  int mx = 0;
+  for (std::map<std::pair<int,int>, int>::const_iterator t = truth.begin(); t != truth.end(); ++t) {
+    BOOST_CHECK_EQUAL(cov.getCoverageAtPosition(t->first.first, t->first.second), t->second);
+    mx = std::max(mx, t->second);
+
+    // and nothing just past the end of each run
+    std::pair<int,int> nx(t->first.first, t->first.second + 1);
+    if (!truth.count(nx))
+      BOOST_CHECK_EQUAL(cov.getCoverageAtPosition(nx.first, nx.second), 0);
+  }
+  BOOST_CHECK_EQUAL(cov.maxCov(), mx);
+
+  cov.clear();
+  BOOST_CHECK_EQUAL(cov.maxCov(), 0);
+  BOOST_CHECK_EQUAL(cov.getCoverageAtPosition(truth.begin()->first.first, truth.begin()->first.second), 0);
+}
+
 BOOST_AUTO_TEST_CASE( plot_test ) {
 
   SeqLib::BamReader r;
@@ -34,6 +34,18 @@ SOFTWARE.
 
 #include <stdexcept>
 #include <algorithm>
+#include <thread>
+#include <exception>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// k-mer table file: magic, k, l_pre, file length, then one 
+// bfc_table_entry per hash table, then the flags and keys arrays
+#define BFC_TABLE_MAGIC "SLBFCCH1"
+#define BFC_TABLE_HEADER 24
 
 namespace SeqLib {
 
@@ -81,6 +93,12 @@ namespace SeqLib {
   }
 
 
+  void BFC::SetThreads(int n) {
+    if (n < 1)
+      throw std::invalid_argument("BFC::SetThreads - n must be > 0");
+    bfc_opt.n_threads = n;
+  }
+
   bool BFC::ErrorCorrect() {
     correct_reads();
     return true;
@@ -176,6 +194,7 @@ namespace SeqLib {
     }
 
     // initialize BFC options
+    tot_len = 0;
     for (size_t i = 0; i < n_seqs; ++i) 
       tot_len += m_seqs[i].l_seq; // compute total length
     bfc_opt.l_pre = tot_len - 8 < 20? tot_len - 8 : 20;
@@ -197,6 +216,7 @@ namespace SeqLib {
     // bfc_ch_t *ch; // set in BFC.h
     
     // do the counting
+    clear_table();
     ch = fml_count(n_seqs, m_seqs, bfc_opt.k, bfc_opt.q, bfc_opt.l_pre, bfc_opt.n_threads);
 
 #ifdef DEBUG_BFC
@@ -209,28 +229,23 @@ namespace SeqLib {
       fprintf(stderr, "K: %d S: %d\n", i, ksize[i]);
     }
 #endif
-  }
 
-  void BFC::correct_reads() {
-    
-    assert(kmer > 0);
+    set_coverage();
+  }
 
-    es.ch = ch;
-    es.opt = &bfc_opt;
-    es.n_seqs = n_seqs;
-    es.seqs = m_seqs;
-    es.flt_uniq = flt_uniq;
+  void BFC::set_coverage() {
 
     // make the histogram?
-    // es.ch is unchanged (const)
-    int mode = bfc_ch_hist(es.ch, hist, hist_high);
+    // ch is unchanged (const)
+    m_mode = bfc_ch_hist(ch, hist, hist_high);
 
+    sum_k = tot_k = 0;
     for (int i = fml_opt.min_cnt; i < 256; ++i) 
       sum_k += hist[i], tot_k += i * hist[i];    
 
 #ifdef DEBUG_BFC
     std::cerr << " sum_k " << sum_k << " tot_k " << tot_k << std::endl;
-    fprintf(stderr, "MODE: %d\n", mode);
+    fprintf(stderr, "MODE: %d\n", m_mode);
     for (int i = fml_opt.min_cnt; i < 256; ++i) {
       fprintf(stderr, "hist[%d]: %d\n",i,hist[i]);
     }
@@ -245,15 +260,300 @@ namespace SeqLib {
     bfc_opt.min_cov = bfc_opt.min_cov > fml_opt.min_cnt? bfc_opt.min_cov : fml_opt.min_cnt;
 
 #ifdef DEBUG_BFC
-    fprintf(stderr, "kcov: %f mincov: %d  mode %d \n", kcov, bfc_opt.min_cov, mode);  
+    fprintf(stderr, "kcov: %f mincov: %d  mode %d \n", kcov, bfc_opt.min_cov, m_mode);  
 #endif
-  
-    // do the actual error correction
-    kmer_correct(&es, mode, ch);
+  }
+
+  void BFC::correct_batch(fseq1_t* seqs, size_t n) {
+
+    assert(kmer > 0);
+
+    // histogram is fixed once the table is trained
+    if (m_mode < 0)
+      set_coverage();
+
+    ec_step_t e;
+    memset(&e, 0, sizeof(ec_step_t));
+    e.ch = ch;
+    e.opt = &bfc_opt;
+    e.n_seqs = n;
+    e.seqs = seqs;
+    e.flt_uniq = flt_uniq;
+
+    // do the actual error correction, on bfc_opt.n_threads
+    kmer_correct(&e, m_mode, ch);
+  }
+
+  void BFC::correct_reads() {
+    correct_batch(m_seqs, n_seqs);
+  }
+
+  size_t BFC::correct_stream(const std::function<bool(UnalignedSequenceVector&)>& fill,
+			     const CorrectedCallback& cb, size_t chunk_size) {
+
+    if (!ch)
+      throw std::runtime_error("BFC::CorrectStream - must call Train first");
+    if (!chunk_size)
+      throw std::invalid_argument("BFC::CorrectStream - chunk_size must be > 0");
+
+    size_t count = 0;
+    UnalignedSequenceVector cur, next;
+    cur.reserve(chunk_size);
+    next.reserve(chunk_size);
+    bool more = fill(cur);
+    std::vector<fseq1_t> fs;
+
+    while (!cur.empty()) {
+
+      // read the next chunk while this one is corrected
+      std::exception_ptr read_error;
+      bool next_more = false;
+      std::thread reader;
+      if (more)
+	reader = std::thread([&]() {
+	    try {
+	      next_more = fill(next);
+	    } catch (...) {
+	      read_error = std::current_exception();
+	    }
+	  });
+
+      try {
+	// correct in place, in the strings themselves
+	fs.resize(cur.size());
+	for (size_t i = 0; i < cur.size(); ++i) {
+	  UnalignedSequence& u = cur[i];
+	  fs[i].seq = &u.Seq[0];
+	  fs[i].qual = u.Qual.length() == u.Seq.length() ? &u.Qual[0] : NULL;
+	  fs[i].l_seq = u.Seq.length();
+	}
+	correct_batch(&fs[0], fs.size());
+
+	for (size_t i = 0; i < cur.size(); ++i) {
+	  UnalignedSequence& u = cur[i];
+	  u.Seq.resize(fs[i].l_seq);
+	  std::transform(u.Seq.begin(), u.Seq.end(), u.Seq.begin(), ::toupper);
+	  if (fs[i].qual)
+	    u.Qual.resize(fs[i].l_seq);
+	  cb(u);
+	  ++count;
+	}
+      } catch (...) {
+	if (reader.joinable())
+	  reader.join();
+	throw;
+      }
+
+      if (reader.joinable())
+	reader.join();
+      if (read_error)
+	std::rethrow_exception(read_error);
+
+      cur.swap(next);
+      next.clear();
+      more = more && next_more;
+    }
+
+    return count;
+  }
+
+  size_t BFC::CorrectStream(FastqReader& r, const CorrectedCallback& cb, size_t chunk_size) {
+    return correct_stream([&r, chunk_size](UnalignedSequenceVector& v) {
+	v.clear();
+	UnalignedSequence u;
+	while (v.size() < chunk_size) {
+	  if (!r.GetNextSequence(u))
+	    return false;
+	  if (!u.Seq.empty())
+	    v.push_back(u);
+	}
+	return true;
+      }, cb, chunk_size);
+  }
+
+  size_t BFC::CorrectStream(BamReader& r, const CorrectedCallback& cb, size_t chunk_size) {
+    return correct_stream([&r, chunk_size](UnalignedSequenceVector& v) {
+	v.clear();
+	BamRecord rec;
+	while (v.size() < chunk_size) {
+	  if (!r.GetNextRecord(rec))
+	    return false;
+	  const bam1_t* b = rec.raw();
+	  if (!b->core.l_qseq)
+	    continue;
+	  // 0xff means the record has no qualities
+	  v.push_back(UnalignedSequence(rec.Qname(), rec.Sequence(),
+					bam_get_qual(b)[0] == 0xff ? std::string() : rec.Qualities()));
+	}
+	return true;
+      }, cb, chunk_size);
+  }
+
+  // where one hash table of the k-mer table lives in the file
+  struct bfc_table_entry {
+    uint32_t n_buckets, size, n_occupied, upper_bound;
+    uint64_t flags_off, keys_off;
+  };
+
+  // number of 32-bit flag words khash keeps for n buckets
+  static inline size_t bfc_flags_len(khint_t n) {
+    return n < 16 ? 1 : n >> 4;
+  }
+
+  // round up so the next array is 8 byte aligned
+  static inline uint64_t bfc_align8(uint64_t x) {
+    return (x + 7) & ~(uint64_t)7;
+  }
+
+  bool BFC::WriteTable(const std::string& file) const {
+
+    if (!ch)
+      return false;
+
+    int32_t n_h = 1 << ch->l_pre;
+
+    // lay out the arrays after the directory
+    std::vector<bfc_table_entry> dir(n_h);
+    uint64_t off = BFC_TABLE_HEADER + n_h * sizeof(bfc_table_entry);
+    for (int32_t i = 0; i < n_h; ++i) {
+      const cnthash_t* h = ch->h[i];
+      bfc_table_entry& e = dir[i];
+      e.n_buckets = h->n_buckets;
+      e.size = h->size;
+      e.n_occupied = h->n_occupied;
+      e.upper_bound = h->upper_bound;
+      e.flags_off = e.keys_off = 0;
+      if (!h->n_buckets)
+	continue;
+      e.flags_off = off;
+      off = bfc_align8(off + bfc_flags_len(h->n_buckets) * sizeof(uint32_t));
+      e.keys_off = off;
+      off += (uint64_t)h->n_buckets * sizeof(uint64_t);
+    }
+
+    FILE* fp = fopen(file.c_str(), "wb");
+    if (!fp)
+      return false;
+
+    int32_t kl[2] = { ch->k, ch->l_pre };
+    bool ok = fwrite(BFC_TABLE_MAGIC, 1, 8, fp) == 8 &&
+      fwrite(kl, sizeof(int32_t), 2, fp) == 2 &&
+      fwrite(&off, sizeof(uint64_t), 1, fp) == 1 &&
+      fwrite(&dir[0], sizeof(bfc_table_entry), n_h, fp) == (size_t)n_h;
+
+    uint64_t pos = BFC_TABLE_HEADER + n_h * sizeof(bfc_table_entry);
+    static const char pad[8] = {0};
+    for (int32_t i = 0; ok && i < n_h; ++i) {
+      const cnthash_t* h = ch->h[i];
+      if (!h->n_buckets)
+	continue;
+      size_t l_flags = bfc_flags_len(h->n_buckets);
+      ok = fwrite(h->flags, sizeof(uint32_t), l_flags, fp) == l_flags;
+      pos += l_flags * sizeof(uint32_t);
+      size_t l_pad = bfc_align8(pos) - pos;
+      ok = ok && fwrite(pad, 1, l_pad, fp) == l_pad;
+      pos += l_pad;
+      ok = ok && fwrite(h->keys, sizeof(uint64_t), h->n_buckets, fp) == h->n_buckets;
+      pos += (uint64_t)h->n_buckets * sizeof(uint64_t);
+    }
+
+    ok = (fclose(fp) == 0) && ok;
+    return ok;
+  }
+
+  bool BFC::LoadTable(const std::string& file) {
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
 
-    return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < BFC_TABLE_HEADER) {
+      close(fd);
+      return false;
+    }
+
+    size_t len = st.st_size;
+    void* map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED)
+      return false;
 
+    // check the header, and that every array is inside the file
+    const uint8_t* m = static_cast<const uint8_t*>(map);
+    int32_t kl[2];
+    uint64_t l_file;
+    memcpy(kl, m + 8, sizeof(kl));
+    memcpy(&l_file, m + 16, sizeof(uint64_t));
+    bool ok = memcmp(m, BFC_TABLE_MAGIC, 8) == 0 && l_file == len &&
+      kl[0] > 0 && kl[1] >= 0 && kl[1] < 31 &&
+      BFC_TABLE_HEADER + ((uint64_t)1 << kl[1]) * sizeof(bfc_table_entry) <= len;
+    int32_t n_h = ok ? 1 << kl[1] : 0;
+    const bfc_table_entry* dir = reinterpret_cast<const bfc_table_entry*>(m + BFC_TABLE_HEADER);
+    for (int32_t i = 0; ok && i < n_h; ++i) {
+      const bfc_table_entry& e = dir[i];
+      if (!e.n_buckets)
+	continue;
+      ok = e.flags_off % 4 == 0 && e.keys_off % 8 == 0 &&
+	e.flags_off + bfc_flags_len(e.n_buckets) * sizeof(uint32_t) <= len &&
+	e.keys_off + (uint64_t)e.n_buckets * sizeof(uint64_t) <= len;
+    }
+    if (!ok) {
+      munmap(map, len);
+      return false;
+    }
 
+    // lookups only read the tables, so they can point into the mapping
+    bfc_ch_t* ch_new = (bfc_ch_t*)calloc(1, sizeof(bfc_ch_t));
+    ch_new->k = kl[0];
+    ch_new->l_pre = kl[1];
+    ch_new->h = (cnthash_t**)calloc(n_h, sizeof(cnthash_t*));
+    for (int32_t i = 0; i < n_h; ++i) {
+      const bfc_table_entry& e = dir[i];
+      cnthash_t* h = (cnthash_t*)calloc(1, sizeof(cnthash_t));
+      h->n_buckets = e.n_buckets;
+      h->size = e.size;
+      h->n_occupied = e.n_occupied;
+      h->upper_bound = e.upper_bound;
+      if (e.n_buckets) {
+	h->flags = (uint32_t*)(const_cast<uint8_t*>(m) + e.flags_off);
+	h->keys = (uint64_t*)(const_cast<uint8_t*>(m) + e.keys_off);
+      }
+      ch_new->h[i] = h;
+    }
+
+    clear_table();
+    ch = ch_new;
+    m_map = map;
+    m_map_len = len;
+
+    // same settings Train would leave behind
+    fml_opt_init(&fml_opt);
+    kmer = bfc_opt.k = ch->k;
+    bfc_opt.l_pre = ch->l_pre;
+    set_coverage();
+    return true;
+  }
+
+  void BFC::clear_table() {
+
+    if (!ch)
+      return;
+
+    // only the structs are ours if the arrays are mapped
+    if (m_map) {
+      for (int i = 0; i < (1 << ch->l_pre); ++i)
+	free(ch->h[i]);
+      free(ch->h);
+      free(ch);
+      munmap(m_map, m_map_len);
+      m_map = NULL;
+      m_map_len = 0;
+    } else {
+      bfc_ch_destroy(ch);
+    }
+    ch = NULL;
+    m_mode = -1;
   }
 
 }
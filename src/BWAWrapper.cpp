@@ -11,9 +11,23 @@ BWA is copyrighted by Heng Li with the Apache2 License
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <climits>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 extern "C" {
   #include <string.h>
+
+  // not in bwamem.h, but exported by bwamem.c (mem_align1 is these two calls)
+  mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf);
+  void mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
 }
 
 // custom sort 
@@ -37,8 +51,88 @@ bool aln_sort(const mem_aln_t& lhs, const mem_aln_t& rhs)
 
 //#define DEBUG_BWATOOLS 1
 
+// write an 'i' aux tag into a pre-sized bam1_t data block (as bam_aux_append would)
+static inline uint8_t* seqlib_put_int_tag(uint8_t* d, const char* tag, int32_t val) {
+  d[0] = tag[0];
+  d[1] = tag[1];
+  d[2] = 'i';
+  memcpy(d + 3, &val, 4);
+  return d + 7;
+}
+
+// header of an index image: magic, then the length of the bwa_idx2mem block
+#define BWA_IMAGE_MAGIC "SLBWAIM1"
+#define BWA_IMAGE_HEADER 16
+
+// take n items of size sz from the image at k, if there are that many left
+static inline bool seqlib_image_take(uint64_t l_mem, uint64_t& k, uint64_t n, uint64_t sz) {
+  if (sz && n > (l_mem - k) / sz)
+    return false;
+  k += n * sz;
+  return true;
+}
+
+// walk the bwa_idx2mem layout the way bwa_mem2idx will, checking each
+// length against the image size first, so a truncated or foreign image
+// fails here instead of sending bwa_mem2idx past the end of the mapping
+static bool seqlib_check_image(const uint8_t* mem, uint64_t l_mem) {
+
+  uint64_t k = 0;
+
+  // bwt struct, then the bwt and sa arrays
+  bwt_t bwt;
+  if (l_mem < sizeof(bwt_t))
+    return false;
+  memcpy(&bwt, mem, sizeof(bwt_t));
+  k += sizeof(bwt_t);
+  if (!seqlib_image_take(l_mem, k, bwt.bwt_size, 4) ||
+      !seqlib_image_take(l_mem, k, bwt.n_sa, sizeof(bwtint_t)))
+    return false;
+
+  // bns struct, then holes, annotations and their name / anno strings
+  bntseq_t bns;
+  if (l_mem - k < sizeof(bntseq_t))
+    return false;
+  memcpy(&bns, mem + k, sizeof(bntseq_t));
+  k += sizeof(bntseq_t);
+  if (bns.n_holes < 0 || bns.n_seqs < 0 || bns.l_pac < 0)
+    return false;
+  if (!seqlib_image_take(l_mem, k, bns.n_holes, sizeof(bntamb1_t)) ||
+      !seqlib_image_take(l_mem, k, bns.n_seqs, sizeof(bntann1_t)))
+    return false;
+  for (int32_t i = 0; i < 2 * bns.n_seqs; ++i) {
+    const void* nul = memchr(mem + k, 0, l_mem - k);
+    if (!nul)
+      return false;
+    k = static_cast<const uint8_t*>(nul) - mem + 1;
+  }
+
+  // pac, which must end the image
+  return seqlib_image_take(l_mem, k, bns.l_pac / 4 + 1, 1) && k == l_mem;
+}
+
+// modified from bwa (heng li). Same layout as smem_aux_t, which mem_align1_core
+// takes as its buffer. One per thread lets a batch reuse the SMEM vectors
+// instead of allocating them for each sequence
+typedef struct {
+  bwtintv_v mem, mem1, *tmpv[2];
+} seqlib_smem_aux_t;
+
+static seqlib_smem_aux_t* seqlib_smem_aux_new() {
+  seqlib_smem_aux_t *a = (seqlib_smem_aux_t*)calloc(1, sizeof(seqlib_smem_aux_t));
+  a->tmpv[0] = (bwtintv_v*)calloc(1, sizeof(bwtintv_v));
+  a->tmpv[1] = (bwtintv_v*)calloc(1, sizeof(bwtintv_v));
+  return a;
+}
+
+static void seqlib_smem_aux_free(seqlib_smem_aux_t *a) {
+  free(a->tmpv[0]->a); free(a->tmpv[0]);
+  free(a->tmpv[1]->a); free(a->tmpv[1]);
+  free(a->mem.a); free(a->mem1.a);
+  free(a);
+}
+
 #define _set_pac(pac, l, c) ((pac)[(l)>>2] |= (c)<<((~(l)&3)<<1))
-#define _get_pac(pac, l) ((pac)[(l)>>2]>>((~(l)&3)<<1)&3)
 
 namespace SeqLib {
 
@@ -127,19 +221,9 @@ namespace SeqLib {
     
     if (idx) {
       std::cerr << "...clearing old index" << std::endl;
-      bwa_idx_destroy(idx);
-      idx = 0;
+      clear_index();
     }
     
-    // allocate memory for idx
-    idx = (bwaidx_t*)calloc(1, sizeof(bwaidx_t));;
-
-    // construct the forward-only pac
-    uint8_t* fwd_pac = seqlib_make_pac(v, true); //true->for_only
-
-    // construct the forward-reverse pac ("packed" 2 bit sequence)
-    uint8_t* pac = seqlib_make_pac(v, false); // don't write, becasue only used to make BWT
-
     size_t tlen = 0;
     for (UnalignedSequenceVector::const_iterator i = v.begin(); i != v.end(); ++i)
       tlen += i->Seq.length();
@@ -148,15 +232,13 @@ namespace SeqLib {
     std::cerr << "ref seq length: " << tlen << std::endl;
 #endif
 
-    // make the bwt
-    bwt_t *bwt;
-    bwt = seqlib_bwt_pac2bwt(pac, tlen*2); // *2 for fwd and rev
-    bwt_bwtupdate_core(bwt);
-    free(pac); // done with fwd-rev pac 
-    
-    // construct sa from bwt and occ. adds it to bwt struct
-    bwt_cal_sa(bwt, 32);
-    bwt_gen_cnt_table(bwt);
+    // make the bwt and forward pac
+    bwt_t* bwt = 0;
+    uint8_t* fwd_pac = 0;
+    seqlib_build_bwt(v, tlen, &bwt, &fwd_pac);
+
+    // allocate memory for idx
+    idx = (bwaidx_t*)calloc(1, sizeof(bwaidx_t));;
         
     // make the bns
     bntseq_t * bns = (bntseq_t*) calloc(1, sizeof(bntseq_t));
@@ -262,6 +344,12 @@ namespace SeqLib {
     mem_alnreg_v ar;
     ar = mem_align1(memopt, idx->bwt, idx->bns, idx->pac, seq.length(), seq.data()); // get all the hits (was c_str())
 
+    regs2bam(ar, seq, name, vec, hardclip, keep_sec_with_frac_of_primary_score, max_secondary);
+  }
+
+  void BWAWrapper::regs2bam(mem_alnreg_v& ar, const std::string& seq, const std::string& name, BamRecordVector& vec, bool hardclip, 
+			    double keep_sec_with_frac_of_primary_score, int max_secondary) const {
+
 #ifdef DEBUG_BWATOOLS
       std::cerr << "num hits: " << ar.n << " " << name << std::endl;
       size_t secondary_count_debug = 0;
@@ -299,141 +387,122 @@ namespace SeqLib {
     
     // sort it 
     std::sort(a.begin(), a.end(), aln_sort);
-    
+
+    // decide which hits to keep first, so the secondary count (SQ) is
+    // known before any record is built
+    std::vector<bool> keep(a.size(), false);
     for (size_t i = 0; i < a.size(); ++i) {
       
       // if score not sufficient or past cap, continue
-      //bool sec_and_low_score =  ar.a[i].secondary >= 0 && (primary_score * keep_sec_with_frac_of_primary_score) > a.score;
-      //bool sec_and_cap_hit = ar.a[i].secondary >= 0 && (int)i > max_secondary;
       bool sec_and_low_score = (a[i].flag&BAM_FSECONDARY) && (primary_score * keep_sec_with_frac_of_primary_score) > a[i].score;
       bool sec_and_cap_hit =   (a[i].flag&BAM_FSECONDARY) && (int)i > max_secondary;
-      if (sec_and_low_score || sec_and_cap_hit) {
-	free(a[i].cigar);
+      if (sec_and_low_score || sec_and_cap_hit) 
 	continue;
-      } else if (!(a[i].flag&BAM_FSECONDARY)) {
+      else if (!(a[i].flag&BAM_FSECONDARY)) 
 	primary_score = a[i].score;
-	//num_secondary = 0;
-      }
+      keep[i] = true;
+      if (a[i].flag&BAM_FSECONDARY)
+	++secondary_count;
+    }
 
-      // instantiate the read
-      BamRecord b;
-      b.init();
+    const int new_val = hardclip ? BAM_CHARD_CLIP : BAM_CSOFT_CLIP;
+    const int32_t num_hits = ar.n;
 
-      b.b->core.tid = a[i].rid;
-      b.b->core.pos = a[i].pos;
-      b.b->core.qual = a[i].mapq;
-      b.b->core.flag = a[i].flag;
-      b.b->core.n_cigar = a[i].n_cigar;
+    for (size_t i = 0; i < a.size(); ++i) {
       
-      // set dumy mate
-      b.b->core.mtid = -1;
-      b.b->core.mpos = -1;
-      b.b->core.isize = 0;
-
-      // if alignment is reverse, set it
-      if (a[i].is_rev) 
-	b.b->core.flag |= BAM_FREVERSE;
+      if (!keep[i]) {
+	free(a[i].cigar);
+	free(a[i].XA);
+	continue;
+      }
 
-      std::string new_seq = seq;
-      // if hardclip, figure out what to clip
+      // if hardclip, figure out what to clip. mem_aln_t marks clips as N
+      size_t tstart = 0;
+      size_t len = seq.length();
       if (hardclip) {
-	size_t tstart = 0;
-	size_t len = 0;
-	for (int i = 0; i < a[i].n_cigar; ++i) {
-	  if (i == 0 && bam_cigar_op(a[i].cigar[i]) == BAM_CREF_SKIP) // first N (e.g. 20N50M)
-	    tstart = bam_cigar_oplen(a[i].cigar[i]);
-	  else if (bam_cigar_type(bam_cigar_op(a[i].cigar[i]))&1) // consumes query, but not N
-	    len += bam_cigar_oplen(a[i].cigar[i]);
+	len = 0;
+	for (int k = 0; k < a[i].n_cigar; ++k) {
+	  if (k == 0 && bam_cigar_op(a[i].cigar[k]) == BAM_CREF_SKIP) // first N (e.g. 20N50M)
+	    tstart = bam_cigar_oplen(a[i].cigar[k]);
+	  else if (bam_cigar_type(bam_cigar_op(a[i].cigar[k]))&1) // consumes query, but not N
+	    len += bam_cigar_oplen(a[i].cigar[k]);
 	}
 	assert(len > 0);
 	assert(tstart + len <= seq.length());
-	new_seq = seq.substr(tstart, len);
+	// the cigar is in alignment orientation, so on the reverse strand 
+	// the leading clip is at the end of the input sequence
+	if (a[i].is_rev)
+	  tstart = seq.length() - tstart - len;
       }
 
-      // allocate all the data
-      b.b->core.l_qname = name.length() + 1;
-      b.b->core.l_qseq = new_seq.length(); //(seq.length()>>1) + seq.length() % 2; // 4-bit encoding
-      b.b->l_data = b.b->core.l_qname + (a[i].n_cigar<<2) + ((b.b->core.l_qseq+1)>>1) + (b.b->core.l_qseq);
-      b.b.get()->data = (uint8_t*)malloc(b.b.get()->l_data);
-
-      // allocate the qname
-      memcpy(b.b->data, name.c_str(), name.length() + 1);
-
-      // allocate the cigar. Reverse if aligned to neg strand, since mem_aln_t stores
-      // cigars relative to referemce string oreiatnion, not forward alignment
-      memcpy(b.b->data + b.b->core.l_qname, (uint8_t*)a[i].cigar, a[i].n_cigar<<2);
-
-      // convert N to S or H
-      int new_val = hardclip ? BAM_CHARD_CLIP : BAM_CSOFT_CLIP;
-      uint32_t * cigr = bam_get_cigar(b.b);
-      for (int k = 0; k < b.b->core.n_cigar; ++k) {
-	if ( (cigr[k] & BAM_CIGAR_MASK) == BAM_CREF_SKIP) {
-	  cigr[k] &= ~BAM_CIGAR_MASK;
-	  cigr[k] |= new_val;
-	}
+      // size the whole data block: qname, cigar, seq, qual and tags
+      const size_t xa_len = a[i].XA ? strlen(a[i].XA) : 0;
+      const int l_qname = name.length() + 1;
+      const int l_cigar = a[i].n_cigar << 2;
+      const int l_seq = (len + 1) >> 1;
+      const int l_tags = 4 * (3 + 4) + (xa_len ? 3 + xa_len + 1 : 0); // NA, NM, AS, SQ + XA
+
+      // instantiate the read
+      BamRecord b;
+      b.init();
+      bam1_t* r = b.b.get();
+
+      r->core.tid = a[i].rid;
+      r->core.pos = a[i].pos;
+      r->core.qual = a[i].mapq;
+      r->core.flag = a[i].flag;
+      r->core.n_cigar = a[i].n_cigar;
+      r->core.l_qname = l_qname;
+      r->core.l_qseq = len;
+      
+      // set dumy mate
+      r->core.mtid = -1;
+      r->core.mpos = -1;
+      r->core.isize = 0;
+
+      // if alignment is reverse, set it
+      if (a[i].is_rev) 
+	r->core.flag |= BAM_FREVERSE;
+
+      r->l_data = r->m_data = l_qname + l_cigar + l_seq + len + l_tags;
+      r->data = (uint8_t*)malloc(r->m_data);
+      uint8_t* d = r->data;
+
+      // qname
+      memcpy(d, name.c_str(), l_qname);
+      d += l_qname;
+
+      // cigar, with the N clips converted to S or H
+      for (int k = 0; k < a[i].n_cigar; ++k) {
+	uint32_t c = a[i].cigar[k];
+	if ((c & BAM_CIGAR_MASK) == BAM_CREF_SKIP)
+	  c = (c & ~BAM_CIGAR_MASK) | new_val;
+	memcpy(d, &c, 4); // qname length leaves the cigar unaligned
+	d += 4;
       }
 	
-      // allocate the sequence
-      uint8_t* m_bases = b.b->data + b.b->core.l_qname + (b.b->core.n_cigar<<2);
-
-      // TODO move this out of bigger loop
-      int slen = new_seq.length();
-      int j = 0;
-      if (a[i].is_rev) {
-	for (int i = slen-1; i >= 0; --i) {
-	  
-	  // bad idea but works for now
-	  // this is REV COMP things
-	  uint8_t base = 15;
-	  if (new_seq.at(i) == 'T')
-	    base = 1;
-	  else if (new_seq.at(i) == 'G')
-	    base = 2;
-	  else if (new_seq.at(i) == 'C')
-	    base = 4;
-	  else if (new_seq.at(i) == 'A')
-	    base = 8;
-
-	  m_bases[j >> 1] &= ~(0xF << ((~j & 1) << 2));   ///< zero out previous 4-bit base encoding
-	  m_bases[j >> 1] |= base << ((~j & 1) << 2);  ///< insert new 4-bit base encoding
-	  ++j;
-	}
-      } else {
-	for (int i = 0; i < slen; ++i) {
-	// bad idea but works for now
-	  uint8_t base = 15;
-	  if (new_seq.at(i) == 'A')
-	    base = 1;
-	  else if (new_seq.at(i) == 'C')
-	    base = 2;
-	  else if (new_seq.at(i) == 'G')
-	    base = 4;
-	  else if (new_seq.at(i) == 'T')
-	    base = 8;
-	  
-	  m_bases[i >> 1] &= ~(0xF << ((~i & 1) << 2));   ///< zero out previous 4-bit base encoding
-	  m_bases[i >> 1] |= base << ((~i & 1) << 2);  ///< insert new 4-bit base encoding
-
-	}
+      // pack the bases, reverse complemented if aligned to the neg strand
+      if (a[i].is_rev)
+	EncodeBasesRevComp(seq.data() + tstart, len, d);
+      else
+	EncodeBases(seq.data() + tstart, len, d);
+      d += l_seq;
+
+      // no qualities
+      memset(d, 0xff, len);
+      d += len;
+
+      // tags, in the order they were once appended
+      d = seqlib_put_int_tag(d, "NA", num_hits); // number of matches
+      d = seqlib_put_int_tag(d, "NM", a[i].NM);
+      if (xa_len) {
+	memcpy(d, "XAZ", 3);
+	memcpy(d + 3, a[i].XA, xa_len + 1);
+	d += 3 + xa_len + 1;
       }
-
-      // allocate the quality to NULL
-      uint8_t* s = bam_get_qual(b.b);
-      s[0] = 0xff;
-
-      b.AddIntTag("NA", ar.n); // number of matches
-      b.AddIntTag("NM", a[i].NM);
-
-      if (a[i].XA)
-	b.AddZTag("XA", std::string(a[i].XA));
-
-      // add num sub opt
-      //b.AddIntTag("SB", ar.a[i].sub_n);
-      b.AddIntTag("AS", a[i].score);
-
-      // count num secondaries
-      if (b.SecondaryFlag())
-	++secondary_count;
+      d = seqlib_put_int_tag(d, "AS", a[i].score);
+      d = seqlib_put_int_tag(d, "SQ", secondary_count);
+      assert(d == r->data + r->l_data);
 
       vec.push_back(b);
 
@@ -446,14 +515,10 @@ namespace SeqLib {
 #endif
       
       free(a[i].cigar); // don't forget to deallocate CIGAR
+      free(a[i].XA);
     }
     
     free (ar.a); // dealloc the hit list
-    
-    // add the secondary counts
-    for (BamRecordVector::iterator i = vec.begin(); i != vec.end(); ++i)
-      i->AddIntTag("SQ", secondary_count);
-    
   }
   
   void BWAWrapper::AlignSequence(const UnalignedSequence& us, BamRecordVector& vec, bool hardclip,
@@ -465,167 +530,242 @@ namespace SeqLib {
           if (copy_comment)
               i->AddZTag("BC", us.Com);
 }
+
+  void BWAWrapper::AlignSequences(const UnalignedSequenceVector& v, std::vector<BamRecordVector>& out, bool hardclip,
+				  double keep_sec_with_frac_of_primary_score, int max_secondary, int nthreads) const {
+
+    if (nthreads < 1)
+      throw std::invalid_argument("BWAWrapper::AlignSequences - nthreads must be > 0");
+
+    out.clear();
+    out.resize(v.size());
+
+    // we haven't made an index, just return
+    if (!idx || v.empty())
+      return;
+
+    if (static_cast<size_t>(nthreads) > v.size())
+      nthreads = v.size();
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> abort(false);
+    std::mutex mtx;
+    std::exception_ptr error;
+
+    auto work = [&]() {
+      // smem buffers live for the whole batch, rather than one per sequence
+      seqlib_smem_aux_t* buf = seqlib_smem_aux_new();
+      std::string s;
+      try {
+	for (size_t i = next++; i < v.size() && !abort; i = next++) {
+	  // mem_align1_core 2-bit encodes the query in place
+	  s = v[i].Seq;
+	  mem_alnreg_v ar = mem_align1_core(memopt, idx->bwt, idx->bns, idx->pac, s.length(), &s[0], buf);
+	  // seed the primary tie-breaking with the input index, so output does not depend on threads
+	  mem_mark_primary_se(memopt, ar.n, ar.a, i);
+	  regs2bam(ar, v[i].Seq, v[i].Name, out[i], hardclip, keep_sec_with_frac_of_primary_score, max_secondary);
+	  if (copy_comment)
+	    for (BamRecordVector::iterator r = out[i].begin(); r != out[i].end(); ++r)
+	      r->AddZTag("BC", v[i].Com);
+	}
+      } catch (...) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!error)
+	  error = std::current_exception();
+	abort = true;
+      }
+      seqlib_smem_aux_free(buf);
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < nthreads; ++t)
+      workers.push_back(std::thread(work));
+    work(); // calling thread does its share
+    for (std::vector<std::thread>::iterator t = workers.begin(); t != workers.end(); ++t)
+      t->join();
+
+    if (error)
+      std::rethrow_exception(error);
+  }
   
-// modified from bwa (heng li)
-uint8_t* BWAWrapper::seqlib_add1(const kseq_t *seq, bntseq_t *bns, uint8_t *pac, int64_t *m_pac, int *m_seqs, int *m_holes, bntamb1_t **q)
-{
-  bntann1_t *p;
-  int lasts;
-  if (bns->n_seqs == *m_seqs) {
-    *m_seqs <<= 1;
-    bns->anns = (bntann1_t*)realloc(bns->anns, *m_seqs * sizeof(bntann1_t));
+  // copy a read into bwa's input form. bwa encodes seq in place, so it gets its own copy
+  static void seqlib_fill_bseq(bseq1_t* b, const UnalignedSequence& us, int id) {
+    memset(b, 0, sizeof(bseq1_t));
+    b->id = id;
+    b->l_seq = us.Seq.length();
+    b->name = strdup(us.Name.c_str());
+    b->seq = strdup(us.Seq.c_str());
+    if (us.Qual.length() == us.Seq.length() && !us.Qual.empty())
+      b->qual = strdup(us.Qual.c_str());
   }
-  p = bns->anns + bns->n_seqs;
-  p->name = strdup((char*)seq->name.s);
-  p->anno = seq->comment.l > 0? strdup((char*)seq->comment.s) : strdup("(null)");
-  p->gi = 0; p->len = seq->seq.l;
-  p->offset = (bns->n_seqs == 0)? 0 : (p-1)->offset + (p-1)->len;
-  p->n_ambs = 0;
-  for (size_t i = lasts = 0; i < seq->seq.l; ++i) {
-    int c = nst_nt4_table[(int)seq->seq.s[i]];
-    if (c >= 4) { // N
-      if (lasts == seq->seq.s[i]) { // contiguous N
-	++(*q)->len;
-      } else {
-	if (bns->n_holes == *m_holes) {
-	  (*m_holes) <<= 1;
-	  bns->ambs = (bntamb1_t*)realloc(bns->ambs, (*m_holes) * sizeof(bntamb1_t));
+
+  void BWAWrapper::AlignPairs(const UnalignedSequenceVector& r1, const UnalignedSequenceVector& r2, BamRecordVector& vec, int nthreads) const {
+
+    if (r1.size() != r2.size())
+      throw std::invalid_argument("BWAWrapper::AlignPairs - r1 and r2 must have the same number of reads");
+    if (nthreads < 1)
+      throw std::invalid_argument("BWAWrapper::AlignPairs - nthreads must be > 0");
+
+    // we haven't made an index, just return
+    if (!idx || r1.empty())
+      return;
+
+    mem_opt_t opt = *memopt;
+    opt.flag |= MEM_F_PE;
+    opt.n_threads = nthreads;
+
+    // bwa wants the pairs interleaved
+    const int n = r1.size() * 2;
+    std::vector<bseq1_t> seqs(n);
+    for (size_t i = 0; i < r1.size(); ++i) {
+      seqlib_fill_bseq(&seqs[i*2],   r1[i], i*2);
+      seqlib_fill_bseq(&seqs[i*2+1], r2[i], i*2+1);
+    }
+
+    // estimates insert size (no pes0), aligns, pairs, rescues mates and writes sam lines
+    mem_process_seqs(&opt, idx->bwt, idx->bns, idx->pac, 0, n, &seqs[0], 0);
+
+    BamHeader hdr = HeaderFromIndex();
+    bool parse_failed = false;
+    for (int i = 0; i < n; ++i) {
+      const UnalignedSequence& us = (i & 1) ? r2[i>>1] : r1[i>>1];
+      char* line = seqs[i].sam;
+      while (line && *line && !parse_failed) {
+	char* eol = strchr(line, '\n');
+	if (eol)
+	  *eol = '\0';
+	BamRecord b;
+	b.init();
+	kstring_t ks;
+	ks.l = strlen(line);
+	ks.m = ks.l + 1;
+	ks.s = line;
+	if (sam_parse1(&ks, hdr.get_(), b.b.get()) < 0) {
+	  parse_failed = true;
+	  break;
 	}
-	*q = bns->ambs + bns->n_holes;
-	(*q)->len = 1;
-	(*q)->offset = p->offset + i;
-	(*q)->amb = seq->seq.s[i];
-	++p->n_ambs;
-	++bns->n_holes;
+	if (copy_comment)
+	  b.AddZTag("BC", us.Com);
+	vec.push_back(b);
+	line = eol ? eol + 1 : NULL;
       }
+      free(seqs[i].name); free(seqs[i].comment); free(seqs[i].seq); 
+      free(seqs[i].qual); free(seqs[i].sam);
     }
-    lasts = seq->seq.s[i];
-    { // fill buffer
-      if (c >= 4) c = lrand48()&3;
-      if (bns->l_pac == *m_pac) { // double the pac size
-	*m_pac <<= 1;
-	pac = (uint8_t*)realloc(pac, *m_pac/4);
-	memset(pac + bns->l_pac/4, 0, (*m_pac - bns->l_pac)/4);
+
+    if (parse_failed)
+      throw std::runtime_error("BWAWrapper::AlignPairs - failed to parse bwa output");
+  }
+
+  // Same result as bwa index (pac2bwt, bwtupdate, cal_sa) on the sequences, but
+  // straight from the strings and with one suffix array: the BWT and the sampled
+  // SA are both read off the SA from is_sa, rather than rebuilding the SA by 
+  // walking the BWT backwards (bwt_cal_sa), which dominated for small references
+  void BWAWrapper::seqlib_build_bwt(const UnalignedSequenceVector& v, size_t tlen, bwt_t** bwt_out, uint8_t** pac_out) 
+  {
+    const int64_t n = tlen * 2; // forward and reverse complement
+    if (n >= INT_MAX)
+      throw std::invalid_argument("BWAWrapper::ConstructIndex - reference too large to index in memory");
+
+    // 2-bit encode. Like bwa, N and other bases are replaced by random ones,
+    // but with a local generator (seeded as bns->seed) so that builds are 
+    // reproducible and can run on many threads at once
+    ubyte_t* buf = (ubyte_t*)malloc(n + 1);
+    unsigned short rng[3] = { 11, 0, 0 };
+    int64_t k = 0;
+    for (UnalignedSequenceVector::const_iterator i = v.begin(); i != v.end(); ++i)
+      for (std::string::const_iterator c = i->Seq.begin(); c != i->Seq.end(); ++c) {
+	int e = nst_nt4_table[(uint8_t)*c];
+	buf[k++] = e < 4 ? e : (nrand48(rng) & 3);
       }
-      _set_pac(pac, bns->l_pac, c);
-      ++bns->l_pac;
+    for (int64_t l = 0; l < (int64_t)tlen; ++l)
+      buf[n - 1 - l] = 3 - buf[l];
+
+    // the index keeps only the forward pac
+    uint8_t* pac = (uint8_t*)calloc(tlen / 4 + 1, 1);
+    for (int64_t l = 0; l < (int64_t)tlen; ++l)
+      _set_pac(pac, l, buf[l]);
+
+    bwt_t* bwt = (bwt_t*)calloc(1, sizeof(bwt_t));
+    bwt->seq_len = n;
+    bwt->bwt_size = (n + 15) >> 4;
+    for (int64_t l = 0; l < n; ++l)
+      ++bwt->L2[1 + buf[l]];
+    for (int i = 2; i <= 4; ++i) 
+      bwt->L2[i] += bwt->L2[i-1];
+
+    // SA[0] is the sentinel (= n)
+    int* SA = (int*)malloc((n + 1) * sizeof(int));
+    if (is_sa(buf, SA, n) != 0) {
+      free(SA); free(buf); free(pac); free(bwt);
+      throw std::runtime_error("BWAWrapper::ConstructIndex - suffix array construction failed");
     }
-  }
-  ++bns->n_seqs;
 
-  return pac;
-}
+    // BWT (skipping the sentinel row) and every 32nd SA value, as bwt_cal_sa(bwt, 32)
+    bwt->bwt = (uint32_t*)calloc(bwt->bwt_size, 4);
+    bwt->sa_intv = 32;
+    bwt->n_sa = (n + bwt->sa_intv) / bwt->sa_intv;
+    bwt->sa = (bwtint_t*)calloc(bwt->n_sa, sizeof(bwtint_t));
+    int64_t j = 0;
+    for (int64_t i = 0; i <= n; ++i) {
+      if ((i & 31) == 0)
+	bwt->sa[i >> 5] = SA[i];
+      if (SA[i] == 0) {
+	bwt->primary = i;
+	continue;
+      }
+      bwt->bwt[j >> 4] |= (uint32_t)buf[SA[i] - 1] << ((15 - (j & 15)) << 1);
+      ++j;
+    }
+    bwt->sa[0] = (bwtint_t)-1;
+    free(SA);
+    free(buf);
 
-  // modified from bwa (heng li)
-uint8_t* BWAWrapper::seqlib_make_pac(const UnalignedSequenceVector& v, bool for_only)
-{
+    // interleave the occurrence counts
+    bwt_bwtupdate_core(bwt);
+    bwt_gen_cnt_table(bwt);
 
-  bntseq_t * bns = (bntseq_t*)calloc(1, sizeof(bntseq_t));
-  uint8_t *pac = 0; 
-  int32_t m_seqs, m_holes;
-  int64_t m_pac, l;
-  bntamb1_t *q;
-
-  bns->seed = 11; // fixed seed for random generator
-  m_seqs = m_holes = 8; m_pac = 0x10000;
-  bns->anns = (bntann1_t*)calloc(m_seqs, sizeof(bntann1_t));
-  bns->ambs = (bntamb1_t*)calloc(m_holes, sizeof(bntamb1_t));
-  pac = (uint8_t*) calloc(m_pac/4, 1);
-  q = bns->ambs;
-
-  // move through the unaligned sequences
-  for (size_t k = 0; k < v.size(); ++k) {
-
-    // make the ref name kstring
-    kstring_t * name = (kstring_t*)malloc(1 * sizeof(kstring_t));
-    name->l = v[k].Name.length() + 1;
-    name->m = v[k].Name.length() + 3;
-    name->s = (char*)calloc(name->m, sizeof(char));
-    memcpy(name->s, v[k].Name.c_str(), v[k].Name.length()+1);
-    
-    // make the sequence kstring
-    kstring_t * t = (kstring_t*)malloc(sizeof(kstring_t));
-    t->l = v[k].Seq.length();
-    t->m = v[k].Seq.length() + 2;
-    //t->s = (char*)calloc(v[k].Seq.length(), sizeof(char));
-    t->s = (char*)malloc(t->m);
-    memcpy(t->s, v[k].Seq.c_str(), v[k].Seq.length());
-    
-    // put into a kstring
-    kseq_t *ks = (kseq_t*)calloc(1, sizeof(kseq_t));  
-    ks->seq = *t;
-    ks->name = *name;
-    
-    // make the forward only pac
-    pac = seqlib_add1(ks, bns, pac, &m_pac, &m_seqs, &m_holes, &q);
-
-    // clear it out
-    free(name->s);
-    free(name);
-    free(t->s);
-    free(t);
-    //free(ks->name.s); 
-    //free(ks->seq.s);
-    //free(ks->f->buf);
-    //free(
-    free(ks);
-    // NOTE free kstring_t?
-    //kseq_destroy(s);
+    *bwt_out = bwt;
+    *pac_out = pac;
   }
 
-  if (!for_only) 
-    {
-      // add the reverse complemented sequence
-      m_pac = (bns->l_pac * 2 + 3) / 4 * 4;
-      pac = (uint8_t*)realloc(pac, m_pac/4);
-      memset(pac + (bns->l_pac+3)/4, 0, (m_pac - (bns->l_pac+3)/4*4) / 4);
-      for (l = bns->l_pac - 1; l >= 0; --l, ++bns->l_pac)
-	_set_pac(pac, bns->l_pac, 3-_get_pac(pac, l));
-    }
-
-  bns_destroy(bns);
-  
-  return pac;
-}
+  void BWAWrapper::ConstructIndexes(const std::vector<BWAWrapper*>& w, const std::vector<UnalignedSequenceVector>& refs, int nthreads) {
+
+    if (w.size() != refs.size())
+      throw std::invalid_argument("BWAWrapper::ConstructIndexes - need one reference per wrapper");
+    if (nthreads < 1)
+      throw std::invalid_argument("BWAWrapper::ConstructIndexes - nthreads must be > 0");
+
+    if (static_cast<size_t>(nthreads) > w.size())
+      nthreads = w.size();
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> abort(false);
+    std::mutex mtx;
+    std::exception_ptr error;
+
+    auto work = [&]() {
+      try {
+	for (size_t i = next++; i < w.size() && !abort; i = next++) 
+	  w[i]->ConstructIndex(refs[i]);
+      } catch (...) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!error)
+	  error = std::current_exception();
+	abort = true;
+      }
+    };
 
-  // modified from bwa (heng li)
-bwt_t *BWAWrapper::seqlib_bwt_pac2bwt(const uint8_t *pac, int bwt_seq_lenr)
-{
+    std::vector<std::thread> workers;
+    for (int t = 1; t < nthreads; ++t)
+      workers.push_back(std::thread(work));
+    work();
+    for (std::vector<std::thread>::iterator t = workers.begin(); t != workers.end(); ++t)
+      t->join();
 
-  bwt_t *bwt;
-  ubyte_t *buf;
-  int i;
-  //FILE *fp;
-
-  // initialization
-  bwt = (bwt_t*)calloc(1, sizeof(bwt_t));
-  bwt->seq_len = bwt_seq_lenr; //bwa_seq_len(fn_pac); //dummy
-  bwt->bwt_size = (bwt->seq_len + 15) >> 4;
-  //fp = xopen(fn_pac, "rb");
-
-  // prepare sequence
-  //pac_size = (bwt->seq_len>>2) + ((bwt->seq_len&3) == 0? 0 : 1);
-  //buf2 = (ubyte_t*)calloc(pac_size, 1);
-  //err_fread_noeof(buf2, 1, pac_size, fp);
-  //err_fclose(fp);
-  memset(bwt->L2, 0, 5 * 4);
-  buf = (ubyte_t*)calloc(bwt->seq_len + 1, 1);
-  for (i = 0; i < (int)bwt->seq_len; ++i) {
-    buf[i] = pac[i>>2] >> ((3 - (i&3)) << 1) & 3;
-    ++bwt->L2[1+buf[i]];
+    if (error)
+      std::rethrow_exception(error);
   }
-  for (i = 2; i <= 4; ++i) 
-    bwt->L2[i] += bwt->L2[i-1];
-  //free(buf2);
-
-  // Burrows-Wheeler Transform
-  bwt->primary = is_bwt(buf, bwt->seq_len);
-  bwt->bwt = (u_int32_t*)calloc(bwt->bwt_size, 4);
-  for (i = 0; i < (int)bwt->seq_len; ++i)
-    bwt->bwt[i>>4] |= buf[i] << ((15 - (i&15)) << 1);
-  free(buf);
-  return bwt;
-}
 
   // modified from bwa (heng li)
   bntann1_t* BWAWrapper::seqlib_add_to_anns(const std::string& name, const std::string& seq, bntann1_t* ann, size_t offset) 
@@ -656,10 +796,85 @@ bwt_t *BWAWrapper::seqlib_bwt_pac2bwt(const uint8_t *pac, int bwt_seq_lenr)
 
     if (idx) {
       std::cerr << "...clearing old index" << std::endl;
-      bwa_idx_destroy(idx);
+      clear_index();
+    } 
+    
+    idx = idx_new;
+    return true;
+  }
+
+  void BWAWrapper::clear_index() {
+    if (idx)
+      bwa_idx_destroy(idx); // leaves the image alone, as is_shm is set for mapped indices
+    idx = 0;
+    if (m_map)
+      munmap(m_map, m_map_len);
+    m_map = 0;
+    m_map_len = 0;
+  }
+
+  bool BWAWrapper::WriteIndexImage(const std::string& file) {
+
+    if (!idx || m_map) // a mapped index is already an image, and is read-only
+      return false;
+
+    // pack bwt, bns and pac into idx->mem. idx stays usable
+    if (!idx->mem && bwa_idx2mem(idx) != 0)
+      return false;
+
+    FILE* fp = fopen(file.c_str(), "wb");
+    if (!fp)
+      return false;
+    uint64_t l_mem = idx->l_mem;
+    bool ok = fwrite(BWA_IMAGE_MAGIC, 1, 8, fp) == 8 &&
+      fwrite(&l_mem, sizeof(uint64_t), 1, fp) == 1 &&
+      fwrite(idx->mem, 1, l_mem, fp) == l_mem;
+    ok = (fclose(fp) == 0) && ok;
+    return ok;
+  }
+
+  bool BWAWrapper::LoadIndexImage(const std::string& file) {
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < BWA_IMAGE_HEADER) {
+      close(fd);
+      return false;
+    }
+
+    size_t len = st.st_size;
+    void* map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED)
+      return false;
+
+    // check the header, that the file holds the whole image, and its layout
+    const uint8_t* m = static_cast<const uint8_t*>(map);
+    uint64_t l_mem;
+    memcpy(&l_mem, m + 8, sizeof(uint64_t));
+    if (memcmp(m, BWA_IMAGE_MAGIC, 8) != 0 || l_mem != len - BWA_IMAGE_HEADER ||
+	!seqlib_check_image(m + BWA_IMAGE_HEADER, l_mem)) {
+      munmap(map, len);
+      return false;
+    }
+
+    // bwa_mem2idx only reads the image, copying the small structs and
+    // pointing bwt, sa, pac and names into it
+    bwaidx_t* idx_new = (bwaidx_t*)calloc(1, sizeof(bwaidx_t));
+    bwa_mem2idx(l_mem, const_cast<uint8_t*>(m) + BWA_IMAGE_HEADER, idx_new);
+    idx_new->is_shm = 1; // don't let bwa_idx_destroy free the image
+
+    if (idx) {
+      std::cerr << "...clearing old index" << std::endl;
+      clear_index();
     } 
     
     idx = idx_new;
+    m_map = map;
+    m_map_len = len;
     return true;
   }
 
@@ -1,17 +1,38 @@
 #include "SeqLib/BamReader.h"
 
+#include <mutex>
+#include <condition_variable>
+#include <sys/stat.h>
+
 //#define DEBUG_WALKER 1
 
 namespace SeqLib {
 
+  // order BAMs in the merge heap by (chr, pos) of their slotted read, then
+  // by the order the files were opened. std heaps are max-heaps, so this
+  // returns true if a should come out *after* b. Chr is compared unsigned
+  // so that unmapped reads (chr -1) sort last, same as samtools merge
+  struct _BamHeapCompare {
+    bool operator()(const _Bam* a, const _Bam* b) const {
+      uint32_t achr = a->next_read.ChrID(), bchr = b->next_read.ChrID();
+      if (achr != bchr)
+	return achr > bchr;
+      if (a->next_read.Position() != b->next_read.Position())
+	return a->next_read.Position() > b->next_read.Position();
+      return a->m_order > b->m_order;
+    }
+  };
+
 // set the bam region
 bool _Bam::SetRegion(const GenomicRegion& gp) {
 
   // mark it "open" again, may be new reads here
   mark_for_closure = false;
     
-  //HTS set region 
-  if ( (fp->format.format == 4 || fp->format.format == 6) && !idx)  // BAM (4) or CRAM (6)
+  //HTS set region. BAM indices can be shared, CRAM indices belong to this fp
+  if (fp->format.format == 4 && !idx) // BAM (4)
+    idx = BamIndexCache::Get(m_in, fp.get());
+  else if (fp->format.format == 6 && !idx)  // CRAM (6)
     idx = SharedIndex(sam_index_load(fp.get(), m_in.c_str()), idx_delete());
   
   if (!idx) {
@@ -38,10 +59,35 @@ bool _Bam::SetRegion(const GenomicRegion& gp) {
   return true;
 }
 
+bool _Bam::rewind(ThreadPool t) {
+
+  reset();
+  hts_itr.reset();
+  if (!fp)
+    return false;
+
+  // back to the first region
+  if (m_region && m_region->size())
+    return SetRegion(m_region->at(0));
+
+  // back to the first read. BAM can seek to just past the header,
+  // SAM and CRAM are opened again (which reloads the header)
+  if (m_data_start >= 0)
+    return bgzf_seek(fp->fp.bgzf, m_data_start, SEEK_SET) == 0;
+  if (m_in == "-")
+    return false;
+  idx.reset(); // CRAM indices belong to the old fp
+  return open_BAM_for_reading(t);
+}
+
 void BamReader::Reset() {
-  for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b) 
-     b->second.reset();
+  m_prefetch.halt();
+  m_prefetch.clear();
   m_region = GRC();
+  unplan_regions();
+  for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b) 
+    b->second.rewind(pool);
+  m_heap_dirty = true;
 }
 
   bool BamReader::Reset(const std::string& f) {
@@ -49,15 +95,20 @@ void BamReader::Reset() {
     // cant reset what we don't have
     if (!m_bams.count(f))
       return false;
-    m_bams[f].reset();
-    return true;
+    m_prefetch.halt();
+    m_prefetch.clear();
+    m_heap_dirty = true;
+    return m_bams[f].rewind(pool);
 }
 
   bool BamReader::Close() {
     
+    m_prefetch.halt();
+    m_prefetch.clear();
     bool success = true;
   for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b) 
       success = success && b->second.close();
+    m_heap_dirty = true;
     return success;
   }
 
@@ -67,10 +118,95 @@ void BamReader::Reset() {
     if (!m_bams.count(f)) 
       return false;
 
+    m_prefetch.halt();
+    m_prefetch.clear();
+    m_heap_dirty = true;
     return m_bams[f].close();
   }
 
-  /*  SharedHTSFile BamReader::GetHTSFile () const {
+  std::mutex BamIndexCache::m_mutex;
+  std::map<std::string, BamIndexCache::Entry> BamIndexCache::m_cache;
+
+  // the index file HTSlib looks for first for a BAM: .csi before .bai, each
+  // appended to the name and then in place of its extension. Empty if none
+  static std::string _bam_index_file(const std::string& f, struct stat& st) {
+    size_t dot = f.rfind('.');
+    size_t slash = f.rfind('/');
+    bool has_ext = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+    const char* exts[] = { ".csi", ".bai" };
+    for (size_t i = 0; i < 2; ++i) {
+      std::string c = f + exts[i];
+      if (stat(c.c_str(), &st) == 0)
+	return c;
+      if (has_ext) {
+	c = f.substr(0, dot) + exts[i];
+	if (stat(c.c_str(), &st) == 0)
+	  return c;
+      }
+    }
+    return std::string();
+  }
+
+  SharedIndex BamIndexCache::Get(const std::string& f, htsFile* fp) {
+
+    if (!fp)
+      return SharedIndex();
+
+    // no way to tell if stdin or a remote file (or its index) changed, so don't cache them
+    struct stat st, ist;
+    std::string fi;
+    if (stat(f.c_str(), &st) != 0 || (fi = _bam_index_file(f, ist)).empty())
+      return SharedIndex(sam_index_load(fp, f.c_str()), idx_delete());
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::map<std::string, Entry>::const_iterator e = m_cache.find(f);
+      if (e != m_cache.end() && e->second.mtime == st.st_mtime &&
+	  e->second.idx_file == fi && e->second.idx_mtime == ist.st_mtime)
+	return e->second.idx;
+    }
+
+    // load outside the lock, so other files aren't held up. Load the index
+    // file that was stat'd, so the entry matches it. If two threads race to
+    // load the same index, the first one in wins
+    SharedIndex idx(sam_index_load2(fp, f.c_str(), fi.c_str()), idx_delete());
+    if (!idx)
+      return idx;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Entry& e = m_cache[f];
+    if (!e.idx || e.mtime != st.st_mtime || e.idx_file != fi || e.idx_mtime != ist.st_mtime) {
+      e.mtime = st.st_mtime;
+      e.idx_file = fi;
+      e.idx_mtime = ist.st_mtime;
+      e.idx = idx;
+    }
+    return e.idx;
+  }
+
+  bool BamIndexCache::Preload(const std::string& f) {
+    SharedHTSFile fp(hts_open(f.c_str(), "r"), htsFile_delete());
+    if (!fp || fp->format.format != 4) // BAM only
+      return false;
+    return Get(f, fp.get()).get() != NULL;
+  }
+
+  bool BamIndexCache::Evict(const std::string& f) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cache.erase(f) > 0;
+  }
+
+  void BamIndexCache::Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cache.clear();
+  }
+
+  size_t BamIndexCache::Size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_cache.size();
+  }
+
+  SharedHTSFile BamReader::GetHTSFile () const {
     if (!m_bams.size())
       throw std::runtime_error("No BAMs have been opened yet");
     return m_bams.begin()->second.fp;
@@ -87,6 +223,7 @@ void BamReader::Reset() {
   bool BamReader::SetPreloadedIndex(SharedIndex& i) {
     if (!m_bams.size())
       return false;
+    m_prefetch.halt();
     m_bams.begin()->second.set_index(i);
     return true;
   }
@@ -94,15 +231,18 @@ void BamReader::Reset() {
   bool BamReader::SetPreloadedIndex(const std::string& f, SharedIndex& i) {
     if (!m_bams.count(f))
       return false;
+    m_prefetch.halt();
     m_bams[f].set_index(i);
     return true;
   }
 
-  */
-
   bool BamReader::SetRegion(const GenomicRegion& g) {
+    m_prefetch.halt();
+    m_prefetch.clear();
     m_region.clear();
     m_region.add(g);
+    unplan_regions();
+    m_heap_dirty = true;
     
     bool success = true;
     if (m_region.size()) {
@@ -125,15 +265,28 @@ void BamReader::Reset() {
     return false;
   }
   
+  m_prefetch.halt();
+  m_prefetch.clear();
   m_region = grc;
+  m_heap_dirty = true;
+
+  // walk the merged queries instead, if coalescing
+  GRC* walk = &m_region;
+  if (m_coalesce_gap >= 0) {
+    plan_regions();
+    walk = &m_plan.queries;
+  } else {
+    m_plan.clear();
+  }
 
   // go through and start all the BAMs at the first region
   bool success = true;
-  if (m_region.size()) {
+  if (walk->size()) {
     for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b) {
-      b->second.m_region = &m_region;
+      b->second.m_region = walk;
+      b->second.m_plan = walk == &m_region ? NULL : &m_plan;
       b->second.m_region_idx = 0; // set to the begining
-      success = success && b->second.SetRegion(m_region[0]);
+      success = success && b->second.SetRegion(walk->at(0));
     }
     return success;
   }
@@ -146,12 +299,16 @@ void BamReader::Reset() {
     // dont open same bam twice
     if (m_bams.count(bam))
       return false;
+
+    m_prefetch.halt();
     
     _Bam new_bam(bam);
+    new_bam.m_order = m_bams.size();
     if (!m_cram_reference.empty()) new_bam.m_cram_reference = m_cram_reference;
     new_bam.m_region = &m_region;
     bool success = new_bam.open_BAM_for_reading(pool);
     m_bams.insert(std::pair<std::string, _Bam>(bam, new_bam));
+    m_heap_dirty = true;
     return success;
   }
 
@@ -163,7 +320,44 @@ void BamReader::Reset() {
     return pass;
   }
   
-BamReader::BamReader() {}
+BamReader::BamReader() : m_recycle(false), m_heap_last(NULL), m_heap_dirty(true), m_coalesce_gap(-1) {}
+
+BamReader::BamReader(const BamReader& r) : m_region(r.m_region), m_bams(r.m_bams), m_cram_reference(r.m_cram_reference),
+					   m_recycle(r.m_recycle), m_heap_last(NULL), m_heap_dirty(true), m_prefetch(r.m_prefetch),
+					   m_coalesce_gap(r.m_coalesce_gap), m_plan(r.m_plan), pool(r.pool) {
+  repoint();
+}
+
+BamReader& BamReader::operator=(const BamReader& r) {
+  if (this == &r)
+    return *this;
+  m_prefetch.halt(); // stop reading from our own files first
+  m_region = r.m_region;
+  m_bams = r.m_bams;
+  m_cram_reference = r.m_cram_reference;
+  m_recycle = r.m_recycle;
+  m_prefetch = r.m_prefetch;
+  m_coalesce_gap = r.m_coalesce_gap;
+  m_plan = r.m_plan;
+  pool = r.pool;
+  repoint();
+  return *this;
+}
+
+void BamReader::repoint() {
+
+  // the copied _Bams point to r's regions and plan
+  for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b) {
+    b->second.m_region = b->second.m_plan ? &m_plan.queries : &m_region;
+    if (b->second.m_plan)
+      b->second.m_plan = &m_plan;
+  }
+
+  // and the heap to r's _Bams
+  m_heap.clear();
+  m_heap_last = NULL;
+  m_heap_dirty = true;
+}
 
   std::string BamReader::HeaderConcat() const {
     std::stringstream ss;
@@ -176,6 +370,7 @@ BamReader::BamReader() {}
   bool BamReader::SetThreadPool(ThreadPool p) {
     if (!p.IsOpen())
       return false;
+    m_prefetch.halt();
     pool = p;
     for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b)
       b->second.set_pool(p);
@@ -218,19 +413,254 @@ BamReader::BamReader() {}
     // if BAM header opening failed, return false
     if (!m_hdr.get()) 
       return false;
+
+    // remember where the reads start, so Reset can come back here
+    m_data_start = fp->format.format == 4 ? bgzf_tell(fp->fp.bgzf) : -1;
     
     // everything worked
     return true;
     
   }
 
+  void BamReader::SetRecycleRecords(bool r) {
+    m_recycle = r;
+  }
+
+  void BamReader::SetPrefetch(size_t depth) {
+    m_prefetch.halt();
+    m_prefetch.resize(depth);
+  }
+
+  PrefetchStats BamReader::GetPrefetchStats() const {
+    PrefetchStats s;
+    s.depth = m_prefetch.depth;
+    s.queued = m_prefetch.tail - m_prefetch.head;
+    s.reads = m_prefetch.reads;
+    s.producer_stalls = m_prefetch.producer_stalls;
+    s.consumer_stalls = m_prefetch.consumer_stalls;
+    return s;
+  }
+
+  void BamReader::SetRegionCoalescing(int32_t gap) {
+    m_coalesce_gap = gap;
+  }
+
+  void BamReader::unplan_regions() {
+    m_plan.clear();
+    for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b) {
+      b->second.m_region = &m_region;
+      b->second.m_plan = NULL;
+    }
+  }
+
+  // compressed extent [beg, end] of the BGZF blocks the index says hold
+  // reads for g. Returns the compressed bytes covered by its chunks
+  static uint64_t _chunk_span(hts_idx_t* idx, const GenomicRegion& g, uint64_t& beg, uint64_t& end) {
+    beg = UINT64_MAX;
+    end = 0;
+    SeqPointer<hts_itr_t> itr(sam_itr_queryi(idx, g.chr, g.pos1, g.pos2), hts_itr_delete());
+    if (!itr)
+      return 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < itr->n_off; ++i) {
+      uint64_t u = itr->off[i].u >> 16, v = itr->off[i].v >> 16; // block offsets
+      bytes += v - u;
+      beg = std::min(beg, u);
+      end = std::max(end, v);
+    }
+    return bytes;
+  }
+
+  void BamReader::plan_regions() {
+
+    m_plan.clear();
+
+    std::vector<GenomicRegion> sorted(m_region.begin(), m_region.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    // union of the requested regions. This is what reads are checked against
+    std::vector<GenomicRegion>& targets = m_plan.targets;
+    for (std::vector<GenomicRegion>::const_iterator r = sorted.begin(); r != sorted.end(); ++r) {
+      if (!targets.empty() && targets.back().chr == r->chr && r->pos1 <= targets.back().pos2)
+	targets.back().pos2 = std::max(targets.back().pos2, r->pos2);
+      else
+	targets.push_back(*r);
+    }
+
+    // chunk lists only come from BAM indices. CRAMs are merged on distance alone
+    std::vector<hts_idx_t*> idxs;
+    std::vector<_Bam*> files = open_order();
+    for (std::vector<_Bam*>::iterator f = files.begin(); f != files.end(); ++f) {
+      if ((*f)->fp.get() == NULL || (*f)->fp->format.format != 4)
+	continue;
+      if (!(*f)->idx)
+	(*f)->idx = BamIndexCache::Get((*f)->m_in, (*f)->fp.get());
+      if ((*f)->idx)
+	idxs.push_back((*f)->idx.get());
+    }
+
+    // grow the current query while the next target is close enough. One index
+    // lookup per target and file, which also gives the byte counts for the stats:
+    // each target read on its own, against each query read from its first
+    // block to its last
+    std::vector<GenomicRegion> queries;
+    std::vector<uint64_t> qend(idxs.size(), 0), tbeg(idxs.size()), tend(idxs.size());
+    uint64_t target_bytes = 0, query_bytes = 0;
+    for (std::vector<GenomicRegion>::const_iterator t = targets.begin(); t != targets.end(); ++t) {
+
+      for (size_t f = 0; f < idxs.size(); ++f)
+	target_bytes += _chunk_span(idxs[f], *t, tbeg[f], tend[f]);
+
+      bool merge = false;
+      if (!queries.empty() && queries.back().chr == t->chr) {
+	merge = t->pos1 - queries.back().pos2 <= m_coalesce_gap;
+	for (size_t f = 0; f < idxs.size(); ++f)
+	  merge = merge || tbeg[f] <= qend[f]; // shares a block with the query so far
+      }
+
+      if (merge) {
+	queries.back().pos2 = t->pos2;
+	for (size_t f = 0; f < idxs.size(); ++f) {
+	  if (tbeg[f] > tend[f]) // no reads here
+	    continue;
+	  query_bytes += qend[f] ? (tend[f] > qend[f] ? tend[f] - qend[f] : 0) : tend[f] - tbeg[f];
+	  qend[f] = std::max(qend[f], tend[f]);
+	}
+      } else {
+	queries.push_back(*t);
+	for (size_t f = 0; f < idxs.size(); ++f) {
+	  qend[f] = tbeg[f] > tend[f] ? 0 : tend[f];
+	  if (qend[f])
+	    query_bytes += tend[f] - tbeg[f];
+	}
+      }
+      m_plan.owner.push_back(queries.size() - 1);
+    }
+
+    for (std::vector<GenomicRegion>::const_iterator q = queries.begin(); q != queries.end(); ++q)
+      m_plan.queries.add(*q);
+
+    m_plan.stats.regions = sorted.size();
+    m_plan.stats.queries = queries.size();
+    m_plan.stats.seeks_saved = sorted.size() - queries.size();
+    m_plan.stats.bytes_saved = static_cast<int64_t>(target_bytes) - static_cast<int64_t>(query_bytes);
+  }
+
+  bool _RegionPlan::keep(const bam1_t* b, size_t q) const {
+
+    // find the first target that ends after the read starts
+    int32_t chr = b->core.tid;
+    int64_t beg = b->core.pos, end = bam_endpos(b);
+    size_t lo = 0, hi = targets.size();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (targets[mid].chr < chr || (targets[mid].chr == chr && targets[mid].pos2 <= beg))
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+    // keep if it overlaps that target, and this query is the one that covers it
+    return lo < targets.size() && targets[lo].chr == chr && targets[lo].pos1 < end && owner[lo] == q;
+  }
+
   void BamReader::SetCramReference(const std::string& ref) {
+    m_prefetch.halt();
     m_cram_reference = ref;
     for (_BamMap::iterator b = m_bams.begin(); b != m_bams.end(); ++b)
       b->second.m_cram_reference = ref;
   }
 
 bool BamReader::GetNextRecord(BamRecord& r) {
+  return next_record(r, m_recycle);
+}
+
+bool BamReader::next_record(BamRecord& r, bool recycle) {
+  // reads queued before prefetching was turned off still come first
+  if (m_prefetch.depth || m_prefetch.tail != m_prefetch.head)
+    return prefetch_pop(r, recycle);
+  return get_next_record(r, recycle);
+}
+
+void BamReader::prefetch_loop() {
+
+  _BamPrefetch& p = m_prefetch;
+  while (!p.stop.load(std::memory_order_relaxed)) {
+
+    // wait for the consumer to free up a slot
+    size_t t = p.tail.load(std::memory_order_relaxed);
+    if (t - p.head >= p.depth) {
+      ++p.producer_stalls;
+      p.wait(p.producer_waiting, [&]() { return t - p.head < p.depth; });
+      continue;
+    }
+
+    // decode straight into the slot, reusing its buffer if the consumer let it go
+    bool found = false;
+    try {
+      found = get_next_record(p.ring[t % p.ring.size()], true);
+    } catch (...) {
+      p.error = std::current_exception();
+    }
+    if (!found) {
+      p.done = true;
+      p.wake(p.consumer_waiting);
+      return;
+    }
+    p.tail = t + 1;
+    p.wake(p.consumer_waiting);
+  }
+}
+
+bool BamReader::prefetch_pop(BamRecord& r, bool recycle) {
+
+  _BamPrefetch& p = m_prefetch;
+
+  // start (or restart) the producer
+  if (p.depth && !p.worker.joinable() && !p.done)
+    p.worker = std::thread(&BamReader::prefetch_loop, this);
+
+  size_t h = p.head.load(std::memory_order_relaxed);
+  if (p.tail == h) {
+    ++p.consumer_stalls;
+    p.wait(p.consumer_waiting, [&]() { return p.tail != h || p.done; });
+
+    // producer may have pushed its last read before finishing
+    if (p.tail == h) {
+      if (p.error) {
+	std::exception_ptr e = p.error;
+	p.error = std::exception_ptr();
+	std::rethrow_exception(e);
+      }
+      return false;
+    }
+  }
+
+  // hand over the read. If recycling, the slot gets r's old buffer to decode into
+  BamRecord& slot = p.ring[h % p.ring.size()];
+  if (recycle)
+    r.swap(slot);
+  else
+    r = slot;
+  ++p.reads;
+  p.head = h + 1;
+  p.wake(p.producer_waiting);
+  return true;
+}
+
+size_t BamReader::GetNextBatch(BamRecordVector& batch, size_t n) {
+
+  if (batch.size() < n)
+    batch.resize(n);
+
+  size_t i = 0;
+  for (; i < n; ++i)
+    if (!next_record(batch[i], true))
+      break;
+  return i;
+}
+
+bool BamReader::get_next_record(BamRecord& r, bool recycle) {
 
   // shortcut if we have only a single bam
   if (m_bams.size() == 1) {
@@ -239,9 +669,11 @@ bool BamReader::GetNextRecord(BamRecord& r) {
       return false;
     
     // try and get the next read
-    int32_t status = m_bams.begin()->second.load_read(r);
-    if (status >= 0)
+    int32_t status = m_bams.begin()->second.load_read(recycle);
+    if (status >= 0) {
+      m_bams.begin()->second.take_read(r, recycle);
       return true;
+    }
     if (status == -1) {
       // didn't find anything, clear it
       m_bams.begin()->second.mark_for_closure = true;
@@ -255,70 +687,237 @@ bool BamReader::GetNextRecord(BamRecord& r) {
     return false;
   }
 
-  // loop the files and load the next read
-  // for the one that was emptied last
-  for (_BamMap::iterator bam = m_bams.begin(); bam != m_bams.end(); ++bam) {
-
-    _Bam *tb = &(bam->second);
-
-    // if marked, then don't even try on this BAM
-    if (tb->mark_for_closure)
-      continue;
+  return get_next_merged_record(r, recycle);
+}
 
-    // skip un-opened BAMs
-    if (tb->fp.get() == NULL) 
-      continue;
+bool BamReader::get_next_merged_record(BamRecord& r, bool recycle) {
+
+  // (re)build the heap from scratch. Load a read for every
+  // open BAM that doesn't already have one slotted
+  if (m_heap_dirty) {
+
+    // visit in the order files were opened, so ties resolve the same every run
+    std::vector<_Bam*> ordered = open_order();
+
+    m_heap.clear();
+    m_heap_last = NULL;
+    for (std::vector<_Bam*>::iterator tb = ordered.begin(); tb != ordered.end(); ++tb) {
+
+      // skip un-opened BAMs, or those with no more reads
+      if ((*tb)->mark_for_closure || (*tb)->fp.get() == NULL)
+	continue;
+
+      if ((*tb)->empty) {
+	int32_t status = (*tb)->load_read(recycle);
+	if (status == -1) {
+	  (*tb)->mark_for_closure = true; // no more reads in this BAM
+	  continue;
+	} else if (status < 0) { // error sent back from sam_read1
+	  std::stringstream ss;
+	  ss << "sam_read1 return status: " << status << " file: " << (*tb)->m_in;
+	  throw std::runtime_error(ss.str());
+	}
+      }
+      m_heap.push_back(*tb);
+    }
+    std::make_heap(m_heap.begin(), m_heap.end(), _BamHeapCompare());
+    m_heap_dirty = false;
+  }
 
-    // if next read is not marked as empty, skip to next
-    if (!tb->empty)
-      continue; 
-    
-    // load the next read
-    int32_t status = tb->load_read(r);
+  // refill the slot of the BAM we took a read from last time, and put it
+  // back on the heap. This is the only BAM that needs a new read
+  else if (m_heap_last) {
+    _Bam* tb = m_heap_last;
+    m_heap_last = NULL;
+    int32_t status = tb->load_read(recycle);
     if (status == -1) {
-      // can't load, so mark for closing
-      tb->empty = true;
       tb->mark_for_closure = true; // no more reads in this BAM
-      continue; 
-    } else if (status < 0) { // error sent back from sam_read1
-      // run time error
+    } else if (status < 0) { 
       std::stringstream ss;
-      ss << "sam_read1 return status: " << status << " file: " << bam->first;
+      ss << "sam_read1 return status: " << status << " file: " << tb->m_in;
       throw std::runtime_error(ss.str());
+    } else {
+      m_heap.push_back(tb);
+      std::push_heap(m_heap.begin(), m_heap.end(), _BamHeapCompare());
     }
-    
   }
 
-  // for multiple bams, choose the one to return
-  // sort based on chr and left-most alignment pos. Same as samtools
-  int min_chr = INT_MAX;
-  int min_pos = INT_MAX;
-  _BamMap::iterator hit; 
-  bool found = false; // did we find a valid read
+  if (m_heap.empty())
+    return false;
 
-  for (_BamMap::iterator bam = m_bams.begin(); 
-       bam != m_bams.end(); ++bam) {
+  // take the read with the lowest (chr, pos)
+  std::pop_heap(m_heap.begin(), m_heap.end(), _BamHeapCompare());
+  _Bam* hit = m_heap.back();
+  m_heap.pop_back();
 
-    // dont check if already marked for removal or doesnt need new read
-    if (bam->second.empty || bam->second.mark_for_closure) 
-      continue;
+  hit->take_read(r, recycle); // marks as empty, so we fill this slot again
+  m_heap_last = hit;
 
-    found = true;
-    if (bam->second.next_read.ChrID() < min_chr || // check if read in this BAM is lowest
-	(bam->second.next_read.Position() <  min_pos && bam->second.next_read.ChrID() == min_chr)) {
-      min_pos = bam->second.next_read.Position();
-      min_chr = bam->second.next_read.ChrID();
-      hit = bam; // read is lowest, so mark this BAM as having the hit
+  return true;
+}
+  
+std::vector<_Bam*> BamReader::open_order() {
+  std::vector<_Bam*> ordered(m_bams.size(), NULL);
+  for (_BamMap::iterator bam = m_bams.begin(); bam != m_bams.end(); ++bam)
+    ordered[bam->second.m_order] = &(bam->second);
+  return ordered;
+}
+
+size_t BamReader::ForEachRegionParallel(const GRC& grc, const RegionCallback& func, int nthreads, bool ordered) {
+
+  if (nthreads < 1)
+    throw std::invalid_argument("ForEachRegionParallel: nthreads must be > 0");
+
+  // the prefetch thread may be using the indices we are about to load
+  m_prefetch.halt();
+
+  // load the BAM indices once up front, to be shared by all the workers
+  std::vector<_Bam*> files;
+  std::vector<_Bam*> all = open_order();
+  for (std::vector<_Bam*>::iterator f = all.begin(); f != all.end(); ++f) {
+    if ((*f)->fp.get() == NULL)
+      continue;
+    int fmt = (*f)->fp->format.format;
+    if (fmt != 4 && fmt != 6) // BAM (4) or CRAM (6)
+      throw std::invalid_argument("ForEachRegionParallel requires an indexed BAM or CRAM: " + (*f)->m_in);
+    if (fmt == 4 && !(*f)->idx) {
+      (*f)->idx = BamIndexCache::Get((*f)->m_in, (*f)->fp.get());
+      if (!(*f)->idx)
+	throw std::runtime_error("Failed to load index for " + (*f)->m_in + ". Rebuild samtools index");
     }
+    files.push_back(*f);
   }
 
-  // mark the one we just found as empty
-  if (found) {
-    r = hit->second.next_read; // read is lowest, so assign
-    hit->second.empty = true;  // mark as empty, so we fill this slot again
+  const size_t nregions = grc.size();
+  if (!nregions || files.empty())
+    return 0;
+  if (static_cast<size_t>(nthreads) > nregions)
+    nthreads = nregions;
+
+  // in ordered mode, how many regions the workers may get ahead of the caller
+  const size_t window = 4 * nthreads;
+
+  std::atomic<size_t> next_region(0);
+  std::atomic<size_t> count(0);
+  std::atomic<bool> abort(false);
+  std::exception_ptr error;
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t emitted = 0; // regions handed to func so far (ordered)
+  std::vector<BamRecordVector> results(ordered ? nregions : 0);
+  std::vector<char> finished(ordered ? nregions : 0, 0);
+
+  std::function<void()> work = [&]() {
+    try {
+
+      // private handles on every file. CRAM indices live in the file
+      // handle, so those are loaded by each worker on its first region
+      GRC single;
+      std::vector<_Bam> mine(files.size());
+      for (size_t j = 0; j < files.size(); ++j) {
+	mine[j] = _Bam(files[j]->m_in);
+	mine[j].m_cram_reference = files[j]->m_cram_reference;
+	if (!mine[j].open_BAM_for_reading(pool))
+	  throw std::runtime_error("ForEachRegionParallel: failed to open " + files[j]->m_in);
+	if (files[j]->fp->format.format == 4)
+	  mine[j].idx = files[j]->idx;
+	mine[j].m_region = &single;
+      }
+
+      BamRecord r;
+      for (size_t i = next_region++; i < nregions && !abort; i = next_region++) {
+
+	if (ordered) {
+	  std::unique_lock<std::mutex> lock(mtx);
+	  cv.wait(lock, [&]() { return i < emitted + window || abort; });
+	  if (abort)
+	    break;
+	}
+
+	single.clear();
+	single.add(grc[i]);
+	BamRecordVector out;
+
+	for (size_t j = 0; j < mine.size(); ++j) {
+	  mine[j].reset();
+	  if (!mine[j].SetRegion(grc[i]))
+	    continue;
+
+	  // unordered reads go straight to func, so the buffer can be reused
+	  int32_t status;
+	  while ((status = mine[j].load_read(!ordered)) >= 0) {
+	    if (ordered) {
+	      mine[j].take_read(r, false);
+	      out.push_back(r);
+	    } else {
+	      mine[j].take_read(r, true);
+	      func(r, i);
+	    }
+	    ++count;
+	  }
+	  if (status < -1) {
+	    std::stringstream ss;
+	    ss << "sam_itr_next return status: " << status << " file: " << mine[j].m_in;
+	    throw std::runtime_error(ss.str());
+	  }
+	}
+
+	if (ordered) {
+	  if (mine.size() > 1)
+	    std::stable_sort(out.begin(), out.end(), BamRecordSort::ByReadPosition());
+	  std::lock_guard<std::mutex> lock(mtx);
+	  results[i].swap(out);
+	  finished[i] = 1;
+	  cv.notify_all();
+	}
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!error)
+	error = std::current_exception();
+      abort = true;
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < nthreads; ++t)
+    workers.push_back(std::thread(work));
+
+  // hand the buffered regions to func in order, as they finish
+  if (ordered) {
+    try {
+      for (size_t i = 0; i < nregions; ++i) {
+	BamRecordVector out;
+	{
+	  std::unique_lock<std::mutex> lock(mtx);
+	  cv.wait(lock, [&]() { return finished[i] || abort; });
+	  if (abort)
+	    break;
+	  out.swap(results[i]);
+	}
+	for (BamRecordVector::const_iterator rr = out.begin(); rr != out.end(); ++rr)
+	  func(*rr, i);
+	std::lock_guard<std::mutex> lock(mtx);
+	emitted = i + 1;
+	cv.notify_all();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!error)
+	error = std::current_exception();
+      abort = true;
+      cv.notify_all();
+    }
   }
-  
-  return found;
+
+  for (std::vector<std::thread>::iterator t = workers.begin(); t != workers.end(); ++t)
+    t->join();
+
+  if (error)
+    std::rethrow_exception(error);
+
+  return count;
 }
   
 std::string BamReader::PrintRegions() const {
@@ -330,10 +929,11 @@ std::string BamReader::PrintRegions() const {
 
 }
 
-  int32_t _Bam::load_read(BamRecord& r) {
+  int32_t _Bam::load_read(bool recycle) {
 
-  // allocated the memory
-  bam1_t* b = bam_init1(); 
+  // allocate the memory, or read over the last buffer if no one else holds it
+  bool reuse = recycle && next_read.b && next_read.b.use_count() == 1;
+  bam1_t* b = reuse ? next_read.b.get() : bam_init1(); 
   int32_t valid = -1; // start with EOF return code
 
   if (hts_itr.get() == NULL) {
@@ -345,40 +945,46 @@ std::string BamReader::PrintRegions() const {
       std::cerr << "ended reading on null hts_itr" << std::endl;
 #endif
       //goto endloop;
-      bam_destroy1(b);
+      if (!reuse)
+	bam_destroy1(b);
       return valid;
     }
   } else {
     
-    //changed to sam from hts_itr_next
-    // move to next region of bam
-    valid = sam_itr_next(fp.get(), hts_itr.get(), b);
-  }
-  
-  if (valid < 0) { // read still not found
+    // keep going until we get a read the region plan (if any) wants
     do {
+
+      //changed to sam from hts_itr_next
+      // move to next region of bam
+      valid = sam_itr_next(fp.get(), hts_itr.get(), b);
+  
+      if (valid < 0) { // read still not found
+	do {
       
 #ifdef DEBUG_WALKER
-      std::cerr << "Failed read, trying next region. Moving counter to " << m_region_idx << " of " << m_region.size() << " FP: "  << fp_htsfile << " hts_itr " << std::endl;
+	  std::cerr << "Failed read, trying next region. Moving counter to " << m_region_idx << " of " << m_region.size() << " FP: "  << fp_htsfile << " hts_itr " << std::endl;
 #endif
-      // try next region, return if no others to try
-      ++m_region_idx; // increment to next region
-      if (m_region_idx >= m_region->size()) {
-	bam_destroy1(b);
-	return valid;
-      }
-	//goto endloop;
+	  // try next region, return if no others to try
+	  ++m_region_idx; // increment to next region
+	  if (m_region_idx >= m_region->size()) {
+	    if (!reuse)
+	      bam_destroy1(b);
+	    return valid;
+	  }
+	  //goto endloop;
       
-      // next region exists, try it
-      SetRegion(m_region->at(m_region_idx));
-      valid = sam_itr_next(fp.get(), hts_itr.get(), b);
-    } while (valid <= 0); // keep trying regions until works
+	  // next region exists, try it
+	  SetRegion(m_region->at(m_region_idx));
+	  valid = sam_itr_next(fp.get(), hts_itr.get(), b);
+	} while (valid <= 0); // keep trying regions until works
+      }
+    } while (m_plan && !m_plan->keep(b, m_region_idx));
   }
   
   // if we got here, then we found a read in this BAM
   empty = false;
-  next_read.assign(b); // assign the shared_ptr for the bam1_t
-  r = next_read;
+  if (!reuse)
+    next_read.assign(b); // assign the shared_ptr for the bam1_t
 
   return valid;
 }
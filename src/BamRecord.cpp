@@ -49,7 +49,7 @@ namespace SeqLib {
   }
 
   int32_t BamRecord::PositionEnd() const { 
-    return b ? (b->core.l_qseq > 0 ? bam_endpos(b.get()) : b->core.pos + GetCigar().NumQueryConsumed()) : -1;
+    return b ? (b->core.l_qseq > 0 ? bam_endpos(b.get()) : b->core.pos + GetCigarView().NumQueryConsumed()) : -1;
   }
 
   int32_t BamRecord::PositionEndWithSClips() const {
@@ -60,12 +60,12 @@ namespace SeqLib {
       return ((*cig_last) & 0xF) == BAM_CSOFT_CLIP ? bam_endpos(b.get()) + ((*cig_last) >> 4) :
                                                      bam_endpos(b.get());
     } else {
-      return b->core.pos + GetCigar().NumQueryConsumed();
+      return b->core.pos + GetCigarView().NumQueryConsumed();
     }
   }
 
   int32_t BamRecord::PositionEndMate() const { 
-    return b ? (b->core.mpos + (b->core.l_qseq > 0 ? b->core.l_qseq : GetCigar().NumQueryConsumed())) : -1;
+    return b ? (b->core.mpos + (b->core.l_qseq > 0 ? b->core.l_qseq : GetCigarView().NumQueryConsumed())) : -1;
   }
 
   GenomicRegion BamRecord::AsGenomicRegion() const {
@@ -83,14 +83,20 @@ namespace SeqLib {
   }
 
   std::string BamRecord::Sequence() const {
-    uint8_t * p = bam_get_seq(b);
     std::string out(b->core.l_qseq, 'N');
-    for (int32_t i = 0; i < b->core.l_qseq; ++i) 
-      out[i] = BASES[bam_seqi(p,i)];
+    if (b->core.l_qseq > 0)
+      DecodeBases(bam_get_seq(b), b->core.l_qseq, &out[0]);
     return out;
     
   }
 
+  std::string BamRecord::SequenceReverseComplement() const {
+    std::string out(b->core.l_qseq, 'N');
+    if (b->core.l_qseq > 0)
+      DecodeBasesRevComp(bam_get_seq(b), b->core.l_qseq, &out[0]);
+    return out;
+  }
+
   void BamRecord::SetCigar(const Cigar& c) {
 
     // case where they are equal, just swap them out
@@ -134,6 +140,7 @@ namespace SeqLib {
     // update the sizes
     // >>1 shift is because only 4 bits needed per ATCGN base
     b->l_data = new_size; 
+    b->m_data = b->l_data;
     b->core.n_cigar = c.size();
     
     free(oldd);
@@ -237,6 +244,7 @@ namespace SeqLib {
     int new_size = b->core.l_qname + ((b)->core.n_cigar<<2);// + 1; ///* 0xff seq */ + 1 /* 0xff qual */;
     b->data = (uint8_t*)realloc(b->data, new_size);
     b->l_data = new_size;
+    b->m_data = b->l_data;
     b->core.l_qseq = 0;
   }
 
@@ -383,36 +391,15 @@ namespace SeqLib {
 
   int32_t BamRecord::CountBWASecondaryAlignments() const 
   {
-    int xp_count = 0;
-    
     // xa tag
-    std::string xar_s;
-    GetZTag("XA", xar_s);
-    if (xar_s.length()) {
-      xp_count += std::count(xar_s.begin(), xar_s.end(), ';');
-    }
-
-    return xp_count;
+    return GetTagView("XA").Count(';');
     
   }
 
   int32_t BamRecord::CountBWAChimericAlignments() const 
   {
-    int xp_count = 0;
-    
-    // sa tag (post bwa mem v0.7.5)
-    std::string xar_s;
-    GetZTag("SA", xar_s);
-    if (xar_s.length()) 
-      xp_count += std::count(xar_s.begin(), xar_s.end(), ';');
-
-    // xp tag (pre bwa mem v0.7.5)
-    std::string xpr_s;
-    GetZTag("XP", xpr_s);
-    if (xpr_s.length()) 
-      xp_count += std::count(xpr_s.begin(), xpr_s.end(), ';');
-
-    return xp_count;
+    // sa tag (post bwa mem v0.7.5) plus xp tag (pre bwa mem v0.7.5)
+    return GetTagView("SA").Count(';') + GetTagView("XP").Count(';');
     
   }
 
@@ -718,7 +705,7 @@ namespace SeqLib {
     uint32_t* c2 = bam_get_cigar(r.b);
     
     //uint8_t * cov1 = (uint8_t*)calloc(l > 0 ? l : b->core.l_qseq, sizeof(uint8_t));
-    uint8_t * cov1 = (uint8_t*)calloc(GetCigar().NumQueryConsumed(), sizeof(uint8_t));
+    uint8_t * cov1 = (uint8_t*)calloc(GetCigarView().NumQueryConsumed(), sizeof(uint8_t));
     size_t pos = 0;
     for (int k = 0; k < b->core.n_cigar; ++k) {
       if (bam_cigar_opchr(c[k]) == 'M')  // is match, so track locale
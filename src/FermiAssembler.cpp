@@ -1,15 +1,28 @@
 #include "SeqLib/FermiAssembler.h"
 #include "fermi-lite/fml.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
 #define MAG_MIN_NSR_COEF .1
 
+// smallest block of name storage to allocate at once
+#define FERMI_MIN_BLOCK 65536
+
 namespace SeqLib {
 
-  FermiAssembler::FermiAssembler()  : m_seqs(0), m(0), size(0), n_seqs(0), n_utg(0), m_utgs(0)  {
+  FermiAssembler::FermiAssembler()  : m_seqs(0), m(0), m_block_ptr(0), m_block_left(0),
+				       size(0), n_seqs(0), n_utg(0), m_utgs(0)  {
     fml_opt_init(&opt);
   }
 
   FermiAssembler::FermiAssembler(fml_opt_t &_opt) :
-      m_seqs(0), m(0), size(0), n_seqs(0), n_utg(0), m_utgs(0), opt(_opt)
+      m_seqs(0), m(0), m_block_ptr(0), m_block_left(0),
+      size(0), n_seqs(0), n_utg(0), m_utgs(0), opt(_opt)
   {
   }
 
@@ -38,74 +51,136 @@ namespace SeqLib {
       m_utgs = fml_mag2utg(g, &n_utg);
     }
 
-    void FermiAssembler::AddRead(const BamRecord &r)
+    void FermiAssembler::reserve_seqs(size_t n)
     {
-      AddRead(UnalignedSequence(
-        r.Qname(), r.Sequence(), r.Qualities())); // probably faster way
+      if (n_seqs + n <= m) return;
+      m = m <= 0 ? 32 : m;
+      while (m < n_seqs + n) m *= 2; // if out of mem, double it
+      m_seqs = (fseq1_t *)realloc(m_seqs, m * sizeof(fseq1_t));
     }
 
-    void FermiAssembler::AddRead(const UnalignedSequence &r)
+    void FermiAssembler::reserve_bytes(size_t n)
     {
-      if (r.Seq.empty()) return;
-      if (r.Name.empty()) return;
+      if (n <= m_block_left) return;
+      size_t l = n > FERMI_MIN_BLOCK ? n : FERMI_MIN_BLOCK;
+      m_blocks.push_back((char *)malloc(l));
+      m_block_ptr  = m_blocks.back();
+      m_block_left = l;
+    }
 
-      // dynamically alloc the memory
-      if (m <= n_seqs) m = m <= 0 ? 32 : (m * 2); // if out of mem, double it
-      m_seqs = (fseq1_t *)realloc(m_seqs, m * sizeof(fseq1_t));
+    char *FermiAssembler::alloc_bytes(size_t n)
+    {
+      reserve_bytes(n);
+      char *p = m_block_ptr;
+      m_block_ptr += n;
+      m_block_left -= n;
+      return p;
+    }
 
-      // add the name
-      m_names.push_back(r.Name);
+    void FermiAssembler::add_read(const char *name, size_t l_name,
+                                  const char *seq, const char *qual,
+                                  size_t l_seq)
+    {
+      fseq1_t *s = &m_seqs[n_seqs++];
+      s->l_seq   = l_seq;
+
+      s->seq = (char *)malloc(l_seq + 1);
+      memcpy(s->seq, seq, l_seq);
+      s->seq[l_seq] = '\0';
+
+      s->qual = NULL;
+      if (qual) {
+        s->qual = (char *)malloc(l_seq + 1);
+        memcpy(s->qual, qual, l_seq);
+        s->qual[l_seq] = '\0';
+      }
 
-      // construct the seq
-      fseq1_t *s;
-      s       = &m_seqs[n_seqs];
-      s->seq  = strdup(r.Seq.c_str());
-      s->qual = r.Qual.empty() ? NULL : strdup(r.Qual.c_str());
+      char *nm = alloc_bytes(l_name + 1);
+      memcpy(nm, name, l_name);
+      nm[l_name] = '\0';
+      m_names.push_back(nm);
 
-      s->l_seq = r.Seq.length();
-      size += m_seqs[n_seqs++].l_seq;
+      size += l_seq;
     }
 
-    void FermiAssembler::AddReads(const UnalignedSequenceVector &v)
+    void FermiAssembler::add_bam_read(const bam1_t *b)
     {
-      // alloc the memory
-      m      = n_seqs + v.size();
-      m_seqs = (fseq1_t *)realloc(m_seqs, m * sizeof(fseq1_t));
-
-      for (UnalignedSequenceVector::const_iterator r = v.begin(); r != v.end();
-           ++r) {
-        m_names.push_back(r->Name);
-        fseq1_t *s;
+      size_t l = b->core.l_qseq;
+      if (!l) return;
+
+      fseq1_t *s = &m_seqs[n_seqs++];
+      s->l_seq   = l;
+
+      s->seq = (char *)malloc(l + 1);
+      DecodeBases(bam_get_seq(b), l, s->seq);
+      s->seq[l] = '\0';
+
+      // 0xff means the record has no qualities
+      const uint8_t *q = bam_get_qual(b);
+      s->qual = NULL;
+      if (q[0] != 0xff) {
+        s->qual = (char *)malloc(l + 1);
+        DecodeQualities(q, l, 33, s->qual);
+        s->qual[l] = '\0';
+      }
 
-        s = &m_seqs[n_seqs];
+      char *nm = alloc_bytes(b->core.l_qname);
+      memcpy(nm, bam_get_qname(b), b->core.l_qname);
+      m_names.push_back(nm);
 
-        s->seq  = strdup(r->Seq.c_str());
-        s->qual = strdup(r->Qual.c_str());
+      size += l;
+    }
 
-        s->l_seq = r->Seq.length();
-        size += m_seqs[n_seqs++].l_seq;
-      }
+    void FermiAssembler::AddRead(const BamRecord &r)
+    {
+      reserve_seqs(1);
+      add_bam_read(r.raw());
     }
-    void FermiAssembler::AddReads(const BamRecordVector &brv)
+
+    void FermiAssembler::AddRead(const UnalignedSequence &r)
     {
-      // alloc the memory
-      m_seqs =
-        (fseq1_t *)realloc(m_seqs, (n_seqs + brv.size()) * sizeof(fseq1_t));
+      if (r.Seq.empty()) return;
+      if (r.Name.empty()) return;
 
-      uint64_t size = 0;
-      for (BamRecordVector::const_iterator r = brv.begin(); r != brv.end();
-           ++r) {
-        m_names.push_back(r->Qname());
-        fseq1_t *s;
+      reserve_seqs(1);
+      add_read(r.Name.c_str(), r.Name.length(), r.Seq.c_str(),
+               r.Qual.empty() ? NULL : r.Qual.c_str(), r.Seq.length());
+    }
 
-        s = &m_seqs[n_seqs];
+    void FermiAssembler::AddReads(const UnalignedSequenceVector &v)
+    {
+      // one block for all the names in the batch
+      size_t bytes = 0;
+      for (UnalignedSequenceVector::const_iterator r = v.begin(); r != v.end(); ++r)
+        bytes += r->Name.length() + 1;
+      reserve_seqs(v.size());
+      reserve_bytes(bytes);
+      m_names.reserve(n_seqs + v.size());
+
+      for (UnalignedSequenceVector::const_iterator r = v.begin(); r != v.end(); ++r)
+        add_read(r->Name.c_str(), r->Name.length(), r->Seq.c_str(),
+                 r->Qual.empty() ? NULL : r->Qual.c_str(), r->Seq.length());
+    }
 
-        s->seq  = strdup(r->Sequence().c_str());
-        s->qual = strdup(r->Qualities().c_str());
+    void FermiAssembler::AddReads(const BamRecordVector &brv)
+    {
+      // one block for all the names in the batch
+      size_t bytes = 0;
+      for (BamRecordVector::const_iterator r = brv.begin(); r != brv.end(); ++r)
+        if (r->raw()->core.l_qseq)
+          bytes += r->raw()->core.l_qname; // counts the NUL
+      reserve_seqs(brv.size());
+      reserve_bytes(bytes);
+      m_names.reserve(n_seqs + brv.size());
+
+      for (BamRecordVector::const_iterator r = brv.begin(); r != brv.end(); ++r)
+        add_bam_read(r->raw());
+    }
 
-        s->l_seq = r->Sequence().length();
-        size += m_seqs[n_seqs++].l_seq;
-      }
+    void FermiAssembler::MoveReads(BamRecordVector &brv)
+    {
+      AddReads(brv);
+      BamRecordVector().swap(brv);
     }
 
     void FermiAssembler::ClearContigs()
@@ -117,17 +192,23 @@ namespace SeqLib {
 
     void FermiAssembler::ClearReads()
     {
-      if (!m_seqs) return; // already cleared
-
+      // bases and qualities are one allocation per read, as fml expects
       for (size_t i = 0; i < n_seqs; ++i) {
-        fseq1_t *s = &m_seqs[i];
-        if (s->qual) free(s->qual);
-        s->qual = NULL;
-        if (s->seq) free(s->seq);
-        s->seq = NULL;
+        free(m_seqs[i].seq);
+        free(m_seqs[i].qual);
       }
+      for (std::vector<char *>::iterator i = m_blocks.begin(); i != m_blocks.end(); ++i)
+        free(*i);
+      m_blocks.clear();
+      m_block_ptr  = NULL;
+      m_block_left = 0;
+
       free(m_seqs);
       m_seqs = NULL;
+      m      = 0;
+      n_seqs = 0;
+      size   = 0;
+      m_names.clear();
     }
 
     void FermiAssembler::CorrectReads() { fml_correct(&opt, n_seqs, m_seqs); }
@@ -142,6 +223,76 @@ namespace SeqLib {
       m_utgs = fml_assemble(&opt, n_seqs, m_seqs, &n_utg); // assemble!
     }
 
+    void FermiAssembler::SetThreads(int n)
+    {
+      if (n < 1)
+        throw std::invalid_argument("FermiAssembler::SetThreads - n must be > 0");
+      opt.n_threads = n;
+    }
+
+    // run one assembly per window, claiming windows from a shared counter
+    template <class T>
+    static std::vector<std::vector<std::string> >
+    assemble_many(const fml_opt_t &opt0, const std::vector<T> &windows, int nthreads)
+    {
+      if (nthreads < 1)
+        throw std::invalid_argument("FermiAssembler::AssembleMany - nthreads must be > 0");
+
+      std::vector<std::vector<std::string> > out(windows.size());
+      if (static_cast<size_t>(nthreads) > windows.size())
+        nthreads = windows.size();
+
+      // parallel across windows, not within them
+      fml_opt_t opt = opt0;
+      opt.n_threads = 1;
+
+      std::atomic<size_t> next(0);
+      std::atomic<bool> abort(false);
+      std::mutex mtx;
+      std::exception_ptr error;
+
+      auto work = [&]() {
+        try {
+          for (size_t i = next++; i < windows.size() && !abort; i = next++) {
+            if (windows[i].empty())
+              continue;
+            FermiAssembler f(opt);
+            f.AddReads(windows[i]);
+            f.PerformAssembly();
+            out[i] = f.GetContigs();
+          }
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mtx);
+          if (!error)
+            error = std::current_exception();
+          abort = true;
+        }
+      };
+
+      std::vector<std::thread> workers;
+      for (int t = 1; t < nthreads; ++t)
+        workers.push_back(std::thread(work));
+      work();
+      for (std::vector<std::thread>::iterator t = workers.begin(); t != workers.end(); ++t)
+        t->join();
+
+      if (error)
+        std::rethrow_exception(error);
+      return out;
+    }
+
+    std::vector<std::vector<std::string> >
+    FermiAssembler::AssembleMany(const std::vector<UnalignedSequenceVector> &windows, int nthreads) const
+    {
+      return assemble_many(opt, windows, nthreads);
+    }
+
+    std::vector<std::vector<std::string> >
+    FermiAssembler::AssembleMany(const std::vector<BamRecordVector> &windows, int nthreads) const
+    {
+      return assemble_many(opt, windows, nthreads);
+    }
+
     std::vector<std::string> FermiAssembler::GetContigs() const
     {
       std::vector<std::string> c;
@@ -183,23 +334,71 @@ namespace SeqLib {
     }
   }
 
-void
-SeqLib::FermiAssembler::WriteGFA(std::ostream &out)
+size_t
+SeqLib::FermiAssembler::VisitUnitigs(const UnitigCallback &contig, const EdgeCallback &edge, bool release)
 {
-  int i, j;
-  out << "H\tVN:Z:1.0" << std::endl;
-  for (i = 0; i < n_utg; ++i) {
-    const fml_utg_t *u = m_utgs + i;
-    out << "S\t" << i << "\t";
-    out << u->seq << "\tLN:i:" << u->len << "\tRC:i:" << u->nsr << "\tPD:Z:";
-    out << u->cov << std::endl;
-    for (j = 0; j < u->n_ovlp[0] + u->n_ovlp[1]; ++j) {
-      fml_ovlp_t *o = &u->ovlp[j];
-      if (i < o->id) {
-        out << "L\t" << i << "\t"
-            << "+-"[!o->from] << "\t" << o->id << "\t"
-            << "+-"[o->to] << "\t" << o->len << "M" << std::endl;
+  size_t n = 0;
+  for (int i = 0; i < n_utg; ++i) {
+    fml_utg_t *u = m_utgs + i;
+
+    FermiUnitig fu;
+    fu.id  = i;
+    fu.seq = u->seq;
+    fu.cov = u->cov;
+    fu.len = u->len;
+    fu.nsr = u->nsr;
+    bool keep_going = contig(fu);
+    ++n;
+
+    if (edge) {
+      for (int j = 0; j < u->n_ovlp[0] + u->n_ovlp[1]; ++j) {
+        const fml_ovlp_t *o = &u->ovlp[j];
+        if (i < (int)o->id) {
+          FermiEdge e;
+          e.from     = i;
+          e.from_rev = !o->from;
+          e.to       = o->id;
+          e.to_rev   = o->to;
+          e.len      = o->len;
+          edge(e);
+        }
       }
     }
+
+    // nothing later refers back to this unitig
+    if (release) {
+      free(u->seq);
+      free(u->cov);
+      free(u->ovlp);
+      u->seq  = NULL;
+      u->cov  = NULL;
+      u->ovlp = NULL;
+    }
+
+    if (!keep_going)
+      break;
   }
+
+  if (release)
+    ClearContigs();
+  return n;
+}
+
+void
+SeqLib::FermiAssembler::WriteGFA(std::ostream &out, bool release)
+{
+  out << "H\tVN:Z:1.0" << std::endl;
+  VisitUnitigs(
+    [&out](const FermiUnitig &u) {
+      out << "S\t" << u.id << "\t";
+      out << u.seq << "\tLN:i:" << u.len << "\tRC:i:" << u.nsr << "\tPD:Z:";
+      out << u.cov << std::endl;
+      return true;
+    },
+    [&out](const FermiEdge &e) {
+      out << "L\t" << e.from << "\t"
+          << "+-"[e.from_rev] << "\t" << e.to << "\t"
+          << "+-"[e.to_rev] << "\t" << e.len << "M" << std::endl;
+    },
+    release);
 }
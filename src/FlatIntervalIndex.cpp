@@ -0,0 +1,196 @@
+#include "SeqLib/FlatIntervalIndex.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace SeqLib {
+
+  void FlatIntervalIndex::Add(int32_t chr, int32_t start, int32_t end, int32_t value) {
+    if (chr < 0)
+      return;
+    if (m_keep) { // start over from an attached index
+      clear();
+    }
+    FlatInterval f;
+    f.start = start;
+    f.end = end;
+    f.max = end;
+    f.value = value;
+    m_a.push_back(f);
+    m_chr.push_back(chr);
+    m_indexed = false;
+  }
+
+  void FlatIntervalIndex::clear() {
+    m_a.clear();
+    m_chr.clear();
+    m_blocks.clear();
+    m_indexed = true;
+    m_ext_a = NULL;
+    m_ext_blocks = NULL;
+    m_ext_n = m_ext_nblocks = 0;
+    m_keep.reset();
+  }
+
+  // order of positions in m_a, by chromosome then start
+  struct FlatIntervalOrder {
+
+    FlatIntervalOrder(const std::vector<FlatInterval>& a, const std::vector<int32_t>& c) : m_a(a), m_c(c) {}
+
+    bool operator()(size_t i, size_t j) const {
+      return m_c[i] < m_c[j] || (m_c[i] == m_c[j] && m_a[i].start < m_a[j].start);
+    }
+
+    const std::vector<FlatInterval>& m_a;
+    const std::vector<int32_t>& m_c;
+  };
+
+  // set max for the implicit tree over a[0, n) and return the level of the root.
+  // From cgranges (Heng Li)
+  static int flat_index1(FlatInterval* a, int64_t n) {
+
+    if (n <= 0)
+      return -1;
+
+    // leaves are the even positions
+    int64_t i, last_i = 0;
+    int32_t last = 0;
+    for (i = 0; i < n; i += 2)
+      last_i = i, last = a[i].max = a[i].end;
+
+    int k;
+    for (k = 1; 1LL << k <= n; ++k) {
+      int64_t x = 1LL << (k - 1), i0 = (x << 1) - 1, step = x << 2;
+      for (i = i0; i < n; i += step) {
+	int32_t el = a[i - x].max;
+	int32_t er = i + x < n ? a[i + x].max : last; // right subtree past the end
+	int32_t e = a[i].end;
+	e = e > el ? e : el;
+	e = e > er ? e : er;
+	a[i].max = e;
+      }
+      last_i = last_i >> k & 1 ? last_i - x : last_i + x;
+      if (last_i < n && a[last_i].max > last)
+	last = a[last_i].max;
+    }
+    return k - 1;
+  }
+
+  void FlatIntervalIndex::Index() {
+
+    // stable, so equal starts keep the order they were added in
+    std::vector<size_t> order(m_a.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(), FlatIntervalOrder(m_a, m_chr));
+
+    std::vector<FlatInterval> a(m_a.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      a[i] = m_a[order[i]];
+
+    // one block per chromosome
+    m_blocks.clear();
+    size_t i = 0;
+    while (i < order.size()) {
+      int32_t c = m_chr[order[i]];
+      size_t j = i;
+      while (j < order.size() && m_chr[order[j]] == c)
+	++j;
+      if (m_blocks.size() <= static_cast<size_t>(c))
+	m_blocks.resize(c + 1);
+      Block& b = m_blocks[c];
+      b.off = i;
+      b.n = j - i;
+      b.level = flat_index1(&a[i], b.n);
+      i = j;
+    }
+
+    m_a.swap(a);
+    std::vector<int32_t>().swap(m_chr);
+    m_indexed = true;
+  }
+
+  // serialized as: uint64 number of blocks, uint64 number of intervals, the blocks, the intervals
+  void FlatIntervalIndex::Serialize(std::vector<char>& out) const {
+
+    const Block* blocks = m_keep ? m_ext_blocks : (m_blocks.empty() ? NULL : &m_blocks[0]);
+    const FlatInterval* a = m_keep ? m_ext_a : (m_a.empty() ? NULL : &m_a[0]);
+    uint64_t nb = m_keep ? m_ext_nblocks : m_blocks.size();
+    uint64_t n = size();
+
+    size_t o = out.size();
+    out.resize(o + 16 + nb * sizeof(Block) + n * sizeof(FlatInterval));
+    memcpy(&out[o], &nb, 8);
+    memcpy(&out[o + 8], &n, 8);
+    if (nb)
+      memcpy(&out[o + 16], blocks, nb * sizeof(Block));
+    if (n)
+      memcpy(&out[o + 16 + nb * sizeof(Block)], a, n * sizeof(FlatInterval));
+  }
+
+  size_t FlatIntervalIndex::Attach(const char* p, size_t len, SeqPointer<void> keep) {
+
+    if (len < 16)
+      return 0;
+    uint64_t nb, n;
+    memcpy(&nb, p, 8);
+    memcpy(&n, p + 8, 8);
+    if (nb > len / sizeof(Block) || n > len / sizeof(FlatInterval) ||
+	16 + nb * sizeof(Block) + n * sizeof(FlatInterval) > len)
+      return 0;
+
+    // every block has to be inside the intervals
+    const Block* blocks = reinterpret_cast<const Block*>(p + 16);
+    for (uint64_t i = 0; i < nb; ++i)
+      if (blocks[i].level >= 0 && (blocks[i].off > n || blocks[i].n > n - blocks[i].off || blocks[i].level > 62))
+	return 0;
+
+    clear();
+    m_ext_blocks = blocks;
+    m_ext_a = reinterpret_cast<const FlatInterval*>(p + 16 + nb * sizeof(Block));
+    m_ext_nblocks = nb;
+    m_ext_n = n;
+    m_keep = keep;
+    return 16 + nb * sizeof(Block) + n * sizeof(FlatInterval);
+  }
+
+  // collects overlaps for FindOverlapping
+  struct FlatCollect {
+    FlatCollect(std::vector<FlatInterval>& o) : out(o) {}
+    bool operator()(const FlatInterval& f) { out.push_back(f); return true; }
+    std::vector<FlatInterval>& out;
+  };
+
+  // counts overlaps for CountOverlapping
+  struct FlatCount {
+    FlatCount(size_t& c) : count(c) {}
+    bool operator()(const FlatInterval&) { ++count; return true; }
+    size_t& count;
+  };
+
+  // stops at the first overlap for AnyOverlapping
+  struct FlatAny {
+    FlatAny(bool& h) : hit(h) {}
+    bool operator()(const FlatInterval&) { hit = true; return false; }
+    bool& hit;
+  };
+
+  size_t FlatIntervalIndex::FindOverlapping(int32_t chr, int32_t start, int32_t end, std::vector<FlatInterval>& out) const {
+    size_t n = out.size();
+    visit(chr, start, end, FlatCollect(out));
+    return out.size() - n;
+  }
+
+  size_t FlatIntervalIndex::CountOverlapping(int32_t chr, int32_t start, int32_t end) const {
+    size_t count = 0;
+    visit(chr, start, end, FlatCount(count));
+    return count;
+  }
+
+  bool FlatIntervalIndex::AnyOverlapping(int32_t chr, int32_t start, int32_t end) const {
+    bool hit = false;
+    visit(chr, start, end, FlatAny(hit));
+    return hit;
+  }
+
+}
@@ -1,6 +1,7 @@
 #include "SeqLib/ReadFilter.h"
 
 #include <cassert>
+#include <algorithm>
 #include "htslib/htslib/khash.h"
 
 //#define QNAME "D0EN0ACXX111207:7:2306:6903:136511"
@@ -103,37 +104,276 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
     return true;
 
   DEBUGIV(r, "starting RFC isValid with non-empty regions")
-  
-    bool is_valid = false;
-    bool exclude_hit = false;
 
-    for (std::vector<ReadFilter>::iterator it = m_regions.begin(); it != m_regions.end(); ++it) {
-      
-      // only check read validity if it overlaps region
-      if (!it->isReadOverlappingRegion(r)) 
-	continue;
+  if (!m_compiled)
+    Compile();
+
+  // excluders come first, so the first filter the read passes decides it.
+  // The rest are still run, so the filter and rule counters count every
+  // filter the read passes
+  int decision = 0; // 1 include, -1 exclude, 0 no filter passed
+  for (std::vector<_CompiledFilter>::const_iterator it = m_program.begin(); it != m_program.end(); ++it) {
     
-    // check the region with all its rules
-      if (it->isValid(r)) {
-     
-      // if this is excluder region, exclude read
-      if (it->excluder)
-	exclude_hit = true;
-      
-      // in case we do fall through, track that we passed here
-      is_valid = true;
+    // only check read validity if it overlaps region
+    if (!it->overlaps(r))
+      continue;
+    
+    // check the region with all its rules. Empty default is pass
+    ReadFilter& rf = m_regions[it->filter];
+    bool pass = it->rules.empty();
+    for (std::vector<_CompiledRule>::const_iterator rr = it->rules.begin(); rr != it->rules.end(); ++rr) {
+      AbstractRule& ar = rf.m_abstract_rules[rr->rule];
+      if (rr->isValid(r, ar)) {
+	++ar.m_count; //update this rule counter
+	++rf.m_count;
+	pass = true;
+	break; // it is includable in at least one. 
+      }
+    }
+
+    // if this is excluder region, exclude read
+    if (pass && !decision)
+      decision = it->excluder ? -1 : 1;
+  }
 
+  if (decision > 0) {
+    ++m_count;
+    return true;
+  }
+  return false;
+}
+
+  void ReadFilterCollection::Compile() {
+    m_program.clear();
+    m_program.reserve(m_regions.size());
+    for (size_t i = 0; i < m_regions.size(); ++i)
+      if (m_regions[i].excluder)
+	m_program.push_back(_CompiledFilter(m_regions[i], i));
+    for (size_t i = 0; i < m_regions.size(); ++i)
+      if (!m_regions[i].excluder)
+	m_program.push_back(_CompiledFilter(m_regions[i], i));
+    m_compiled = true;
+  }
+
+  _CompiledFilter::_CompiledFilter(const ReadFilter& rf, size_t idx) 
+    : filter(idx), excluder(rf.excluder), mate(rf.m_applies_to_mate), whole_genome(rf.m_grv.size() == 0) {
+
+    for (std::vector<GenomicRegion>::const_iterator g = rf.m_grv.begin(); g != rf.m_grv.end(); ++g) {
+      if (g->chr < 0)
+	continue;
+      if ((size_t)g->chr >= regions.size())
+	regions.resize(g->chr + 1);
+      regions[g->chr].push_back(std::pair<int32_t, int32_t>(g->pos1, g->pos2));
     }
+
+    // sort and merge, so that the ends are sorted too
+    for (size_t c = 0; c < regions.size(); ++c) {
+      std::vector<std::pair<int32_t, int32_t> >& v = regions[c];
+      std::sort(v.begin(), v.end());
+      size_t k = 0;
+      for (size_t i = 0; i < v.size(); ++i) {
+	if (k && v[i].first <= v[k-1].second)
+	  v[k-1].second = std::max(v[k-1].second, v[i].second);
+	else
+	  v[k++] = v[i];
+      }
+      v.resize(k);
+    }
+
+    for (size_t i = 0; i < rf.m_abstract_rules.size(); ++i)
+      rules.push_back(_CompiledRule(rf.m_abstract_rules[i], i));
   }
 
-    // found a hit in a rule
-    if (is_valid && !exclude_hit) {
-      ++m_count;
+  bool _CompiledFilter::overlaps(int32_t chr, int32_t pos1, int32_t pos2) const {
+    if (chr < 0 || (size_t)chr >= regions.size())
+      return false;
+    const std::vector<std::pair<int32_t, int32_t> >& v = regions[chr];
+    // first interval ending at or after pos1
+    size_t lo = 0, hi = v.size();
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (v[mid].second < pos1)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    return lo < v.size() && v[lo].first <= pos2;
+  }
+
+  bool _CompiledFilter::overlaps(const BamRecord& r) const {
+    if (whole_genome)
+      return true;
+    if (overlaps(r.ChrID(), r.Position(), r.PositionEnd()))
       return true;
+    return mate && overlaps(r.MateChrID(), r.MatePosition(), r.MatePosition() + r.Length());
+  }
+
+  void _CompiledRule::require(uint32_t bit, bool on) {
+    if ((flag_mask & bit) && ((flag_val & bit) != 0) != on)
+      never = true;
+    flag_mask |= bit;
+    if (on)
+      flag_val |= bit;
+  }
+
+  _CompiledRule::_CompiledRule(const AbstractRule& ar, size_t idx) 
+    : rule(idx), need(0), never(false), flag_mask(0), flag_val(0), all_off(0), any_on(0), any_off(0) {
+
+    if (ar.isEvery())
+      return;
+
+    const FlagRule& f = ar.fr;
+    if (!f.isEvery()) {
+
+      // all bits of allflag on
+      for (uint32_t bit = 1; bit && bit <= f.m_all_on_flag; bit <<= 1)
+	if (f.m_all_on_flag & bit)
+	  require(bit, true);
+      all_off = f.m_all_off_flag;
+      any_on = f.m_any_on_flag;
+      any_off = f.m_any_off_flag;
+
+      // named flags that are a single bit
+      if (!f.dup.isNA())         require(BAM_FDUP, f.dup.isOn());
+      if (!f.supp.isNA())        require(BAM_FSECONDARY, f.supp.isOn());
+      if (!f.qcfail.isNA())      require(BAM_FQCFAIL, f.qcfail.isOn());
+      if (!f.mapped.isNA())      require(BAM_FUNMAP, f.mapped.isOff());
+      if (!f.mate_mapped.isNA()) require(BAM_FMUNMAP, f.mate_mapped.isOff());
+
+      hardclip = f.hardclip;
+      if (!hardclip.isNA())
+	need |= NEED_HARDCLIP;
+
+      // orientation checks need the pair to be mapped
+      ff = f.ff; fr = f.fr; rf = f.rf; rr = f.rr; ic = f.ic;
+      if (!ff.isNA() || !fr.isNA() || !rf.isNA() || !rr.isNA() || !ic.isNA()) {
+	require(BAM_FPAIRED, true);
+	require(BAM_FUNMAP, false);
+	require(BAM_FMUNMAP, false);
+	need |= NEED_ORIENT;
+      }
     }
-    
-    return false;
-}
+
+    mapq = ar.mapq;     if (!mapq.isEvery())   need |= NEED_MAPQ;
+    isize = ar.isize;   if (!isize.isEvery())  need |= NEED_ISIZE;
+    ins = ar.ins;       
+    del = ar.del;       if (!ins.isEvery() || !del.isEvery()) need |= NEED_INDEL;
+    nm = ar.nm;         if (!nm.isEvery())     need |= NEED_NM;
+    xp = ar.xp;         if (!xp.isEvery())     need |= NEED_XP;
+    len = ar.len;       if (!len.isEvery())    need |= NEED_LEN;
+    clip = ar.clip;     if (!clip.isEvery())   need |= NEED_CLIP;
+    nbases = ar.nbases; if (!nbases.isEvery()) need |= NEED_NBASES;
+
+    if (ar.subsam_frac < 1)      need |= NEED_SUBSAMPLE;
+    if (!ar.read_group.empty())  need |= NEED_RG;
+#ifdef HAVE_C11
+    if (ar.aho.count)            need |= NEED_MOTIF;
+#endif
+  }
+
+  // cheapest checks first. All are pure, so the order does not change the result
+  bool _CompiledRule::isValid(const BamRecord& r, const AbstractRule& ar) const {
+
+    if (never)
+      return false;
+
+    const uint32_t flag = r.AlignmentFlag();
+    if (((flag & flag_mask) != flag_val) | ((flag & any_off) != 0) | 
+	(any_on && !(flag & any_on)) | (all_off && (flag & all_off) == all_off))
+      return false;
+
+    if (!need)
+      return true;
+
+    if ((need & NEED_MAPQ) && !mapq.isValid(r.MapQuality()))
+      return false;
+
+    if ((need & NEED_SUBSAMPLE) && !ar.isValidSubsample(r))
+      return false;
+
+    if ((need & NEED_ISIZE) && !isize.isValid(r.FullInsertSize()))
+      return false;
+
+    if ((need & NEED_ORIENT)) {
+      // pair mapped is already in the flag mask
+      bool bic = r.Interchromosomal();
+      if (!bic) { 
+	int PO = r.PairOrientation();
+	if ( (PO == FRORIENTATION && fr.isOff()) || (PO != FRORIENTATION && fr.isOn())) 
+	  return false;
+	if ( (PO == RRORIENTATION && rr.isOff()) || (PO != RRORIENTATION && rr.isOn())) 
+	  return false;
+	if ( (PO == RFORIENTATION && rf.isOff()) || (PO != RFORIENTATION && rf.isOn())) 
+	  return false;
+	if ( (PO == FFORIENTATION && ff.isOff()) || (PO != FFORIENTATION && ff.isOn())) 
+	  return false;
+      }
+      if ( (bic && ic.isOff()) || (!bic && ic.isOn()))
+	return false;
+    }
+
+    if (need & (NEED_INDEL | NEED_HARDCLIP)) {
+      CigarView cv = r.GetCigarView();
+      int32_t max_ins = 0, max_del = 0, hclip = 0;
+      for (CigarView::const_iterator c = cv.begin(); c != cv.end(); ++c) {
+	CigarField cf = *c;
+	if (cf.Type() == 'I')
+	  max_ins = std::max(max_ins, (int32_t)cf.Length());
+	else if (cf.Type() == 'D')
+	  max_del = std::max(max_del, (int32_t)cf.Length());
+	else if (cf.Type() == 'H')
+	  hclip += cf.Length();
+      }
+      if (!ins.isValid(max_ins) || !del.isValid(max_del))
+	return false;
+      if ((need & NEED_HARDCLIP) && cv.size() > 1 &&
+	  ( (hclip > 0 && hardclip.isOff()) || (hclip == 0 && hardclip.isOn()) ))
+	return false;
+    }
+
+    if ((need & NEED_RG) && !ar.isValidReadGroup(r))
+      return false;
+
+    if ((need & NEED_NM) && !nm.isValid(r.GetTagView("NM").AsInt()))
+      return false;
+
+    if ((need & NEED_XP) && !xp.isValid(r.CountBWASecondaryAlignments()))
+      return false;
+
+    // length of the sequence as trimmed (see QualitySequence)
+    if (need & (NEED_LEN | NEED_CLIP)) {
+      TagView gv = r.GetTagView("GV");
+      int32_t tlen = gv.size() ? gv.size() : r.Length();
+      if (!len.isValid(tlen))
+	return false;
+      if ((need & NEED_CLIP) && !clip.isValid(r.NumClip() - (r.Length() - tlen)))
+	return false;
+    }
+
+    if ((need & NEED_NBASES) && !nbases.isValid(r.CountNBases()))
+      return false;
+
+#ifdef HAVE_C11
+    // only the motif search needs the decoded sequence
+    if ((need & NEED_MOTIF) && !ar.aho.QueryText(r.QualitySequence()))
+      return false;
+#endif
+
+    return true;
+  }
+
+  size_t ReadFilterCollection::FilterBatch(BamRecordVector& batch, size_t n) {
+
+    n = std::min(n, batch.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) 
+      if (isValid(batch[i])) {
+	if (kept != i)
+	  batch[kept].swap(batch[i]);
+	++kept;
+      }
+    return kept;
+  }
 
   void ReadFilter::AddRule(const AbstractRule& ar) {
     m_abstract_rules.push_back(ar);
@@ -142,7 +382,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
   // constructor to make a ReadFilterCollection from a rules file.
   // This will reduce each individual BED file and make the 
   // GenomicIntervalTreeMap
-  ReadFilterCollection::ReadFilterCollection(const std::string& script, const BamHeader& hdr) : m_count(0), m_count_seen(0) {
+  ReadFilterCollection::ReadFilterCollection(const std::string& script, const BamHeader& hdr) : m_count(0), m_count_seen(0), m_compiled(false) {
 
     // if is a file, read into a string
     std::ifstream iscript(script.c_str());
@@ -282,6 +522,7 @@ bool ReadFilter::isReadOverlappingRegion(const BamRecord &r) const {
 	mr.m_abstract_rules.push_back(rule_all);
 	mr.id = "WG_includer";
 	m_regions.push_back(mr);
+	m_compiled = false;
       }
 
     }
@@ -333,6 +574,7 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
   void ReadFilterCollection::AddReadFilter(const ReadFilter& rf) {
     m_regions.push_back(rf);
+    m_compiled = false;
   }
 
   ReadFilter::~ReadFilter() {}
@@ -453,6 +695,23 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
   }
 
 
+  bool AbstractRule::isValidSubsample(const BamRecord &r) const {
+    uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(r.QnameChar()) ^ subsam_seed);
+    return (double)(k&0xffffff) / 0x1000000 < subsam_frac;
+  }
+
+  // Same as ParseReadGroup, but without making strings
+  bool AbstractRule::isValidReadGroup(const BamRecord &r) const {
+    TagView rg = r.GetTagView("RG");
+    if (rg.IsString()) 
+      return !rg.size() || rg == read_group;
+    const char* qn = r.QnameChar();
+    const char* colon = strchr(qn, ':');
+    if (!colon) 
+      return read_group == "NA";
+    return colon == qn || read_group.compare(0, std::string::npos, qn, colon - qn) == 0;
+  }
+
     // main function for determining if a read is valid
     bool AbstractRule::isValid(const BamRecord &r) {
     
@@ -463,11 +722,8 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
       return true;
     
     // check if it is a subsample
-    if (subsam_frac < 1) {
-      uint32_t k = __ac_Wang_hash(__ac_X31_hash_string(r.QnameChar()) ^ subsam_seed);
-      if ((double)(k&0xffffff) / 0x1000000 >= subsam_frac) 
-	return false;
-    }
+    if (subsam_frac < 1 && !isValidSubsample(r))
+      return false;
     
     // check if is discordant
     bool isize_pass = isize.isValid(r.FullInsertSize());
@@ -478,12 +734,9 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
       return false;
     }
     
-    // check for valid read name 
-    if (!read_group.empty()) {
-      std::string RG = r.ParseReadGroup();
-      if (!RG.empty() && RG != read_group)
-	return false;
-    }
+    // check for valid read group
+    if (!read_group.empty() && !isValidReadGroup(r))
+      return false;
 
     // check for valid mapping quality
     if (!mapq.isEvery())
@@ -508,13 +761,14 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
     DEBUGIV(r, "cigar pass")
       
-    // get the sequence as trimmed
-    std::string tseq = r.QualitySequence(); //AddZTag("GV", r.Sequence().substr(startpoint, new_len));
+    // length of the sequence as trimmed (see QualitySequence)
+    TagView gv = r.GetTagView("GV"); //AddZTag("GV", r.Sequence().substr(startpoint, new_len));
+    size_t tlen = gv.size() ? gv.size() : r.Length();
     
 #ifdef HAVE_C11
-    // check for aho corasick motif match
+    // check for aho corasick motif match. Only this needs the actual sequence
     if (aho.count) {
-      if (!aho.QueryText(tseq))
+      if (!aho.QueryText(r.QualitySequence()))
       return false;
       DEBUGIV(r, "aho pass")
     }
@@ -522,8 +776,7 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
 
     // check for valid NM
     if (!nm.isEvery()) {
-      int32_t nm_val = 0;
-      r.GetIntTag("NM", nm_val);
+      int32_t nm_val = r.GetTagView("NM").AsInt();
       if (!nm.isValid(nm_val))
 	return false;
       DEBUGIV(r, "NM pass")
@@ -538,13 +791,13 @@ std::ostream& operator<<(std::ostream &out, const ReadFilter &mr) {
     }
 
     // check for valid length
-    if (!len.isValid(tseq.length())) {
+    if (!len.isValid(tlen)) {
       return false;
       DEBUGIV(r, "len pass")
     }
 
     // check for valid clip
-    int new_clipnum = r.NumClip() - (r.Length() - tseq.length()); // get clips, minus amount trimmed off
+    int new_clipnum = r.NumClip() - (r.Length() - tlen); // get clips, minus amount trimmed off
     if (!clip.isValid(new_clipnum)) {
       return false;
       DEBUGIV(r, "clip pass with clip size " + tostring(new_clipnum))
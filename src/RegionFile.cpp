@@ -0,0 +1,353 @@
+#include "SeqLib/GenomicRegionCollection.h"
+
+#include <cstring>
+#include <climits>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+
+// bytes decompressed per pass of ReadRegionFile
+#define REGION_CHUNK (16 * 1024 * 1024)
+
+// region index file: magic, then uint64 file length, number of contigs,
+// dictionary bytes, number of regions, index bytes. Then the dictionary
+// (uint32 length, uint32 name length, name; padded to 8 bytes), the
+// RegionIndexRecords and the serialized FlatIntervalIndex
+#define REGION_INDEX_MAGIC "SLGRIDX1"
+#define REGION_INDEX_HEADER 48
+
+namespace SeqLib {
+
+  // chromosome names to IDs, resolved as the GenomicRegion string constructor
+  // does, but only once per distinct name
+  class _ChrCache {
+
+  public:
+
+    _ChrCache(const BamHeader& h) : m_hdr(&h), m_last_id(-1) {}
+
+    int get(const char* s, size_t l) {
+
+      // consecutive lines are mostly on the same chromosome
+      if (l == m_last.length() && memcmp(s, m_last.data(), l) == 0)
+	return m_last_id;
+
+      std::string name(s, l);
+      int id;
+      SeqHashMap<std::string, int>::const_iterator ff = m_cache.find(name);
+      if (ff != m_cache.end()) {
+	id = ff->second;
+      } else {
+	id = GenomicRegion(name, "0", "0", *m_hdr).chr; // may throw
+	m_cache[name] = id;
+      }
+      m_last.swap(name);
+      m_last_id = id;
+      return id;
+    }
+
+  private:
+
+    const BamHeader* m_hdr;
+    SeqHashMap<std::string, int> m_cache;
+    std::string m_last;
+    int m_last_id;
+  };
+
+  static inline bool region_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  // split up to n whitespace delimited fields from [p, e). Returns the number found
+  static int region_fields(const char* p, const char* e, int n, const char** fb, const char** fe) {
+    int k = 0;
+    while (k < n) {
+      while (p < e && region_space(*p))
+	++p;
+      if (p == e)
+	break;
+      fb[k] = p;
+      while (p < e && !region_space(*p))
+	++p;
+      fe[k++] = p;
+    }
+    return k;
+  }
+
+  // leading integer of [p, e), with the same errors as std::stoi
+  static int32_t region_pos(const char* p, const char* e) {
+    bool neg = false;
+    if (p < e && (*p == '-' || *p == '+'))
+      neg = *p++ == '-';
+    if (p == e || *p < '0' || *p > '9')
+      throw std::invalid_argument("stoi");
+    int64_t v = 0;
+    for (; p < e && *p >= '0' && *p <= '9'; ++p) {
+      v = v * 10 + (*p - '0');
+      if (v > (int64_t)INT_MAX + 1)
+	throw std::out_of_range("stoi");
+    }
+    v = neg ? -v : v;
+    if (v > INT_MAX)
+      throw std::out_of_range("stoi");
+    return v;
+  }
+
+  // parse the whole lines in [p, e)
+  static void region_lines(const char* p, const char* e, bool vcf, _ChrCache& cc,
+			   std::vector<GenomicRegion>& out, std::mutex& log) {
+
+    const char* fb[3];
+    const char* fe[3];
+
+    while (p < e) {
+      const char* le = static_cast<const char*>(memchr(p, '\n', e - p));
+      if (!le)
+	le = e;
+      const char* line = p;
+      p = le + 1;
+
+      GenomicRegion gr;
+      if (vcf) {
+	if (line == le || *line == '#')
+	  continue;
+	try {
+	  if (region_fields(line, le, 2, fb, fe) < 2)
+	    throw std::invalid_argument("missing field");
+	  gr.chr = cc.get(fb[0], fe[0] - fb[0]);
+	  gr.pos1 = gr.pos2 = region_pos(fb[1], fe[1]);
+	} catch (...) {
+	  std::lock_guard<std::mutex> lock(log);
+	  int n = region_fields(line, le, 2, fb, fe);
+	  std::cerr << "...Could not parse pos: " << (n == 2 ? std::string(fb[1], fe[1]) : std::string())
+		    << std::endl << std::endl << "...on line " << std::string(line, le) << std::endl;
+	  continue;
+	}
+      } else {
+	if (memchr(line, '#', le - line))
+	  continue;
+	int n = region_fields(line, le, 3, fb, fe);
+	if (n == 0)
+	  continue;
+	size_t l0 = fe[0] - fb[0];
+	if ((l0 == 5 && !memcmp(fb[0], "track", 5)) || (l0 == 7 && !memcmp(fb[0], "browser", 7)))
+	  continue;
+	if (n < 3)
+	  throw std::invalid_argument("ReadBED - fewer than 3 columns on line: " + std::string(line, le));
+	gr.chr = cc.get(fb[0], l0);
+	gr.pos1 = region_pos(fb[1], fe[1]);
+	gr.pos2 = region_pos(fb[2], fe[2]);
+      }
+
+      if (gr.chr >= 0)
+	out.push_back(gr);
+    }
+  }
+
+  bool ReadRegionFile(const std::string& file, const BamHeader& hdr, bool vcf, int nthreads, std::vector<GenomicRegion>& out) {
+
+    if (nthreads < 1)
+      throw std::invalid_argument("ReadRegionFile - nthreads must be > 0");
+
+    // reads plain, gzip and bgzip files. Only bgzip decompresses in parallel
+    BGZF* fp = file.empty() ? NULL : bgzf_open(file.c_str(), "r");
+    if (!fp) {
+      std::cerr << (vcf ? "VCF" : "BED") << " file not readable: " << file << std::endl;
+      return false;
+    }
+    if (nthreads > 1)
+      bgzf_mt(fp, nthreads, 256);
+
+    std::vector<char> buf;
+    size_t have = 0;
+    bool eof = false;
+
+    std::vector<std::vector<GenomicRegion> > parts(nthreads);
+    std::vector<_ChrCache> caches(nthreads, _ChrCache(hdr));
+    std::mutex log;
+
+    while (!eof || have) {
+
+      if (!eof) {
+	if (buf.size() < have + REGION_CHUNK)
+	  buf.resize(have + REGION_CHUNK);
+	ssize_t n = bgzf_read(fp, &buf[have], REGION_CHUNK);
+	if (n < 0) {
+	  std::cerr << "Error reading " << file << std::endl;
+	  bgzf_close(fp);
+	  return false;
+	}
+	eof = n == 0;
+	have += n;
+      }
+
+      // only whole lines, unless there is nothing more to come
+      size_t end = have;
+      if (!eof) {
+	while (end > 0 && buf[end - 1] != '\n')
+	  --end;
+	if (end == 0)
+	  continue; // line longer than the buffer, so read more
+      }
+      if (end == 0)
+	break;
+
+      // one piece per thread, split on line ends
+      const char* b = &buf[0];
+      std::vector<size_t> cut(nthreads + 1, end);
+      cut[0] = 0;
+      for (int t = 1; t < nthreads; ++t) {
+	size_t c = std::max(cut[t - 1], end / nthreads * t);
+	const char* nl = c < end ? static_cast<const char*>(memchr(b + c, '\n', end - c)) : NULL;
+	cut[t] = nl ? nl - b + 1 : end;
+      }
+
+      std::exception_ptr error;
+      auto work = [&](int t) {
+	try {
+	  region_lines(b + cut[t], b + cut[t + 1], vcf, caches[t], parts[t], log);
+	} catch (...) {
+	  std::lock_guard<std::mutex> lock(log);
+	  if (!error)
+	    error = std::current_exception();
+	}
+      };
+      std::vector<std::thread> workers;
+      for (int t = 1; t < nthreads; ++t)
+	if (cut[t] < cut[t + 1])
+	  workers.push_back(std::thread(work, t));
+      work(0);
+      for (std::vector<std::thread>::iterator w = workers.begin(); w != workers.end(); ++w)
+	w->join();
+      if (error) {
+	bgzf_close(fp);
+	std::rethrow_exception(error);
+      }
+
+      // keep file order
+      for (int t = 0; t < nthreads; ++t) {
+	out.insert(out.end(), parts[t].begin(), parts[t].end());
+	parts[t].clear();
+      }
+
+      // carry the partial last line over
+      memmove(&buf[0], &buf[end], have - end);
+      have -= end;
+    }
+
+    bgzf_close(fp);
+    return true;
+  }
+
+  bool WriteRegionIndexFile(const std::string& file, const BamHeader& hdr,
+			    const std::vector<RegionIndexRecord>& regions, const FlatIntervalIndex& fi) {
+
+    std::vector<char> buf(REGION_INDEX_HEADER);
+    memcpy(&buf[0], REGION_INDEX_MAGIC, 8);
+
+    // contig dictionary
+    HeaderSequenceVector hsv;
+    if (!hdr.isEmpty())
+      hsv = hdr.GetHeaderSequenceVector();
+    for (HeaderSequenceVector::const_iterator i = hsv.begin(); i != hsv.end(); ++i) {
+      uint32_t l[2] = { i->Length, (uint32_t)i->Name.length() };
+      size_t o = buf.size();
+      buf.resize(o + sizeof(l) + l[1]);
+      memcpy(&buf[o], l, sizeof(l));
+      memcpy(&buf[o + sizeof(l)], i->Name.data(), l[1]);
+    }
+    buf.resize((buf.size() + 7) / 8 * 8, 0);
+    uint64_t l_dict = buf.size() - REGION_INDEX_HEADER;
+
+    size_t o = buf.size();
+    buf.resize(o + regions.size() * sizeof(RegionIndexRecord));
+    if (regions.size())
+      memcpy(&buf[o], &regions[0], regions.size() * sizeof(RegionIndexRecord));
+
+    o = buf.size();
+    fi.Serialize(buf);
+
+    uint64_t h[5] = { buf.size(), hsv.size(), l_dict, regions.size(), buf.size() - o };
+    memcpy(&buf[8], h, sizeof(h));
+
+    FILE* fp = fopen(file.c_str(), "wb");
+    if (!fp) {
+      std::cerr << "Could not open region index for writing: " << file << std::endl;
+      return false;
+    }
+    bool ok = fwrite(&buf[0], 1, buf.size(), fp) == buf.size();
+    ok = (fclose(fp) == 0) && ok;
+    return ok;
+  }
+
+  bool MapRegionIndexFile(const std::string& file, const BamHeader& hdr,
+			  const RegionIndexRecord** regions, size_t* n, FlatIntervalIndex& fi) {
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < REGION_INDEX_HEADER) {
+      close(fd);
+      return false;
+    }
+
+    size_t len = st.st_size;
+    void* map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED)
+      return false;
+    // unmapped when the last FlatIntervalIndex using it goes
+    SeqPointer<void> keep(map, [len](void* p) { munmap(p, len); });
+
+    // check the header, and that every section is inside the file
+    const char* m = static_cast<const char*>(map);
+    uint64_t h[5];
+    memcpy(h, m + 8, sizeof(h));
+    uint64_t l_dict = h[2], n_reg = h[3], l_idx = h[4];
+    if (memcmp(m, REGION_INDEX_MAGIC, 8) != 0 || h[0] != len || l_dict % 8 ||
+	l_dict > len || n_reg > len / sizeof(RegionIndexRecord) ||
+	REGION_INDEX_HEADER + l_dict + n_reg * sizeof(RegionIndexRecord) + l_idx != len)
+      return false;
+
+    // the chr IDs are only meaningful with the same dictionary
+    const char* d = m + REGION_INDEX_HEADER;
+    const char* de = d + l_dict;
+    for (uint64_t i = 0; i < h[1]; ++i) {
+      uint32_t l[2];
+      if (de - d < (ptrdiff_t)sizeof(l))
+	return false;
+      memcpy(l, d, sizeof(l));
+      d += sizeof(l);
+      if ((uint64_t)(de - d) < l[1])
+	return false;
+      if (!hdr.isEmpty()) {
+	std::string name(d, l[1]);
+	if (hdr.Name2ID(name) != (int)i || hdr.GetSequenceLength((int)i) != (int)l[0]) {
+	  std::cerr << "Region index " << file << " was made with another dictionary (contig "
+		    << name << ")" << std::endl;
+	  return false;
+	}
+      }
+      d += l[1];
+    }
+
+    const char* idx = de + n_reg * sizeof(RegionIndexRecord);
+    if (fi.Attach(idx, l_idx, keep) != l_idx)
+      return false;
+
+    *regions = reinterpret_cast<const RegionIndexRecord*>(de);
+    *n = n_reg;
+    return true;
+  }
+
+}
@@ -0,0 +1,383 @@
+#include "SeqLib/SeqDecode.h"
+
+#include <atomic>
+
+// x86 kernels are compiled with per-function target attributes and picked
+// at run time, so the library itself does not need to be built with -mavx2
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SEQLIB_X86_KERNELS 1
+#include <immintrin.h>
+#define SEQLIB_SSSE3 __attribute__((target("ssse3")))
+#define SEQLIB_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace SeqLib {
+
+  // 4-bit code to ASCII. Same as BASES in BamRecord.h
+  static const char DEC_TABLE[16] = {' ', 'A', 'C', ' ',
+				     'G', ' ', ' ', ' ',
+				     'T', ' ', ' ', ' ',
+				     ' ', ' ', ' ', 'N'};
+
+  // 4-bit code to ASCII of the complement. Same as RCOMPLEMENT_TABLE on DEC_TABLE
+  static const char COMP_TABLE[16] = {' ', 'T', 'G', ' ',
+				      'C', ' ', ' ', ' ',
+				      'A', ' ', ' ', ' ',
+				      ' ', ' ', ' ', 'N'};
+
+  // ASCII to 4-bit code, for the base and for its complement
+  struct _EncodeTables {
+    _EncodeTables() {
+      for (int i = 0; i < 256; ++i)
+	fwd[i] = rc[i] = 15;
+      fwd['A'] = 1; fwd['C'] = 2; fwd['G'] = 4; fwd['T'] = 8;
+      rc['A'] = 8; rc['C'] = 4; rc['G'] = 2; rc['T'] = 1;
+    }
+    uint8_t fwd[256];
+    uint8_t rc[256];
+  };
+
+  static const _EncodeTables& encode_tables() {
+    static const _EncodeTables t;
+    return t;
+  }
+
+  static SeqDecodeLevel detect_level() {
+#ifdef SEQLIB_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return SEQ_DECODE_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+      return SEQ_DECODE_SSSE3;
+#endif
+    return SEQ_DECODE_SCALAR;
+  }
+
+  // level cap set by the user. -1 until set, meaning use the best
+  static std::atomic<int> s_level(-1);
+
+  SeqDecodeLevel SeqDecodeBestLevel() {
+    static const SeqDecodeLevel best = detect_level();
+    return best;
+  }
+
+  SeqDecodeLevel GetSeqDecodeLevel() {
+    int l = s_level.load(std::memory_order_relaxed);
+    SeqDecodeLevel best = SeqDecodeBestLevel();
+    return (l < 0 || l > best) ? best : static_cast<SeqDecodeLevel>(l);
+  }
+
+  void SetSeqDecodeLevel(SeqDecodeLevel l) {
+    s_level.store(l, std::memory_order_relaxed);
+  }
+
+  //////////////
+  // scalar
+  //////////////
+
+  // decode bases [0, n) of a packed sequence, n even
+  static inline void decode_pairs(const uint8_t* p, size_t n, char* out, const char* table) {
+    for (size_t i = 0; i < n / 2; ++i) {
+      out[2*i]   = table[p[i] >> 4];
+      out[2*i+1] = table[p[i] & 0xf];
+    }
+  }
+
+  // reverse complement of bases [0, n) of a packed sequence, n even,
+  // written to out[0, n)
+  static inline void decode_pairs_rc(const uint8_t* p, size_t n, char* out) {
+    for (size_t i = 0; i < n / 2; ++i) {
+      out[n - 1 - 2*i] = COMP_TABLE[p[i] >> 4];
+      out[n - 2 - 2*i] = COMP_TABLE[p[i] & 0xf];
+    }
+  }
+
+  static inline void encode_pairs(const char* s, size_t n, uint8_t* p, const uint8_t* table) {
+    for (size_t i = 0; i < n / 2; ++i)
+      p[i] = (table[(uint8_t)s[2*i]] << 4) | table[(uint8_t)s[2*i+1]];
+  }
+
+  // pack the reverse complement of s[0, n), n even
+  static inline void encode_pairs_rc(const char* s, size_t n, uint8_t* p, const uint8_t* table) {
+    for (size_t i = 0; i < n / 2; ++i)
+      p[i] = (table[(uint8_t)s[n - 1 - 2*i]] << 4) | table[(uint8_t)s[n - 2 - 2*i]];
+  }
+
+#ifdef SEQLIB_X86_KERNELS
+
+  //////////////
+  // SSE2 / SSSE3, 16 bytes at a time
+  //////////////
+
+  // decode 16 packed bytes into 32 chars
+  SEQLIB_SSSE3 static inline void decode16(const uint8_t* p, const __m128i& table, __m128i& o0, __m128i& o1) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i v  = _mm_loadu_si128((const __m128i*)p);
+    __m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, mask));
+    o0 = _mm_unpacklo_epi8(hi, lo);
+    o1 = _mm_unpackhi_epi8(hi, lo);
+  }
+
+  SEQLIB_SSSE3 static size_t decode_ssse3(const uint8_t* p, size_t n, char* out) {
+    const __m128i table = _mm_loadu_si128((const __m128i*)DEC_TABLE);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+      __m128i o0, o1;
+      decode16(p + i / 2, table, o0, o1);
+      _mm_storeu_si128((__m128i*)(out + i), o0);
+      _mm_storeu_si128((__m128i*)(out + i + 16), o1);
+    }
+    return i;
+  }
+
+  // reverse complement of the first m (even) bases. Returns how many were done,
+  // always the first ones, which land at the end of out[0, m)
+  SEQLIB_SSSE3 static size_t decode_rc_ssse3(const uint8_t* p, size_t m, char* out) {
+    const __m128i table = _mm_loadu_si128((const __m128i*)COMP_TABLE);
+    const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i = 0;
+    for (; i + 32 <= m; i += 32) {
+      __m128i o0, o1;
+      decode16(p + i / 2, table, o0, o1);
+      char* dst = out + m - i - 32;
+      _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(o1, rev));
+      _mm_storeu_si128((__m128i*)(dst + 16), _mm_shuffle_epi8(o0, rev));
+    }
+    return i;
+  }
+
+  SEQLIB_SSSE3 static size_t quals_ssse3(const uint8_t* q, size_t n, int offset, char* out) {
+    const __m128i off = _mm_set1_epi8((char)offset);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(q + i)), off));
+    return i;
+  }
+
+  // ASCII to 4-bit codes, where a/c/g/t give the codes for A/C/G/T
+  SEQLIB_SSSE3 static inline __m128i codes16(__m128i v, int a, int c, int g, int t) {
+    __m128i r = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('A')), _mm_set1_epi8(a)),
+					  _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('C')), _mm_set1_epi8(c))),
+			     _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('G')), _mm_set1_epi8(g)),
+					  _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('T')), _mm_set1_epi8(t))));
+    // everything else is N
+    return _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi8(r, _mm_setzero_si128()), _mm_set1_epi8(15)));
+  }
+
+  // pack 32 codes into 16 bytes, first of each pair in the high nibble
+  SEQLIB_SSSE3 static inline __m128i pack32(__m128i a, __m128i b) {
+    const __m128i himask = _mm_set1_epi16(0x00f0);
+    __m128i pa = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(a, 4), himask), _mm_srli_epi16(a, 8));
+    __m128i pb = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(b, 4), himask), _mm_srli_epi16(b, 8));
+    return _mm_packus_epi16(pa, pb);
+  }
+
+  SEQLIB_SSSE3 static size_t encode_ssse3(const char* s, size_t n, uint8_t* p) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+      __m128i a = codes16(_mm_loadu_si128((const __m128i*)(s + i)), 1, 2, 4, 8);
+      __m128i b = codes16(_mm_loadu_si128((const __m128i*)(s + i + 16)), 1, 2, 4, 8);
+      _mm_storeu_si128((__m128i*)(p + i / 2), pack32(a, b));
+    }
+    return i;
+  }
+
+  // reverse complement of the last m chars of s[0, n), into the first m/2 bytes of p
+  SEQLIB_SSSE3 static size_t encode_rc_ssse3(const char* s, size_t n, uint8_t* p) {
+    const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+      const char* src = s + n - i - 32;
+      __m128i a = codes16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 16)), rev), 8, 4, 2, 1);
+      __m128i b = codes16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), rev), 8, 4, 2, 1);
+      _mm_storeu_si128((__m128i*)(p + i / 2), pack32(a, b));
+    }
+    return i;
+  }
+
+  //////////////
+  // AVX2, 32 bytes at a time
+  //////////////
+
+  // decode 32 packed bytes into 64 chars, in order
+  SEQLIB_AVX2 static inline void decode32(const uint8_t* p, const __m256i& table, __m256i& o0, __m256i& o1) {
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i v  = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, mask));
+    // unpack works within 128 bit lanes, so put the lanes back in order
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    o0 = _mm256_permute2x128_si256(a, b, 0x20);
+    o1 = _mm256_permute2x128_si256(a, b, 0x31);
+  }
+
+  // reverse the 32 bytes of v
+  SEQLIB_AVX2 static inline __m256i reverse32(__m256i v) {
+    const __m256i rev = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+					0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    v = _mm256_shuffle_epi8(v, rev);
+    return _mm256_permute2x128_si256(v, v, 0x01);
+  }
+
+  SEQLIB_AVX2 static size_t decode_avx2(const uint8_t* p, size_t n, char* out) {
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)DEC_TABLE));
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+      __m256i o0, o1;
+      decode32(p + i / 2, table, o0, o1);
+      _mm256_storeu_si256((__m256i*)(out + i), o0);
+      _mm256_storeu_si256((__m256i*)(out + i + 32), o1);
+    }
+    return i;
+  }
+
+  SEQLIB_AVX2 static size_t decode_rc_avx2(const uint8_t* p, size_t m, char* out) {
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)COMP_TABLE));
+    size_t i = 0;
+    for (; i + 64 <= m; i += 64) {
+      __m256i o0, o1;
+      decode32(p + i / 2, table, o0, o1);
+      char* dst = out + m - i - 64;
+      _mm256_storeu_si256((__m256i*)dst, reverse32(o1));
+      _mm256_storeu_si256((__m256i*)(dst + 32), reverse32(o0));
+    }
+    return i;
+  }
+
+  SEQLIB_AVX2 static size_t quals_avx2(const uint8_t* q, size_t n, int offset, char* out) {
+    const __m256i off = _mm256_set1_epi8((char)offset);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(q + i)), off));
+    return i;
+  }
+
+  SEQLIB_AVX2 static inline __m256i codes32(__m256i v, int a, int c, int g, int t) {
+    __m256i r = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('A')), _mm256_set1_epi8(a)),
+						_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('C')), _mm256_set1_epi8(c))),
+				_mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('G')), _mm256_set1_epi8(g)),
+						_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('T')), _mm256_set1_epi8(t))));
+    return _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpeq_epi8(r, _mm256_setzero_si256()), _mm256_set1_epi8(15)));
+  }
+
+  // pack 64 codes into 32 bytes
+  SEQLIB_AVX2 static inline __m256i pack64(__m256i a, __m256i b) {
+    const __m256i himask = _mm256_set1_epi16(0x00f0);
+    __m256i pa = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(a, 4), himask), _mm256_srli_epi16(a, 8));
+    __m256i pb = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(b, 4), himask), _mm256_srli_epi16(b, 8));
+    // packus works within lanes, giving a0 b0 a1 b1. Reorder to a0 a1 b0 b1
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(pa, pb), 0xD8);
+  }
+
+  SEQLIB_AVX2 static size_t encode_avx2(const char* s, size_t n, uint8_t* p) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+      __m256i a = codes32(_mm256_loadu_si256((const __m256i*)(s + i)), 1, 2, 4, 8);
+      __m256i b = codes32(_mm256_loadu_si256((const __m256i*)(s + i + 32)), 1, 2, 4, 8);
+      _mm256_storeu_si256((__m256i*)(p + i / 2), pack64(a, b));
+    }
+    return i;
+  }
+
+  SEQLIB_AVX2 static size_t encode_rc_avx2(const char* s, size_t n, uint8_t* p) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+      const char* src = s + n - i - 64;
+      __m256i a = codes32(reverse32(_mm256_loadu_si256((const __m256i*)(src + 32))), 8, 4, 2, 1);
+      __m256i b = codes32(reverse32(_mm256_loadu_si256((const __m256i*)src)), 8, 4, 2, 1);
+      _mm256_storeu_si256((__m256i*)(p + i / 2), pack64(a, b));
+    }
+    return i;
+  }
+
+#endif
+
+  //////////////
+  // dispatch. Vector kernels do the bulk, and return how far they got
+  //////////////
+
+  void DecodeBases(const uint8_t* packed, size_t n, char* out) {
+    size_t i = 0;
+#ifdef SEQLIB_X86_KERNELS
+    switch (GetSeqDecodeLevel()) {
+    case SEQ_DECODE_AVX2: i = decode_avx2(packed, n, out); break;
+    case SEQ_DECODE_SSSE3: i = decode_ssse3(packed, n, out); break;
+    default: break;
+    }
+#endif
+    decode_pairs(packed + i / 2, n - i, out + i, DEC_TABLE);
+    if (n & 1)
+      out[n - 1] = DEC_TABLE[packed[n / 2] >> 4];
+  }
+
+  void DecodeBasesRevComp(const uint8_t* packed, size_t n, char* out) {
+
+    // an odd last base is the high nibble of the last byte, and goes first.
+    // The rest is an even number of bases, so whole bytes
+    if (n & 1)
+      out[0] = COMP_TABLE[packed[n / 2] >> 4];
+    size_t m = n & ~(size_t)1;
+    char* o = out + (n & 1);
+
+    size_t i = 0;
+#ifdef SEQLIB_X86_KERNELS
+    switch (GetSeqDecodeLevel()) {
+    case SEQ_DECODE_AVX2: i = decode_rc_avx2(packed, m, o); break;
+    case SEQ_DECODE_SSSE3: i = decode_rc_ssse3(packed, m, o); break;
+    default: break;
+    }
+#endif
+    // bases [i, m) go to o[0, m - i)
+    decode_pairs_rc(packed + i / 2, m - i, o);
+  }
+
+  void DecodeQualities(const uint8_t* qual, size_t n, int offset, char* out) {
+    size_t i = 0;
+#ifdef SEQLIB_X86_KERNELS
+    switch (GetSeqDecodeLevel()) {
+    case SEQ_DECODE_AVX2: i = quals_avx2(qual, n, offset, out); break;
+    case SEQ_DECODE_SSSE3: i = quals_ssse3(qual, n, offset, out); break;
+    default: break;
+    }
+#endif
+    for (; i < n; ++i)
+      out[i] = (char)(qual[i] + offset);
+  }
+
+  void EncodeBases(const char* seq, size_t n, uint8_t* packed) {
+    const uint8_t* table = encode_tables().fwd;
+    size_t i = 0;
+#ifdef SEQLIB_X86_KERNELS
+    switch (GetSeqDecodeLevel()) {
+    case SEQ_DECODE_AVX2: i = encode_avx2(seq, n, packed); break;
+    case SEQ_DECODE_SSSE3: i = encode_ssse3(seq, n, packed); break;
+    default: break;
+    }
+#endif
+    encode_pairs(seq + i, n - i, packed + i / 2, table);
+    if (n & 1)
+      packed[n / 2] = table[(uint8_t)seq[n - 1]] << 4;
+  }
+
+  void EncodeBasesRevComp(const char* seq, size_t n, uint8_t* packed) {
+    const uint8_t* table = encode_tables().rc;
+
+    // vector kernels take whole blocks off the end of seq
+    size_t i = 0;
+#ifdef SEQLIB_X86_KERNELS
+    switch (GetSeqDecodeLevel()) {
+    case SEQ_DECODE_AVX2: i = encode_rc_avx2(seq, n, packed); break;
+    case SEQ_DECODE_SSSE3: i = encode_rc_ssse3(seq, n, packed); break;
+    default: break;
+    }
+#endif
+    // what's left is seq[0, n - i), whose reverse complement fills the rest
+    size_t r = n - i;
+    encode_pairs_rc(seq + (r & 1), r & ~(size_t)1, packed + i / 2, table);
+    if (r & 1)
+      packed[n / 2] = table[(uint8_t)seq[0]] << 4;
+  }
+
+}
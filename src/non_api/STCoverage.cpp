@@ -1,62 +1,116 @@
-#include "SeqLib/STCoverage.h"
+#include "STCoverage.h"
 #include "SeqLib/SeqLibCommon.h"
 #include <stdexcept>
 #include <algorithm>
+#include <fstream>
 
 namespace SeqLib {
 
-  void STCoverage::clear() {
-    m_map.clear();
+  static const size_t STCOV_MASK = STCOV_CHUNK - 1;
+
+  // add a pending d at position p of a track
+  static inline void cov_bump(CovTrack& t, size_t p, int32_t d) {
+    size_t c = p >> STCOV_CHUNK_BITS;
+    if (c >= t.diff.size())
+      t.diff.resize(c + 1);
+    if (t.diff[c].empty())
+      t.diff[c].assign(STCOV_CHUNK, 0);
+    t.diff[c][p & STCOV_MASK] += d;
+    if (t.lo == (size_t)-1 || c < t.lo)
+      t.lo = c;
+    if (c > t.hi)
+      t.hi = c;
   }
 
-  void STCoverage::settleCoverage() {
-    GRC tmp = m_grc;
-    m_grc.mergeOverlappingIntervals();
-  }
-  
-  STCoverage::STCoverage(const SeqLib::GenomicRegion& gr) {
-    m_gr = gr;
-    v = uint16_sp(new std::vector<uint16_t>(gr.width(),0));
-  }
+  // prefix sum the pending edits of a track into its coverage. Every read
+  // adds as much as it takes away, so there is nothing to carry in from
+  // before the first edited block or out past the last one. The edit blocks
+  // are zeroed as they are read, so the next window of reads reuses them
+  static void cov_settle(CovTrack& t) {
 
-  uint16_t STCoverage::maxCov() const {
-    return (*std::max_element(v->begin(), v->end()));
+    if (t.lo == (size_t)-1)
+      return;
+
+    if (t.cov.size() <= t.hi)
+      t.cov.resize(t.hi + 1);
+
+    int32_t carry = 0;
+    for (size_t c = t.lo; c <= t.hi; ++c) {
+      CovChunk& d = t.diff[c];
+      if (d.empty() && !carry) // nothing pending here
+	continue;
+      CovChunk& a = t.cov[c];
+      if (a.empty())
+	a.assign(STCOV_CHUNK, 0);
+      if (d.empty()) { // a read spans the whole block
+	for (size_t i = 0; i < STCOV_CHUNK; ++i)
+	  a[i] += carry;
+      } else {
+	for (size_t i = 0; i < STCOV_CHUNK; ++i) {
+	  carry += d[i];
+	  a[i] += carry;
+	  d[i] = 0;
+	}
+      }
+    }
+    assert(carry == 0);
+
+    t.lo = -1;
+    t.hi = 0;
   }
 
-  /*void STCoverage::addRead2(const BamRecord& r) {
+  void STCoverage::clear() {
+    m_cov.clear();
+    m_pending = false;
+  }
 
-    int p = r.Position();
-    int e = r.PositionEnd();
+  void STCoverage::settleCoverage() const {
 
-    if (p < 0 || e < 0)
+    if (!m_pending)
       return;
 
-    if (p < m_gr.pos1 || e > m_gr.pos2)
-      return;
+    for (std::vector<CovTrack>::iterator t = m_cov.begin(); t != m_cov.end(); ++t)
+      cov_settle(*t);
+    m_pending = false;
+  }
+
+  void STCoverage::add_block(int chr, int p, int e) {
 
-    if (r.ChrID() != m_gr.chr)
+    if (chr < 0 || p < 0 || e < p)
       return;
 
-    assert(p - m_gr.pos1 < v->size());
-    ++v[p - m_gr.pos1];
-    }
-  */
+    if (chr >= (int)m_cov.size())
+      m_cov.resize(chr + 1);
+
+    CovTrack& t = m_cov[chr];
+    cov_bump(t, p, 1);
+    cov_bump(t, (size_t)e + 1, -1);
+    m_pending = true;
+  }
+
+  STCoverage::STCoverage(const SeqLib::GenomicRegion& gr) : m_pending(false) {
+    m_gr = gr;
+  }
+
+  int STCoverage::maxCov() const {
+
+    settleCoverage();
+
+    int32_t m = 0;
+    for (std::vector<CovTrack>::const_iterator t = m_cov.begin(); t != m_cov.end(); ++t)
+      for (std::vector<CovChunk>::const_iterator c = t->cov.begin(); c != t->cov.end(); ++c)
+	if (!c->empty())
+	  m = std::max(m, *std::max_element(c->begin(), c->end()));
+    return m;
+  }
+
   void STCoverage::addRead(const BamRecord &r, int buff, bool full_length) {
-    
-    //m_settled = false;
-    //m_grc.add(GenomicRegion(r.ChrID(), r.Position(), r.PositionEnd()));
-    
-    // out of bounds
-    //if (r.Position() < m_gr.pos1 || r.PositionEnd() > m_gr.pos2 || r.ChrID() != m_gr.chr)
-    //  return;
-
-    //int p = std::min(r.Position() - m_gr.pos1, m_gr.pos2);
-    //int e = std::min(r.PositionEnd() - m_gr.pos1, m_gr.pos2);
-    int p = -1; 
+
+    int p = -1;
     int e = -1;
 
     if (full_length) {
-      Cigar c = r.GetCigar();
+      CigarView c = r.GetCigarView();
       // get beginning
       if (c.size() && c[0].RawType() == BAM_CSOFT_CLIP)
 	p = std::max((int32_t)0, r.Position() - (int32_t)c[0].Length()); // get prefixing S
@@ -76,103 +130,107 @@ namespace SeqLib {
     if (p < 0 || e < 0)
       return;
 
-    // if we don't have an empty map for this, add
-    if (r.ChrID() >= (int)m_map.size()) {
-      int k = m_map.size();
-      while (k <= r.ChrID()) {
-	m_map.push_back(CovMap());
-	//m_map.back().reserve(reserve_size);
-	++k;
-      }
-    }
-
     assert(e - p < 1e6); // limit on read length
-    assert(r.ChrID() >= 0);
-    assert(r.ChrID() < (int)m_map.size());
-
-    try {
-       while (p <= e) {
-	//CovMap::iterator iter = m_map.find(p);
-	++(m_map[r.ChrID()][p]); // add one to this position
-	++p;
-	//if (v->at(p) < 60000) // 60000 is roughly int16 lim
-	//  v->at(p)++;
-	//++p;
-	
-      }
-    } catch (std::out_of_range &oor) {
-      std::cerr << "Position " << p << " on tid " << r.ChrID()
-		<< " is greater than expected max of " << v->size() << " -- skipping" << std::endl;
-      
+
+    add_block(r.ChrID(), p, e);
+  }
+
+  void STCoverage::addReadBlocks(const BamRecord &r) {
+
+    int32_t pos = r.Position();
+    if (pos < 0 || r.ChrID() < 0)
+      return;
+
+    CigarView c = r.GetCigarView();
+    for (CigarView::const_iterator i = c.begin(); i != c.end(); ++i) {
+      CigarField f = *i;
+      if (!f.ConsumesReference())
+	continue;
+      uint8_t op = f.RawType();
+      if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF)
+	add_block(r.ChrID(), pos, pos + (int32_t)f.Length() - 1);
+      pos += f.Length();
     }
-    
   }
-  
+
   std::ostream& operator<<(std::ostream &out, const STCoverage &c) {
-    out << "Region " << c.m_gr << " v.size() " << c.v->size() << std::endl;
+    size_t n = 0;
+    for (std::vector<CovTrack>::const_iterator t = c.m_cov.begin(); t != c.m_cov.end(); ++t)
+      for (std::vector<CovChunk>::const_iterator k = t->cov.begin(); k != t->cov.end(); ++k)
+	n += k->size();
+    out << "Region " << c.m_gr << " contigs " << c.m_cov.size() << " bases stored " << n << std::endl;
     return out;
   }
 
   void STCoverage::ToBedgraph(std::ofstream * o, const bam_hdr_t * h) const {
 
-    //settleCoverage();
+    settleCoverage();
 
-    // unitialized so nothing to do
-    if (m_gr.chr == -1 || v->size() == 0)
-      return;
+    int c0 = 0;
+    int c1 = m_cov.size();
+    if (m_gr.chr >= 0) { // just the region
+      c0 = m_gr.chr;
+      c1 = std::min(c1, m_gr.chr + 1);
+    }
+
+    for (int chr = c0; chr < c1; ++chr) {
 
-    size_t curr_start = 0;
-    size_t curr_val = v->at(0);
-    for (size_t i = 0; i < v->size(); ++i) {
-      if (v->at(i) != curr_val) {
-	(*o) << m_gr.ChrName(h) << "\t" << (curr_start + m_gr.pos1) << "\t" << (i+m_gr.pos1) << "\t" << curr_val << std::endl;
-	curr_start = i;
-	curr_val = v->at(i);
+      const std::vector<CovChunk>& t = m_cov[chr].cov;
+      size_t b = 0;
+      size_t e = t.size() * STCOV_CHUNK;
+      if (m_gr.chr >= 0) {
+	b = std::max(0, m_gr.pos1);
+	e = std::min(e, (size_t)std::max(0, m_gr.pos2) + 1);
       }
+
+      std::string name = (h && chr < h->n_targets) ? std::string(h->target_name[chr]) : std::to_string(chr + 1);
+
+      // runs of equal coverage, skipping whole blocks without any
+      size_t run = b;
+      int32_t val = 0;
+      size_t p = b;
+      while (p < e) {
+	size_t c = p >> STCOV_CHUNK_BITS;
+	size_t ce = std::min(e, (c + 1) << STCOV_CHUNK_BITS);
+	if (t[c].empty()) {
+	  if (val)
+	    (*o) << name << "\t" << run << "\t" << p << "\t" << val << std::endl;
+	  run = ce;
+	  val = 0;
+	  p = ce;
+	  continue;
+	}
+	const int32_t* a = &t[c][0];
+	for (; p < ce; ++p) {
+	  int32_t v = a[p & STCOV_MASK];
+	  if (v != val) {
+	    if (val)
+	      (*o) << name << "\t" << run << "\t" << p << "\t" << val << std::endl;
+	    run = p;
+	    val = v;
+	  }
+	}
+      }
+
+      // need to dump last one
+      if (val)
+	(*o) << name << "\t" << run << "\t" << e << "\t" << val << std::endl;
     }
-    
-    // need to dump last one
-    if ( (curr_start+1) != v->size()) 
-      (*o) << m_gr.ChrName(h) << "\t" << (curr_start + m_gr.pos1) << "\t" << (v->size()+m_gr.pos1-1) << "\t" << curr_val << std::endl;
   }
-  
+
   int STCoverage::getCoverageAtPosition(int chr, int pos) const {
 
-    //CovMapMap::iterator it = m_map.find(chr);
-    //if (it == m_map.end())
-    //  return 0;
-    if (chr >= (int)m_map.size())
-      return 0;
-    
-    //std::cerr << " MAP " << std::endl;
-    //for (auto& i : m_map)
-    //  std::cerr << i.first << " " << i.second << std::endl;
-    
-    //if (!m_settled)
-    //  settleCoverage();
-
-    //if (pos < m_gr.pos1 || pos > m_gr.pos2) {
-      //std::cerr << "Coverage query out of bounds for location " << m_gr.chr << ":" << pos << std::endl;
-    //  return 0;
-    //}
-    
-    //size_t q = pos - m_gr.pos1;
-    //if (q >= v->size()) {
-    // std::cerr << "Coverage query out of bounds for location " << m_gr.chr << ":" << pos << " with pos-start of " << q << " attempt on v of size " << v->size() << std::endl;
-    //  return 0;
-    //}
-    //return it->second[pos];
-    
-    CovMap::const_iterator ff = m_map[chr].find(pos);
-    if (ff == m_map[chr].end()) {
+    if (chr < 0 || chr >= (int)m_cov.size() || pos < 0)
       return 0;
-    }
 
-    return ff->second;
+    settleCoverage();
 
-    //return (v->at(q));
-    
+    const std::vector<CovChunk>& t = m_cov[chr].cov;
+    size_t c = (size_t)pos >> STCOV_CHUNK_BITS;
+    if (c >= t.size() || t[c].empty())
+      return 0;
 
-}
+    return t[c][pos & STCOV_MASK];
+  }
 
 }
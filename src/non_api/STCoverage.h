@@ -2,13 +2,10 @@
 #define SNOWMAN_SEQLIB_COVERAGE_H__
 
 #include <memory>
-#include <unordered_map>
 #include <vector>
 #include <cstdint>
-#include <vector>
 #include <cassert> 
 #include <iostream>
-#include <memory>
 
 #include "htslib/hts.h"
 #include "htslib/sam.h"
@@ -19,53 +16,77 @@
 #include "SeqLib/GenomicRegion.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
-typedef std::shared_ptr<std::vector<uint16_t>> uint16_sp;
-typedef std::unordered_map<int,int> CovMap;
-//typedef std::unordered_map<int,CovMap> CovMapMap;
-
 namespace SeqLib {
 
+  // bases per block of a coverage track
+  static const size_t STCOV_CHUNK_BITS = 14;
+  static const size_t STCOV_CHUNK = 1 << STCOV_CHUNK_BITS;
 
-  
-  /** Hold base-pair or binned coverage across an interval or genome
+  typedef std::vector<int32_t> CovChunk; // one block. Empty = all zero
+
+  // coverage of one contig
+  struct CovTrack {
+
+    CovTrack() : lo(-1), hi(0) {}
+
+    std::vector<CovChunk> cov; // settled coverage
+    std::vector<CovChunk> diff; // +1 / -1 edits from reads not yet settled (zeroed when settled)
+    size_t lo; // first block with a pending edit (-1 if none)
+    size_t hi; // last block with a pending edit
+  };
+
+  /** Hold base-pair coverage across an interval or genome
    *
-   * Currently stores coverage as an unordered_map.
+   * Each contig is a dense array of counts, split into blocks of STCOV_CHUNK
+   * bases that are only allocated once a read lands in them. Reads are added
+   * to a separate difference array (+1 at the start, -1 past the end), so a
+   * read costs two updates however long it is. The first query after adding
+   * reads prefix sums the pending differences into the coverage, over just the
+   * blocks between the first and last edit of each contig. So adding a window
+   * of reads and querying it costs the size of the window, not the genome.
    */
 class STCoverage {
   
  private:
 
-  GRC m_grc;
   GenomicRegion m_gr;
 
-  //CovMapMap m_map;
-  std::vector<CovMap> m_map;
-
-  uint16_sp v;
+  // per contig coverage, and pending reads
+  mutable std::vector<CovTrack> m_cov;
+  mutable bool m_pending;
 
+  // add one to the coverage of [p, e] on chr
+  void add_block(int chr, int p, int e);
 
  public:
 
   /** Clear the coverage map */
   void clear();
 
-
-  /** */
-  void settleCoverage();
+  /** Add the pending reads into the coverage. Done by the first query after 
+   * adding reads, so only needed to control when the work happens */
+  void settleCoverage() const;
       
-  /** Add a read to this coverage track 
-   * @param reserve_size Upper bound estimate for size of map. Not a hard
-   *   cutoff but improves performance if total number of positions is less than this, 
-   *   as it will not rehash. */
+  /** Add a read to this coverage track, from start to end
+   * @param r Read to add. Unmapped reads are skipped
+   * @param buff Bases to trim from each end of the alignment
+   * @param full_length Extend the read over its leading and trailing soft clips (buff is then ignored)
+   */
   void addRead(const BamRecord &r, int buff, bool full_length);
 
-  /** Make a new coverage object at interval gr */
+  /** Add the aligned blocks of a read (M, = and X), leaving out deletions and skips
+   * @param r Read to add. Unmapped reads are skipped
+   */
+  void addReadBlocks(const BamRecord &r);
+
+  /** Make a new coverage object at interval gr. ToBedgraph only prints this interval */
   STCoverage(const GenomicRegion& gr);
 
-  uint16_t maxCov() const;
+  /** Return the highest coverage at any position */
+  int maxCov() const;
 
   /** Make an empty coverage */
-  STCoverage() {}
+  STCoverage() : m_pending(false) {}
 
   /*! Add to coverage objects together to get total coverge 
    * 
@@ -73,7 +94,7 @@ class STCoverage {
    */
   //void combineCoverage(Coverage &cov);
 
-  /** Return a short summary string of this coverage object */
+  /** Write the runs of equal, non-zero coverage as bedgraph (0-based, half-open) */
   void ToBedgraph(std::ofstream * o, const bam_hdr_t * h) const;
   
   /** Print the entire data */